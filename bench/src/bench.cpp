@@ -0,0 +1,343 @@
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+#include "huffman.h"
+
+namespace huffman_algo {
+
+class Benchmark final {
+public:
+    static int run(int argc, char *argv[]);
+
+private:
+    struct Result {
+        std::string corpus;
+        std::size_t size;
+        std::string phase;
+        unsigned threads;
+        double seconds;
+    };
+
+    static constexpr std::size_t PATTERN_SIZE = 1 << 20;
+    static constexpr double MIN_MEASURE_TIME = 0.02;
+    static constexpr std::array<const char *, 5> CORPORA = {"uniform", "zipfian", "single", "text", "binary"};
+
+    static std::size_t parse_size(const std::string &value, const std::string &name);
+    static std::vector<unsigned char> generate(const std::string &corpus, std::size_t size);
+    static void generate_pattern(const std::string &corpus, std::vector<unsigned char> &data, std::mt19937_64 &random);
+    static double measure(const std::function<void()> &task, unsigned repeat);
+    static void write_file(const std::filesystem::path &path, const std::vector<unsigned char> &data);
+    static void print_csv(const std::vector<Result> &results);
+    static void print_json(const std::vector<Result> &results);
+};
+
+std::size_t Benchmark::parse_size(const std::string &value, const std::string &name) {
+    std::size_t digits = value.size();
+    std::size_t multiplier = 1;
+    if (digits && (value.back() == 'K' || value.back() == 'M' || value.back() == 'G')) {
+        multiplier = value.back() == 'K' ? std::size_t(1) << 10 : value.back() == 'M' ? std::size_t(1) << 20
+                                                                                       : std::size_t(1) << 30;
+        --digits;
+    }
+    if (!digits || digits > 9 || value.find_first_not_of("0123456789") < digits) {
+        throw std::invalid_argument("Invalid " + name + ": \"" + value + "\"");
+    }
+    return std::stoull(value.substr(0, digits)) * multiplier;
+}
+
+std::vector<unsigned char> Benchmark::generate(const std::string &corpus, std::size_t size) {
+    std::mt19937_64 random(size);
+    std::vector<unsigned char> data(std::min(size, PATTERN_SIZE));
+    generate_pattern(corpus, data, random);
+    data.resize(size);
+    for (std::size_t i = PATTERN_SIZE; i < size; i += PATTERN_SIZE) {
+        std::copy_n(data.begin(), std::min(PATTERN_SIZE, size - i), data.begin() + i);
+    }
+    return data;
+}
+
+void Benchmark::generate_pattern(const std::string &corpus, std::vector<unsigned char> &data,
+                                 std::mt19937_64 &random) {
+    if (corpus == "uniform") {
+        std::uniform_int_distribution<unsigned> byte(0, UCHAR_MAX);
+        for (unsigned char &chr: data) {
+            chr = byte(random);
+        }
+    } else if (corpus == "zipfian") {
+        std::vector<double> weights(UCHAR_MAX + 1);
+        for (std::size_t i = 0; i < weights.size(); ++i) {
+            weights[i] = 1.0 / double(i + 1);
+        }
+        std::discrete_distribution<unsigned> byte(weights.begin(), weights.end());
+        for (unsigned char &chr: data) {
+            chr = byte(random);
+        }
+    } else if (corpus == "single") {
+        std::fill(data.begin(), data.end(), 'a');
+    } else if (corpus == "text") {
+        static const std::vector<std::string> words = {
+                "the", "of", "and", "to", "a", "in", "that", "he", "was", "it", "his", "with", "had", "is", "as",
+                "for", "her", "not", "at", "on", "but", "be", "she", "by", "him", "they", "you", "all", "from",
+                "said", "which", "were", "this", "what", "have", "so", "one", "there", "or", "their", "would",
+                "been", "when", "an", "who", "them", "no", "then", "prince", "could", "into", "now", "did", "up",
+                "out", "are", "more", "will", "do", "about", "only", "me", "my", "if", "pierre", "natasha",
+                "moscow", "army", "emperor", "countess", "looked", "face", "eyes", "began", "thought", "old",
+                "man", "time", "without", "again", "room", "know", "went", "over", "very", "how", "little"};
+        std::vector<double> weights(words.size());
+        for (std::size_t i = 0; i < weights.size(); ++i) {
+            weights[i] = 1.0 / double(i + 1);
+        }
+        std::discrete_distribution<std::size_t> word(weights.begin(), weights.end());
+        std::uniform_int_distribution<unsigned> punctuation(0, 15);
+        std::string text;
+        std::size_t line_length = 0;
+        bool capitalize = true;
+        while (text.size() < data.size()) {
+            std::string next = words[word(random)];
+            if (capitalize) {
+                next[0] = char(next[0] - 'a' + 'A');
+                capitalize = false;
+            }
+            unsigned mark = punctuation(random);
+            if (mark == 0) {
+                next += '.';
+                capitalize = true;
+            } else if (mark == 1) {
+                next += ',';
+            }
+            line_length += next.size() + 1;
+            text += next;
+            text += line_length > 72 ? '\n' : ' ';
+            if (line_length > 72) {
+                line_length = 0;
+            }
+        }
+        std::copy_n(text.begin(), data.size(), data.begin());
+    } else if (corpus == "binary") {
+        static const std::vector<unsigned char> opcodes = {
+                0x48, 0x89, 0x8b, 0xe8, 0x0f, 0x83, 0x85, 0x74, 0x75, 0xc3, 0x31, 0x41, 0x4c, 0x8d, 0xeb, 0x39,
+                0x3b, 0x01, 0x29, 0xff, 0xc7, 0x66, 0x44, 0x49, 0x84, 0x5d, 0x55, 0x53, 0x5b, 0x50, 0x58, 0xb8};
+        std::vector<double> weights(opcodes.size());
+        for (std::size_t i = 0; i < weights.size(); ++i) {
+            weights[i] = 1.0 / double(i + 1);
+        }
+        std::discrete_distribution<std::size_t> opcode(weights.begin(), weights.end());
+        std::uniform_int_distribution<unsigned> kind(0, 15);
+        std::uniform_int_distribution<unsigned> byte(0, UCHAR_MAX);
+        std::geometric_distribution<unsigned> small(0.1);
+        std::size_t i = 0;
+        auto put = [&](unsigned char chr) {
+            if (i < data.size()) {
+                data[i++] = chr;
+            }
+        };
+        while (i < data.size()) {
+            unsigned instruction = kind(random);
+            put(opcodes[opcode(random)]);
+            if (instruction < 6) {
+                put(byte(random));
+            } else if (instruction < 10) {
+                put((unsigned char)std::min(small(random), unsigned(UCHAR_MAX)));
+            } else if (instruction < 13) {
+                uint32_t address = byte(random) | byte(random) << 8 | (byte(random) & 0x3) << 16;
+                for (std::size_t j = 0; j < sizeof(address); ++j) {
+                    put((unsigned char)(address >> (j * CHAR_BIT)));
+                }
+            } else if (instruction == 15) {
+                std::size_t padding = small(random) % 16;
+                unsigned char filler = byte(random) % 2 ? 0x00 : 0xcc;
+                for (std::size_t j = 0; j < padding; ++j) {
+                    put(filler);
+                }
+            }
+        }
+    } else {
+        throw std::invalid_argument("Unknown corpus: \"" + corpus + "\"");
+    }
+}
+
+double Benchmark::measure(const std::function<void()> &task, unsigned repeat) {
+    task();
+    double best = 0;
+    for (unsigned i = 0; i < repeat; ++i) {
+        std::size_t iterations = 0;
+        auto start = std::chrono::steady_clock::now();
+        double elapsed;
+        do {
+            task();
+            ++iterations;
+            elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        } while (elapsed < MIN_MEASURE_TIME);
+        double seconds = elapsed / double(iterations);
+        best = i ? std::min(best, seconds) : seconds;
+    }
+    return best;
+}
+
+void Benchmark::write_file(const std::filesystem::path &path, const std::vector<unsigned char> &data) {
+    std::ofstream out(path, std::ios_base::binary);
+    out.write((const char *)data.data(), std::streamsize(data.size()));
+    if (!out) {
+        throw std::runtime_error("Couldn't write file \"" + path.string() + "\".");
+    }
+}
+
+void Benchmark::print_csv(const std::vector<Result> &results) {
+    std::cout << "corpus,size,phase,threads,seconds,mb_per_s\n";
+    for (const Result &result: results) {
+        std::cout << result.corpus << ',' << result.size << ',' << result.phase << ',' << result.threads << ','
+                  << result.seconds << ',' << double(result.size) / result.seconds / 1e6 << '\n';
+    }
+}
+
+void Benchmark::print_json(const std::vector<Result> &results) {
+    std::cout << "[\n";
+    for (std::size_t i = 0; i < results.size(); ++i) {
+        const Result &result = results[i];
+        std::cout << "  {\"corpus\": \"" << result.corpus << "\", \"size\": " << result.size << ", \"phase\": \""
+                  << result.phase << "\", \"threads\": " << result.threads << ", \"seconds\": " << result.seconds
+                  << ", \"mb_per_s\": " << double(result.size) / result.seconds / 1e6 << '}'
+                  << (i + 1 < results.size() ? ",\n" : "\n");
+    }
+    std::cout << "]\n";
+}
+
+int Benchmark::run(int argc, char *argv[]) {
+    std::string format = "csv";
+    std::size_t min_size = std::size_t(1) << 10;
+    std::size_t max_size = std::size_t(32) << 20;
+    unsigned repeat = 3;
+    unsigned max_threads = std::max(std::thread::hardware_concurrency(), 1u);
+    std::vector<std::string> corpora;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--format" && i < argc - 1) {
+            format = argv[++i];
+        } else if (arg == "--min-size" && i < argc - 1) {
+            min_size = parse_size(argv[++i], "minimum size");
+        } else if (arg == "--max-size" && i < argc - 1) {
+            max_size = parse_size(argv[++i], "maximum size");
+        } else if (arg == "--repeat" && i < argc - 1) {
+            repeat = parse_size(argv[++i], "repeat count");
+        } else if (arg == "--threads" && i < argc - 1) {
+            max_threads = parse_size(argv[++i], "thread count");
+        } else if (arg == "--corpus" && i < argc - 1) {
+            corpora.emplace_back(argv[++i]);
+        } else {
+            throw std::invalid_argument("Invalid argument: \"" + arg + "\"");
+        }
+    }
+    if (format != "csv" && format != "json") {
+        throw std::invalid_argument("Invalid format: \"" + format + "\"");
+    }
+    if (!min_size || min_size > max_size || !repeat || !max_threads) {
+        throw std::invalid_argument("Invalid benchmark parameters.");
+    }
+    if (corpora.empty()) {
+        corpora.assign(CORPORA.begin(), CORPORA.end());
+    }
+    std::vector<unsigned> thread_counts;
+    for (unsigned threads = 1; threads < max_threads; threads *= 2) {
+        thread_counts.push_back(threads);
+    }
+    thread_counts.push_back(max_threads);
+
+    std::filesystem::path directory;
+    std::random_device device;
+    do {
+        directory = std::filesystem::temp_directory_path() / ("hw_02_bench." + std::to_string(device()));
+    } while (!std::filesystem::create_directory(directory));
+    struct DirectoryRemover {
+        const std::filesystem::path &path;
+        ~DirectoryRemover() {
+            std::error_code error;
+            std::filesystem::remove_all(path, error);
+        }
+    } directory_remover{directory};
+    std::filesystem::path in_path = directory / "hw_02_bench.in";
+    std::filesystem::path zip_path = directory / "hw_02_bench.huf";
+    std::filesystem::path out_path = directory / "hw_02_bench.out";
+    std::vector<Result> results;
+    for (const std::string &corpus: corpora) {
+        for (std::size_t size = min_size; size <= max_size; size *= 32) {
+            std::vector<unsigned char> data = generate(corpus, size);
+            std::span<const std::byte> input((const std::byte *)data.data(), data.size());
+            auto add = [&](const std::string &phase, unsigned threads, double seconds) {
+                results.push_back({corpus, size, phase, threads, seconds});
+            };
+
+            std::array<uint64_t, UCHAR_MAX + 1> vocabulary{};
+            for (unsigned threads: thread_counts) {
+                add("histogram", threads, measure([&]() {
+                    vocabulary.fill(0);
+                    HuffmanArchiver::count_bytes_parallel(data.data(), data.size(), threads, vocabulary);
+                }, repeat));
+            }
+            std::array<uint8_t, UCHAR_MAX + 1> code_lengths{};
+            uint64_t length_limit_overhead;
+            add("tree_build", 1, measure([&]() {
+                code_lengths = HuffmanArchiver::choose_code_lengths(
+                        vocabulary, HuffmanArchiver::HuffTree::MAX_CANONICAL_CODE_LENGTH, length_limit_overhead);
+            }, repeat));
+            add("code_gen", 1, measure([&]() {
+                HuffmanArchiver::HuffTree tree(code_lengths);
+            }, repeat));
+            std::vector<std::byte> compressed;
+            add("zip", 1, measure([&]() {
+                compressed = HuffmanArchiver::compress(input);
+            }, repeat));
+            std::vector<std::byte> decompressed;
+            add("unzip", 1, measure([&]() {
+                decompressed = HuffmanArchiver::decompress(compressed);
+            }, repeat));
+            if (!std::equal(input.begin(), input.end(), decompressed.begin(), decompressed.end())) {
+                throw std::logic_error("Round trip mismatch for corpus \"" + corpus + "\".");
+            }
+
+            write_file(in_path, data);
+            for (unsigned threads: thread_counts) {
+                add("zip_blocks", threads, measure([&]() {
+                    HuffmanArchiver archiver(in_path.string(), zip_path.string());
+                    archiver.set_block_size(HuffmanArchiver::DEFAULT_BLOCK_SIZE);
+                    archiver.set_thread_count(threads);
+                    archiver.zip();
+                }, repeat));
+                add("unzip_blocks", threads, measure([&]() {
+                    HuffmanArchiver archiver(zip_path.string(), out_path.string());
+                    archiver.set_thread_count(threads);
+                    archiver.unzip();
+                }, repeat));
+            }
+        }
+    }
+    if (format == "json") {
+        print_json(results);
+    } else {
+        print_csv(results);
+    }
+    return 0;
+}
+
+}
+
+int main(int argc, char *argv[]) {
+    try {
+        return huffman_algo::Benchmark::run(argc, argv);
+    } catch (const std::exception &e) {
+        std::cerr << e.what();
+        return 1;
+    }
+}
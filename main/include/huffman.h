@@ -1,10 +1,17 @@
 #include <array>
+#include <chrono>
 #include <climits>
+#include <cstddef>
+#include <cstdint>
 #include <fstream>
-#include <list>
+#include <functional>
+#include <istream>
 #include <memory>
+#include <ostream>
 #include <queue>
+#include <span>
 #include <string>
+#include <string_view>
 #include <vector>
 
 
@@ -13,57 +20,260 @@ namespace huffman_algo {
 class HuffmanArchiver final {
    class TreeNode;
    class HuffTree;
+   class BitReader;
+   class BitWriter;
+   class MappedFile;
 
 public:
+    enum class DecodeMode { tree_walk, table, multi_table };
+
+    struct Stats {
+        double read_seconds;
+        double histogram_seconds;
+        double tree_build_seconds;
+        double code_gen_seconds;
+        double encode_seconds;
+        double decode_seconds;
+        double write_seconds;
+        double total_seconds;
+        uint64_t bytes_read;
+        uint64_t bytes_written;
+        double average_code_length;
+        unsigned max_code_length;
+        uint64_t block_count;
+
+        Stats &operator+=(const Stats &other) noexcept;
+    };
+
+    static constexpr std::size_t DEFAULT_BLOCK_SIZE = 1 << 20;
+    static constexpr std::size_t MIN_BLOCK_SIZE = 1 << 12;
+    static constexpr std::size_t MAX_BLOCK_SIZE = 1 << 30;
+    static constexpr uint64_t DEFAULT_MEMORY_LIMIT = 1 << 28;
+    static constexpr unsigned MIN_CONTEXT_TABLES = 4;
+    static constexpr unsigned MAX_CONTEXT_TABLES = 32;
+    static constexpr char STANDARD_STREAM[] = "-";
+
+    explicit HuffmanArchiver(const std::string &in_filename);
     HuffmanArchiver(const std::string &in_filename, const std::string &out_filename);
     HuffmanArchiver(const HuffmanArchiver &other) = delete;
-    ~HuffmanArchiver() = default;
+    ~HuffmanArchiver();
 
-    uint32_t get_in_file_size() const noexcept;
-    uint32_t get_out_file_size() const noexcept;
-    uint32_t get_extra_data_size() const noexcept;
+    uint64_t get_in_file_size() const noexcept;
+    uint64_t get_out_file_size() const noexcept;
+    uint64_t get_extra_data_size() const noexcept;
+    uint64_t get_length_limit_overhead() const noexcept;
+    const Stats &get_stats() const noexcept;
+    void set_max_code_length(unsigned max_code_length);
+    void set_thread_count(unsigned thread_count);
+    void set_block_size(std::size_t block_size);
+    void set_memory_limit(uint64_t memory_limit) noexcept;
+    void set_interleaved(bool interleaved);
+    void set_context_model(bool context_model);
+    void set_context_tables(unsigned context_tables);
+    void set_token_model(bool token_model);
 
     void zip();
     void unzip();
+    void estimate();
+
+    static std::size_t compress_bound(std::size_t size) noexcept;
+    static uint64_t decompressed_size(std::span<const std::byte> data);
+    static std::vector<std::byte> compress(std::span<const std::byte> data);
+    static std::size_t compress(std::span<const std::byte> data, std::span<std::byte> out);
+    static std::vector<std::byte> decompress(std::span<const std::byte> data);
+    static std::size_t decompress(std::span<const std::byte> data, std::span<std::byte> out);
 
 private:
-    std::ifstream _in;
-    std::ofstream _out;
-    uint32_t _in_file_size;
-    uint32_t _out_file_size;
-    uint32_t _extra_data_size;
-
-    std::array<uint32_t, UCHAR_MAX + 1> build_vocabulary();
-    std::array<uint32_t, UCHAR_MAX + 1> extract_vocabulary();
-    void decode(HuffTree &tree);
+    enum class FormatVersion : uint8_t { legacy = 0, canonical = 1, canonical_64 = 2, blocks = 3, stream = 4,
+                                        stored = 5, run = 6, tokens = 7 };
+
+    enum class BlockType : uint8_t { huffman = 0, interleaved = 1, stored = 2, run = 3, context = 4,
+                                     clustered = 5 };
+
+    struct Block {
+        std::vector<unsigned char> header;
+        std::vector<unsigned char> payload;
+        uint64_t length_limit_overhead;
+        Stats stats;
+    };
+
+    struct BlockLayout {
+        BlockType type;
+        std::array<uint8_t, UCHAR_MAX + 1> code_lengths;
+        std::vector<std::array<uint8_t, UCHAR_MAX + 1>> context_code_lengths;
+        std::array<uint16_t, UCHAR_MAX + 1> context_map;
+        unsigned char symbol;
+        uint64_t header_size;
+        uint64_t payload_size;
+        uint64_t length_limit_overhead;
+    };
+
+    struct TokenLayout {
+        std::vector<uint32_t> symbols;
+        std::vector<uint8_t> code_lengths;
+        std::vector<unsigned char> dictionary;
+        uint64_t payload_size;
+        uint64_t length_limit_overhead;
+    };
+
+    struct BlockEntry {
+        uint64_t offset;
+        uint32_t size;
+    };
+
+    static constexpr char SIGNATURE[] = {'H', 'U', 'F'};
+    static constexpr std::size_t PARALLEL_HISTOGRAM_MIN_SIZE = 1 << 23;
+    static constexpr std::size_t INTERLEAVED_STREAMS = 4;
+    static constexpr std::size_t CONTEXT_COUNT = UCHAR_MAX + 1;
+    static constexpr std::size_t CONTEXT_MASK_SIZE = CONTEXT_COUNT / CHAR_BIT;
+    static constexpr unsigned CLUSTER_ITERATIONS = 8;
+    static constexpr std::size_t MAX_TOKEN_LENGTH = UCHAR_MAX;
+    static constexpr std::size_t MAX_TOKEN_COUNT = 1 << 20;
+    static constexpr uint64_t MIN_TOKEN_FREQUENCY = 2;
+    static constexpr unsigned TOKEN_MAX_CODE_LENGTH = 24;
+    static constexpr unsigned TOKEN_TABLE_BITS = 12;
+    static constexpr std::size_t TOKEN_COPY_SIZE = 16;
+    static constexpr char TOKEN_OPTIONS_ERROR[] = "Token mode can't be combined with block or context options.";
+
+    std::ifstream _in_file;
+    std::ofstream _out_file;
+    std::istream _in;
+    std::ostream _out;
+    std::string _out_filename;
+    std::unique_ptr<MappedFile> _in_map;
+    bool _in_regular;
+    uint64_t _in_file_size;
+    uint64_t _out_file_size;
+    uint64_t _extra_data_size;
+    uint64_t _length_limit_overhead;
+    unsigned _max_code_length;
+    unsigned _thread_count;
+    std::size_t _block_size;
+    uint64_t _memory_limit;
+    bool _interleaved;
+    bool _context_model;
+    unsigned _context_tables;
+    bool _token_model;
+    Stats _stats;
+
+    static double lap(std::chrono::steady_clock::time_point &start) noexcept;
+    void finish_stats(std::chrono::steady_clock::time_point start, uint64_t original_size, uint64_t payload_size);
+    void load_input();
+    std::array<uint64_t, UCHAR_MAX + 1> build_vocabulary();
+    static void count_bytes(const unsigned char *data, std::size_t size, std::array<uint64_t, UCHAR_MAX + 1> &vocabulary);
+    static void count_streams(const unsigned char *data, std::size_t size,
+                              std::array<std::array<uint64_t, UCHAR_MAX + 1>, INTERLEAVED_STREAMS> &vocabularies);
+    static void count_contexts(const unsigned char *data, std::size_t size,
+                               std::vector<std::array<uint64_t, UCHAR_MAX + 1>> &contexts);
+    static void count_bytes_parallel(const unsigned char *data, std::size_t size, unsigned thread_count,
+                                     std::array<uint64_t, UCHAR_MAX + 1> &vocabulary);
+    static void run_parallel(std::size_t task_count, unsigned thread_count,
+                             const std::function<void(std::size_t)> &task);
+    static std::array<uint8_t, UCHAR_MAX + 1> choose_code_lengths(const std::array<uint64_t, UCHAR_MAX + 1> &vocabulary,
+                                                                  unsigned max_code_length,
+                                                                  uint64_t &length_limit_overhead);
+    static uint64_t encoded_size(const std::array<uint64_t, UCHAR_MAX + 1> &vocabulary,
+                                 const std::array<uint8_t, UCHAR_MAX + 1> &code_lengths) noexcept;
+    static bool is_single_symbol(const std::array<uint64_t, UCHAR_MAX + 1> &vocabulary,
+                                 unsigned char &symbol) noexcept;
+    static FormatVersion choose_format(const std::array<uint64_t, UCHAR_MAX + 1> &vocabulary,
+                                       const std::array<uint8_t, UCHAR_MAX + 1> &code_lengths, uint64_t size,
+                                       uint64_t &header_size, uint64_t &payload_size);
+    std::array<uint64_t, UCHAR_MAX + 1> extract_vocabulary();
+    void write_header(FormatVersion version);
+    bool is_legacy_header(uint32_t out_file_size);
+    FormatVersion extract_header();
+    static std::size_t read_header(std::span<const std::byte> data, FormatVersion &version, uint64_t &size);
+    static std::vector<unsigned char> pack_code_lengths(const std::array<uint8_t, UCHAR_MAX + 1> &code_lengths);
+    void write_code_lengths(const std::array<uint8_t, UCHAR_MAX + 1> &code_lengths);
+    std::array<uint8_t, UCHAR_MAX + 1> extract_code_lengths();
+    static std::array<uint8_t, UCHAR_MAX + 1> unpack_code_lengths(const std::function<unsigned char()> &next_byte);
+    std::vector<BlockEntry> extract_block_index();
+    std::unique_ptr<HuffTree> extract_tree(FormatVersion version);
+    void decode(HuffTree &tree, DecodeMode mode = DecodeMode::multi_table);
+    void decode_tree_walk(HuffTree &tree);
+    void decode_table(HuffTree &tree);
+    static void decode_symbols(const HuffTree &tree, BitReader &reader, unsigned char *out, std::size_t count);
+    static void decode_block(const HuffTree &tree, const unsigned char *data, std::size_t size,
+                             unsigned char *out, std::size_t count);
+    static void decode_interleaved(const HuffTree &tree, const unsigned char *data,
+                                   const std::array<uint32_t, INTERLEAVED_STREAMS> &sizes,
+                                   unsigned char *out, std::size_t count);
+    static void decode_contexts(const std::vector<std::unique_ptr<HuffTree>> &trees,
+                                const std::array<uint16_t, CONTEXT_COUNT> &context_map, const unsigned char *data,
+                                const std::array<uint32_t, INTERLEAVED_STREAMS> &sizes,
+                                unsigned char *out, std::size_t count);
+    static uint32_t decode_context_record(const unsigned char *record, std::size_t record_size,
+                                          unsigned char *out, std::size_t count, Stats &stats);
+    static uint32_t decode_block_record(const unsigned char *record, std::size_t record_size,
+                                        unsigned char *out, std::size_t count, Stats &stats);
     void encode(HuffTree &tree);
+    void store_input();
+    void extract_stored();
+    void extract_run();
+    static void encode_symbols(const HuffTree &tree, const unsigned char *data, std::size_t size, BitWriter &writer);
+    static std::array<uint32_t, INTERLEAVED_STREAMS> encode_interleaved(const HuffTree &tree, const unsigned char *data,
+                                                                       std::size_t size,
+                                                                       std::vector<unsigned char> &payload);
+    static std::array<uint32_t, INTERLEAVED_STREAMS> encode_contexts(
+            const std::vector<std::unique_ptr<HuffTree>> &trees,
+            const std::array<uint16_t, CONTEXT_COUNT> &context_map, const unsigned char *data, std::size_t size,
+            std::vector<unsigned char> &payload);
+    static std::vector<std::array<uint64_t, UCHAR_MAX + 1>> cluster_contexts(
+            const std::vector<std::array<uint64_t, UCHAR_MAX + 1>> &contexts, unsigned table_count,
+            std::array<uint16_t, CONTEXT_COUNT> &context_map);
+    void plan_contexts(const unsigned char *data, std::size_t size, BlockLayout &layout, Stats &stats) const;
+    static std::size_t next_token(const unsigned char *data, std::size_t size) noexcept;
+    static std::vector<uint32_t> tokenize(const unsigned char *data, std::size_t size,
+                                          std::vector<std::string_view> &dictionary);
+    static std::vector<unsigned char> pack_tokens(const std::vector<std::string_view> &dictionary,
+                                                  const std::vector<uint8_t> &code_lengths);
+    static std::size_t unpack_tokens(const unsigned char *data, std::size_t size, std::vector<unsigned char> &tokens,
+                                     std::vector<uint32_t> &offsets, std::vector<uint8_t> &code_lengths);
+    static void encode_tokens(const std::vector<uint32_t> &symbols, const std::vector<uint8_t> &code_lengths,
+                              BitWriter &writer);
+    static std::size_t decode_tokens(const std::vector<unsigned char> &tokens, const std::vector<uint32_t> &offsets,
+                                     const std::vector<uint8_t> &code_lengths, const unsigned char *data,
+                                     std::size_t size, unsigned char *out, std::size_t count);
+    static TokenLayout plan_tokens(const unsigned char *data, std::size_t size, Stats &stats);
+    bool prefer_tokens(TokenLayout &layout);
+    void zip_tokens();
+    void extract_tokens();
+    BlockLayout plan_block(const unsigned char *data, std::size_t size, Stats &stats) const;
+    Block compress_block(const unsigned char *data, std::size_t size) const;
+    void zip_single();
+    void unzip_single(FormatVersion version);
+    void zip_blocks();
+    void unzip_blocks();
+    bool is_streaming() const noexcept;
+    void zip_stream();
+    void unzip_stream(FormatVersion version);
+    void estimate_blocks();
     void fill_buffer(std::queue<bool> &buffer);
     void extract_buffer(std::queue<bool> &buffer);
 
     class TestHuffmanArchiver;
+    friend class Benchmark;
 };
 
 
 class HuffmanArchiver::TreeNode final {
 public:
-    explicit TreeNode(uint32_t frequency = 0, bool is_leaf = false, unsigned char value = 0,
-                      std::unique_ptr<TreeNode> left_child = nullptr,
-                      std::unique_ptr<TreeNode> right_child = nullptr) noexcept;
-    TreeNode(const TreeNode &other) = delete;
+    explicit TreeNode(bool is_leaf = false, unsigned char value = 0,
+                      uint16_t left_child = 0, uint16_t right_child = 0) noexcept;
+    TreeNode(const TreeNode &other) = default;
     ~TreeNode() = default;
 
-    uint32_t get_frequency() const noexcept;
     bool is_leaf() const noexcept;
     unsigned char get_value() const noexcept;
-    const std::unique_ptr<TreeNode> &get_left_child() const noexcept;
-    const std::unique_ptr<TreeNode> &get_right_child() const noexcept;
+    uint16_t get_left_child() const noexcept;
+    uint16_t get_right_child() const noexcept;
 
 private:
-    uint32_t _frequency;
-    bool _is_leaf;
+    uint16_t _left_child;
+    uint16_t _right_child;
     unsigned char _value;
-    const std::unique_ptr<TreeNode> _left_child;
-    const std::unique_ptr<TreeNode> _right_child;
+    bool _is_leaf;
 
     class TestTreeNode;
 };
@@ -71,24 +281,154 @@ private:
 
 class HuffmanArchiver::HuffTree final {
 public:
-    explicit HuffTree(const std::array<uint32_t, UCHAR_MAX + 1> &vocabulary);
+    struct DecodeEntry {
+        uint16_t value;
+        uint8_t length;
+        uint8_t sub_bits;
+    };
+
+    struct Code {
+        uint64_t bits;
+        uint8_t length;
+    };
+
+    static constexpr unsigned DECODE_TABLE_BITS = 11;
+    static constexpr unsigned MULTI_DECODE_TABLE_BITS = 12;
+    static constexpr unsigned MAX_MULTI_SYMBOLS = 3;
+
+    struct MultiDecodeEntry {
+        unsigned char symbols[MAX_MULTI_SYMBOLS];
+        uint8_t count;
+        uint8_t length;
+    };
+
+    static constexpr unsigned MAX_TABLE_CODE_LENGTH = 22;
+    static constexpr unsigned MAX_CANONICAL_CODE_LENGTH = 15;
+    static constexpr unsigned MIN_CODE_LENGTH_LIMIT = CHAR_BIT;
+    static constexpr unsigned MAX_CODE_LENGTH_LIMIT = MAX_CANONICAL_CODE_LENGTH;
+
+    explicit HuffTree(const std::array<uint64_t, UCHAR_MAX + 1> &vocabulary);
+    explicit HuffTree(const std::array<uint8_t, UCHAR_MAX + 1> &code_lengths);
     HuffTree(const HuffTree &other) = delete;
     ~HuffTree() = default;
 
     std::vector<bool> &get_code_by_char(unsigned char chr) noexcept;
     bool try_extract_code(std::queue<bool> &buffer, unsigned char &chr);
+    const std::array<Code, UCHAR_MAX + 1> &get_code_table() const noexcept;
+    bool build_decode_table();
+    const std::vector<DecodeEntry> &get_decode_table() const noexcept;
+    void build_multi_decode_table();
+    const std::vector<MultiDecodeEntry> &get_multi_decode_table() const noexcept;
+    static std::vector<uint8_t> build_code_lengths(const std::vector<uint64_t> &frequencies);
+    static std::vector<uint8_t> build_limited_code_lengths(const std::vector<uint64_t> &frequencies,
+                                                           unsigned max_code_length);
+    static std::vector<Code> build_canonical_codes(const std::vector<uint8_t> &code_lengths);
 
 private:
-    std::unique_ptr<TreeNode> _root;
+    std::vector<TreeNode> _nodes;
     std::vector<bool> _chars_to_codes[UCHAR_MAX + 1];
-    const TreeNode *_cur_node;
+    alignas(64) std::array<Code, UCHAR_MAX + 1> _code_table;
+    uint16_t _cur_node;
+    std::vector<DecodeEntry> _decode_table;
+    std::vector<MultiDecodeEntry> _multi_decode_table;
 
-    static std::_List_iterator<std::unique_ptr<TreeNode>> find_min(std::list<std::unique_ptr<TreeNode>> &nodes);
-    static std::unique_ptr<TreeNode> build_tree(const std::array<uint32_t, UCHAR_MAX + 1> &vocabulary);
+    static std::vector<TreeNode> build_tree(const std::array<uint64_t, UCHAR_MAX + 1> &vocabulary);
+    static std::vector<TreeNode> build_canonical_tree(const std::array<uint8_t, UCHAR_MAX + 1> &code_lengths);
+    static std::vector<std::array<uint32_t, 2>> merge_leaves(const std::vector<uint64_t> &weights);
+    static std::vector<TreeNode> layout_tree(const std::vector<std::array<uint32_t, 2>> &children,
+                                             const std::vector<unsigned char> &leaves, uint32_t root);
     void get_codes();
     void get_next_code(std::vector<bool> &code);
 
     class TestHuffTree;
 };
 
+
+class HuffmanArchiver::BitReader final {
+public:
+    static constexpr std::size_t CHUNK_SIZE = 1 << 16;
+    static constexpr unsigned MIN_REFILL_BITS = 57;
+
+    explicit BitReader(std::istream &in);
+    BitReader(const unsigned char *data, std::size_t size) noexcept;
+    BitReader(const BitReader &other) = delete;
+    ~BitReader() = default;
+
+    void refill();
+    uint64_t peek() const noexcept;
+    void consume(unsigned length) noexcept;
+    unsigned char decode_symbol(const HuffTree::DecodeEntry *table);
+    uint64_t get_consumed_bits() const noexcept;
+    uint64_t get_consumed_bytes() const noexcept;
+    bool is_overrun() const noexcept;
+
+private:
+    std::istream *_in;
+    std::vector<unsigned char> _chunk;
+    const unsigned char *_pos;
+    const unsigned char *_end;
+    uint64_t _bits;
+    unsigned _bit_count;
+    uint64_t _loaded_bits;
+    uint64_t _consumed_bits;
+
+    bool load_chunk();
+
+    class TestBitReader;
+};
+
+
+class HuffmanArchiver::BitWriter final {
+public:
+    static constexpr std::size_t CHUNK_SIZE = 1 << 16;
+
+    explicit BitWriter(std::ostream &out);
+    explicit BitWriter(std::vector<unsigned char> &out);
+    BitWriter(unsigned char *out, std::size_t size) noexcept;
+    BitWriter(const BitWriter &other) = delete;
+    ~BitWriter() = default;
+
+    void write(uint64_t code, unsigned length);
+    void flush();
+    uint64_t get_written_bits() const noexcept;
+    uint64_t get_written_bytes() const noexcept;
+
+private:
+    std::ostream *_out;
+    std::vector<unsigned char> *_buffer;
+    std::vector<unsigned char> _chunk;
+    unsigned char *_data;
+    std::size_t _capacity;
+    std::size_t _chunk_size;
+    uint64_t _bits;
+    unsigned _bit_count;
+    uint64_t _written_bits;
+
+    void reserve(std::size_t size);
+    void store_word();
+    void flush_chunk();
+
+    class TestBitWriter;
+};
+
+
+class HuffmanArchiver::MappedFile final {
+public:
+    explicit MappedFile(const std::string &filename) noexcept;
+    MappedFile(std::istream &in, std::size_t size);
+    MappedFile(const MappedFile &other) = delete;
+    ~MappedFile();
+
+    bool is_mapped() const noexcept;
+    const unsigned char *data() const noexcept;
+    std::size_t size() const noexcept;
+
+private:
+    const unsigned char *_data;
+    std::size_t _size;
+    std::vector<unsigned char> _buffer;
+
+    class TestMappedFile;
+};
+
 }
@@ -1,25 +1,41 @@
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <bit>
 #include <climits>
+#include <cmath>
+#include <cstring>
+#include <filesystem>
 #include <fstream>
-#include <list>
+#include <functional>
+#include <iostream>
+#include <limits>
 #include <memory>
+#include <mutex>
+#include <optional>
 #include <queue>
 #include <stdexcept>
 #include <string>
+#include <system_error>
+#include <thread>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 #include "huffman.h"
 
-using namespace huffman_algo;
+#if __has_include(<sys/mman.h>)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define HUFFMAN_HAS_MMAP 1
+#endif
 
-huffman_algo::HuffmanArchiver::TreeNode::TreeNode(uint32_t frequency, bool is_leaf, unsigned char value,
-                   std::unique_ptr<TreeNode> left_child, std::unique_ptr<TreeNode> right_child) noexcept:
-        _frequency(frequency), _is_leaf(is_leaf), _value(value),
-        _left_child(std::move(left_child)), _right_child(std::move(right_child)) { }
+using namespace huffman_algo;
 
-uint32_t HuffmanArchiver::TreeNode::get_frequency() const noexcept {
-    return _frequency;
-}
+HuffmanArchiver::TreeNode::TreeNode(bool is_leaf, unsigned char value,
+                                    uint16_t left_child, uint16_t right_child) noexcept:
+        _left_child(left_child), _right_child(right_child), _value(value), _is_leaf(is_leaf) { }
 
 bool HuffmanArchiver::TreeNode::is_leaf() const noexcept {
     return _is_leaf;
@@ -29,18 +45,24 @@ unsigned char HuffmanArchiver::TreeNode::get_value() const noexcept {
     return _value;
 }
 
-const std::unique_ptr<HuffmanArchiver::TreeNode> &HuffmanArchiver::TreeNode::get_left_child() const noexcept {
+uint16_t HuffmanArchiver::TreeNode::get_left_child() const noexcept {
     return _left_child;
 }
 
-const std::unique_ptr<HuffmanArchiver::TreeNode> &HuffmanArchiver::TreeNode::get_right_child() const noexcept {
+uint16_t HuffmanArchiver::TreeNode::get_right_child() const noexcept {
     return _right_child;
 }
 
-HuffmanArchiver::HuffTree::HuffTree(const std::array<uint32_t, UCHAR_MAX + 1> &vocabulary) {
-    _root = build_tree(vocabulary);
+HuffmanArchiver::HuffTree::HuffTree(const std::array<uint64_t, UCHAR_MAX + 1> &vocabulary) {
+    _nodes = build_tree(vocabulary);
+    get_codes();
+    _cur_node = 0;
+}
+
+HuffmanArchiver::HuffTree::HuffTree(const std::array<uint8_t, UCHAR_MAX + 1> &code_lengths) {
+    _nodes = build_canonical_tree(code_lengths);
     get_codes();
-    _cur_node = _root.get();
+    _cur_node = 0;
 }
 
 std::vector<bool> &HuffmanArchiver::HuffTree::get_code_by_char(unsigned char chr) noexcept {
@@ -48,230 +70,3064 @@ std::vector<bool> &HuffmanArchiver::HuffTree::get_code_by_char(unsigned char chr
 }
 
 bool HuffmanArchiver::HuffTree::try_extract_code(std::queue<bool> &buffer, unsigned char &chr) {
-    if (_cur_node && _cur_node == _root.get() && _cur_node->is_leaf() && !buffer.empty()) {
+    if (_nodes.empty()) {
+        throw std::logic_error("Attempt to extract a code from invalid data.");
+    }
+    if (_cur_node == 0 && _nodes[0].is_leaf() && !buffer.empty()) {
         buffer.pop();
-        chr = _cur_node->get_value();
+        chr = _nodes[0].get_value();
         return true;
     }
-    while (_cur_node && !_cur_node->is_leaf() && !buffer.empty()) {
+    while (!_nodes[_cur_node].is_leaf() && !buffer.empty()) {
         bool bit = buffer.front();
         if (bit) {
-            _cur_node = _cur_node->get_left_child().get();
+            _cur_node = _nodes[_cur_node].get_left_child();
         } else {
-            _cur_node = _cur_node->get_right_child().get();
+            _cur_node = _nodes[_cur_node].get_right_child();
         }
         buffer.pop();
     }
-    if (!_cur_node) {
-        throw std::logic_error("Attempt to extract a code from invalid data.");
-    } else if (_cur_node->is_leaf()) {
-        chr = _cur_node->get_value();
-        _cur_node = _root.get();
+    if (_nodes[_cur_node].is_leaf()) {
+        chr = _nodes[_cur_node].get_value();
+        _cur_node = 0;
         return true;
     }
     return false;
 }
 
-std::_List_iterator<std::unique_ptr<HuffmanArchiver::TreeNode>>
-        HuffmanArchiver::HuffTree::find_min(std::list<std::unique_ptr<TreeNode>> &nodes) {
-    auto min = nodes.begin();
-    for (auto it = nodes.begin(); it != nodes.end(); ++it) {
-        if ((*it)->get_frequency() < (*min)->get_frequency()) {
-            min = it;
+const std::array<HuffmanArchiver::HuffTree::Code, UCHAR_MAX + 1> &
+        HuffmanArchiver::HuffTree::get_code_table() const noexcept {
+    return _code_table;
+}
+
+bool HuffmanArchiver::HuffTree::build_decode_table() {
+    std::size_t max_length = 0;
+    for (auto &code: _code_table) {
+        max_length = std::max<std::size_t>(max_length, code.length);
+    }
+    _decode_table.clear();
+    _multi_decode_table.clear();
+    if (max_length > MAX_TABLE_CODE_LENGTH) {
+        return false;
+    }
+    const std::size_t table_size = std::size_t(1) << DECODE_TABLE_BITS;
+    _decode_table.resize(table_size, DecodeEntry{0, 0, 0});
+    if (!_nodes.empty() && _nodes.front().is_leaf()) {
+        std::fill(_decode_table.begin(), _decode_table.end(), DecodeEntry{_nodes.front().get_value(), 1, 0});
+        return true;
+    }
+    for (std::size_t i = 0; i <= UCHAR_MAX; ++i) {
+        const Code &code = _code_table[i];
+        if (code.length && code.length <= DECODE_TABLE_BITS) {
+            for (std::size_t index = code.bits; index < table_size; index += std::size_t(1) << code.length) {
+                _decode_table[index] = DecodeEntry{uint16_t(i), code.length, 0};
+            }
+        } else if (code.length) {
+            DecodeEntry &link = _decode_table[code.bits & (table_size - 1)];
+            link.sub_bits = std::max(link.sub_bits, uint8_t(code.length - DECODE_TABLE_BITS));
+        }
+    }
+    for (std::size_t prefix = 0; prefix < table_size; ++prefix) {
+        DecodeEntry &link = _decode_table[prefix];
+        if (link.sub_bits) {
+            link.value = _decode_table.size();
+            _decode_table.resize(_decode_table.size() + (std::size_t(1) << link.sub_bits), DecodeEntry{0, 0, 0});
+        }
+    }
+    for (std::size_t i = 0; i <= UCHAR_MAX; ++i) {
+        const Code &code = _code_table[i];
+        if (code.length <= DECODE_TABLE_BITS) {
+            continue;
+        }
+        DecodeEntry link = _decode_table[code.bits & (table_size - 1)];
+        std::size_t sub_table_size = std::size_t(1) << link.sub_bits;
+        for (std::size_t index = code.bits >> DECODE_TABLE_BITS; index < sub_table_size;
+             index += std::size_t(1) << (code.length - DECODE_TABLE_BITS)) {
+            _decode_table[link.value + index] = DecodeEntry{uint16_t(i), code.length, 0};
+        }
+    }
+    return true;
+}
+
+const std::vector<HuffmanArchiver::HuffTree::DecodeEntry> &
+        HuffmanArchiver::HuffTree::get_decode_table() const noexcept {
+    return _decode_table;
+}
+
+void HuffmanArchiver::HuffTree::build_multi_decode_table() {
+    _multi_decode_table.clear();
+    uint8_t min_length = UINT8_MAX;
+    for (const DecodeEntry &entry: _decode_table) {
+        if (entry.length) {
+            min_length = std::min(min_length, entry.length);
+        }
+    }
+    if (2 * min_length > MULTI_DECODE_TABLE_BITS) {
+        return;
+    }
+    const std::size_t mask = (std::size_t(1) << DECODE_TABLE_BITS) - 1;
+    _multi_decode_table.resize(std::size_t(1) << MULTI_DECODE_TABLE_BITS);
+    for (std::size_t index = 0; index < _multi_decode_table.size(); ++index) {
+        MultiDecodeEntry entry{};
+        while (entry.count < MAX_MULTI_SYMBOLS) {
+            const DecodeEntry &single = _decode_table[(index >> entry.length) & mask];
+            if (!single.length || entry.length + single.length > MULTI_DECODE_TABLE_BITS) {
+                break;
+            }
+            entry.symbols[entry.count++] = single.value;
+            entry.length += single.length;
         }
+        _multi_decode_table[index] = entry;
     }
-    return min;
 }
 
-std::unique_ptr<HuffmanArchiver::TreeNode>
-        HuffmanArchiver::HuffTree::build_tree(const std::array<uint32_t, UCHAR_MAX + 1> &vocabulary) {
-    std::size_t vocabulary_size = 0;
-    std::list<std::unique_ptr<TreeNode>> nodes;
+const std::vector<HuffmanArchiver::HuffTree::MultiDecodeEntry> &
+        HuffmanArchiver::HuffTree::get_multi_decode_table() const noexcept {
+    return _multi_decode_table;
+}
+
+std::vector<HuffmanArchiver::TreeNode>
+        HuffmanArchiver::HuffTree::build_tree(const std::array<uint64_t, UCHAR_MAX + 1> &vocabulary) {
+    std::vector<unsigned char> symbols;
     for (std::size_t i = 0; i <= UCHAR_MAX; ++i) {
         if (vocabulary.at(i)) {
-            ++vocabulary_size;
-            nodes.push_back(std::make_unique<TreeNode>(vocabulary.at(i), true, i));
+            symbols.push_back(i);
+        }
+    }
+    std::stable_sort(symbols.begin(), symbols.end(), [&vocabulary](unsigned char lhs, unsigned char rhs) {
+        return vocabulary[lhs] < vocabulary[rhs];
+    });
+    std::vector<TreeNode> nodes;
+    if (symbols.size() == 1) {
+        nodes.emplace_back(true, symbols.front());
+    }
+    if (symbols.size() <= 1) {
+        return nodes;
+    }
+    std::vector<uint64_t> weights;
+    for (auto chr: symbols) {
+        weights.push_back(vocabulary[chr]);
+    }
+    return layout_tree(merge_leaves(weights), symbols, 2 * symbols.size() - 2);
+}
+
+std::vector<HuffmanArchiver::TreeNode>
+        HuffmanArchiver::HuffTree::build_canonical_tree(const std::array<uint8_t, UCHAR_MAX + 1> &code_lengths) {
+    std::array<uint32_t, MAX_CANONICAL_CODE_LENGTH + 1> length_counts{};
+    std::vector<unsigned char> symbols;
+    for (std::size_t i = 0; i <= UCHAR_MAX; ++i) {
+        if (code_lengths[i] > MAX_CANONICAL_CODE_LENGTH) {
+            throw std::logic_error("Invalid code lengths.");
+        }
+        if (code_lengths[i]) {
+            ++length_counts[code_lengths[i]];
+            symbols.push_back(i);
+        }
+    }
+    uint32_t kraft_sum = 0;
+    for (std::size_t length = 1; length <= MAX_CANONICAL_CODE_LENGTH; ++length) {
+        kraft_sum += length_counts[length] << (MAX_CANONICAL_CODE_LENGTH - length);
+    }
+    std::vector<TreeNode> nodes;
+    if (symbols.size() == 1 && code_lengths[symbols.front()] == 1) {
+        nodes.emplace_back(true, symbols.front());
+        return nodes;
+    }
+    if (symbols.empty()) {
+        return nodes;
+    }
+    if (kraft_sum != uint32_t(1) << MAX_CANONICAL_CODE_LENGTH) {
+        throw std::logic_error("Invalid code lengths.");
+    }
+    std::array<uint32_t, MAX_CANONICAL_CODE_LENGTH + 1> next_codes{};
+    for (std::size_t length = 1; length <= MAX_CANONICAL_CODE_LENGTH; ++length) {
+        next_codes[length] = (next_codes[length - 1] + length_counts[length - 1]) << 1;
+    }
+    const uint32_t unset = UINT32_MAX;
+    std::size_t leaf_count = symbols.size();
+    std::vector<std::array<uint32_t, 2>> children = {{unset, unset}};
+    for (std::size_t leaf = 0; leaf < leaf_count; ++leaf) {
+        unsigned length = code_lengths[symbols[leaf]];
+        uint32_t code = next_codes[length]++;
+        std::size_t node = 0;
+        for (unsigned i = length; i-- > 1;) {
+            uint32_t child = children[node][(code >> i) & 1 ? 0 : 1];
+            if (child == unset) {
+                child = leaf_count + children.size();
+                children[node][(code >> i) & 1 ? 0 : 1] = child;
+                children.push_back({unset, unset});
+            }
+            node = child - leaf_count;
+        }
+        children[node][code & 1 ? 0 : 1] = leaf;
+    }
+    return layout_tree(children, symbols, leaf_count);
+}
+
+std::vector<std::array<uint32_t, 2>> HuffmanArchiver::HuffTree::merge_leaves(const std::vector<uint64_t> &weights) {
+    std::size_t leaf_count = weights.size();
+    std::vector<uint64_t> node_weights(weights);
+    std::vector<std::array<uint32_t, 2>> children;
+    if (leaf_count < 2) {
+        return children;
+    }
+    node_weights.resize(2 * leaf_count - 1);
+    children.reserve(leaf_count - 1);
+    std::size_t next_leaf = 0;
+    std::size_t next_node = leaf_count;
+    auto extract_min = [&](std::size_t end_node) {
+        if (next_leaf < leaf_count && (next_node == end_node || node_weights[next_leaf] <= node_weights[next_node])) {
+            return next_leaf++;
+        }
+        return next_node++;
+    };
+    for (std::size_t node = leaf_count; node < node_weights.size(); ++node) {
+        uint32_t left_child = extract_min(node);
+        uint32_t right_child = extract_min(node);
+        node_weights[node] = node_weights[left_child] + node_weights[right_child];
+        children.push_back({left_child, right_child});
+    }
+    return children;
+}
+
+std::vector<uint8_t> HuffmanArchiver::HuffTree::build_limited_code_lengths(const std::vector<uint64_t> &frequencies,
+                                                                         unsigned max_code_length) {
+    std::vector<uint8_t> lengths = build_code_lengths(frequencies);
+    if (lengths.empty() || *std::max_element(lengths.begin(), lengths.end()) <= max_code_length) {
+        return lengths;
+    }
+    std::vector<uint32_t> symbols;
+    for (std::size_t i = 0; i < frequencies.size(); ++i) {
+        if (frequencies[i]) {
+            symbols.push_back(i);
+        }
+    }
+    if (max_code_length >= 64 || symbols.size() > uint64_t(1) << max_code_length) {
+        throw std::invalid_argument("Code length limit is too small for the alphabet.");
+    }
+    std::stable_sort(symbols.begin(), symbols.end(), [&frequencies](uint32_t lhs, uint32_t rhs) {
+        return frequencies[lhs] < frequencies[rhs];
+    });
+    struct Item {
+        uint64_t weight;
+        uint32_t first;
+        uint32_t second;
+        bool is_leaf;
+    };
+    std::vector<std::vector<Item>> levels(max_code_length);
+    for (std::size_t level = 0; level < max_code_length; ++level) {
+        std::vector<Item> packages;
+        if (level) {
+            const std::vector<Item> &previous = levels[level - 1];
+            for (std::size_t i = 0; i + 1 < previous.size(); i += 2) {
+                packages.push_back({previous[i].weight + previous[i + 1].weight, uint32_t(i), uint32_t(i + 1), false});
+            }
+        }
+        std::vector<Item> &items = levels[level];
+        std::size_t next_leaf = 0;
+        std::size_t next_package = 0;
+        while (next_leaf < symbols.size() || next_package < packages.size()) {
+            if (next_package == packages.size() ||
+                (next_leaf < symbols.size() && frequencies[symbols[next_leaf]] <= packages[next_package].weight)) {
+                items.push_back({frequencies[symbols[next_leaf]], uint32_t(next_leaf), 0, true});
+                ++next_leaf;
+            } else {
+                items.push_back(packages[next_package++]);
+            }
         }
     }
-    while (nodes.size() >= 2) {
-        auto first_min = find_min(nodes);
-        std::unique_ptr<TreeNode> left_child = std::move(*first_min);
-        nodes.erase(first_min);
-        auto second_min = find_min(nodes);
-        std::unique_ptr<TreeNode> right_child = std::move(*second_min);
-        nodes.erase(second_min);
-        std::unique_ptr<TreeNode> node =
-                std::make_unique<TreeNode>(left_child->get_frequency() + right_child->get_frequency(),
-                                           false, 0, std::move(left_child), std::move(right_child));
-        nodes.push_back(std::move(node));
+    std::fill(lengths.begin(), lengths.end(), 0);
+    std::vector<std::pair<std::size_t, uint32_t>> stack;
+    for (uint32_t i = 0; i < 2 * symbols.size() - 2; ++i) {
+        stack.emplace_back(max_code_length - 1, i);
     }
-    return nodes.empty() ? nullptr : std::move(nodes.front());
+    while (!stack.empty()) {
+        auto [level, index] = stack.back();
+        stack.pop_back();
+        const Item &item = levels[level][index];
+        if (item.is_leaf) {
+            ++lengths[symbols[item.first]];
+        } else {
+            stack.emplace_back(level - 1, item.first);
+            stack.emplace_back(level - 1, item.second);
+        }
+    }
+    return lengths;
+}
+
+std::vector<HuffmanArchiver::TreeNode>
+        HuffmanArchiver::HuffTree::layout_tree(const std::vector<std::array<uint32_t, 2>> &children,
+                                               const std::vector<unsigned char> &leaves, uint32_t root) {
+    std::vector<TreeNode> nodes;
+    std::vector<uint32_t> order = {root};
+    nodes.reserve(2 * leaves.size() - 1);
+    for (std::size_t i = 0; i < order.size(); ++i) {
+        if (order[i] < leaves.size()) {
+            nodes.emplace_back(true, leaves[order[i]]);
+            continue;
+        }
+        const std::array<uint32_t, 2> &node_children = children[order[i] - leaves.size()];
+        nodes.emplace_back(false, 0, order.size(), order.size() + 1);
+        order.push_back(node_children[0]);
+        order.push_back(node_children[1]);
+    }
+    return nodes;
+}
+
+std::vector<uint8_t> HuffmanArchiver::HuffTree::build_code_lengths(const std::vector<uint64_t> &frequencies) {
+    std::vector<uint32_t> symbols;
+    for (std::size_t i = 0; i < frequencies.size(); ++i) {
+        if (frequencies[i]) {
+            symbols.push_back(i);
+        }
+    }
+    std::stable_sort(symbols.begin(), symbols.end(), [&frequencies](uint32_t lhs, uint32_t rhs) {
+        return frequencies[lhs] < frequencies[rhs];
+    });
+    std::vector<uint8_t> lengths(frequencies.size(), 0);
+    if (symbols.size() == 1) {
+        lengths[symbols.front()] = 1;
+    }
+    if (symbols.size() <= 1) {
+        return lengths;
+    }
+    std::vector<uint64_t> weights;
+    for (auto symbol: symbols) {
+        weights.push_back(frequencies[symbol]);
+    }
+    std::vector<std::array<uint32_t, 2>> children = merge_leaves(weights);
+    std::size_t leaf_count = symbols.size();
+    std::vector<uint8_t> depths(2 * leaf_count - 1, 0);
+    for (std::size_t node = children.size(); node-- > 0;) {
+        for (auto child: children[node]) {
+            depths[child] = depths[leaf_count + node] + 1;
+        }
+    }
+    for (std::size_t i = 0; i < leaf_count; ++i) {
+        lengths[symbols[i]] = depths[i];
+    }
+    return lengths;
+}
+
+std::vector<HuffmanArchiver::HuffTree::Code>
+        HuffmanArchiver::HuffTree::build_canonical_codes(const std::vector<uint8_t> &code_lengths) {
+    unsigned max_length = code_lengths.empty() ? 0 : *std::max_element(code_lengths.begin(), code_lengths.end());
+    if (max_length >= 64) {
+        throw std::logic_error("Invalid code lengths.");
+    }
+    std::vector<uint64_t> length_counts(max_length + 1, 0);
+    std::size_t symbol_count = 0;
+    for (uint8_t length: code_lengths) {
+        if (length) {
+            ++length_counts[length];
+            ++symbol_count;
+        }
+    }
+    uint64_t kraft_sum = 0;
+    for (std::size_t length = 1; length <= max_length; ++length) {
+        if (length_counts[length] > uint64_t(1) << length) {
+            throw std::logic_error("Invalid code lengths.");
+        }
+        kraft_sum += length_counts[length] << (max_length - length);
+        if (kraft_sum > uint64_t(1) << max_length) {
+            throw std::logic_error("Invalid code lengths.");
+        }
+    }
+    if (symbol_count && !(symbol_count == 1 && max_length == 1) && kraft_sum != uint64_t(1) << max_length) {
+        throw std::logic_error("Invalid code lengths.");
+    }
+    std::vector<uint64_t> next_codes(max_length + 1, 0);
+    for (std::size_t length = 1; length <= max_length; ++length) {
+        next_codes[length] = (next_codes[length - 1] + length_counts[length - 1]) << 1;
+    }
+    std::vector<Code> codes(code_lengths.size(), Code{0, 0});
+    for (std::size_t i = 0; i < code_lengths.size(); ++i) {
+        unsigned length = code_lengths[i];
+        if (!length) {
+            continue;
+        }
+        uint64_t code = next_codes[length]++;
+        for (unsigned bit = 0; bit < length; ++bit) {
+            codes[i].bits |= ((code >> bit) & 1) << (length - 1 - bit);
+        }
+        codes[i].length = length;
+    }
+    return codes;
 }
 
 void HuffmanArchiver::HuffTree::get_codes() {
-    _cur_node = _root.get();
+    _cur_node = 0;
     std::vector<bool> code;
     get_next_code(code);
+    for (std::size_t i = 0; i <= UCHAR_MAX; ++i) {
+        _code_table[i] = Code{0, uint8_t(_chars_to_codes[i].size())};
+        for (std::size_t j = 0; j < _chars_to_codes[i].size(); ++j) {
+            _code_table[i].bits |= uint64_t(_chars_to_codes[i][j]) << j;
+        }
+    }
 }
 
 void HuffmanArchiver::HuffTree::get_next_code(std::vector<bool> &code) {
-    if (!_cur_node) {
+    if (_cur_node >= _nodes.size()) {
         return;
     }
-    if (code.empty() && _cur_node->is_leaf()) {
+    const TreeNode &node = _nodes[_cur_node];
+    if (code.empty() && node.is_leaf()) {
         code.push_back(true);
     }
-    if (_cur_node->is_leaf()) {
-        _chars_to_codes[_cur_node->get_value()] = code;
+    if (node.is_leaf()) {
+        _chars_to_codes[node.get_value()] = code;
         return;
     }
     code.push_back(true);
-    const TreeNode *tmp_node = _cur_node;
-    _cur_node = tmp_node->get_left_child().get();
+    _cur_node = node.get_left_child();
     get_next_code(code);
     code.pop_back();
     code.push_back(false);
-    _cur_node = tmp_node->get_right_child().get();
+    _cur_node = node.get_right_child();
     get_next_code(code);
     code.pop_back();
 }
 
-HuffmanArchiver::HuffmanArchiver(const std::string &in_filename, const std::string &out_filename):
-        _in_file_size(0), _out_file_size(0), _extra_data_size(0) {
-    _in = std::ifstream(in_filename, std::ios_base::binary);
+HuffmanArchiver::BitReader::BitReader(std::istream &in):
+        _in(&in), _chunk(CHUNK_SIZE), _pos(_chunk.data()), _end(_chunk.data()),
+        _bits(0), _bit_count(0), _loaded_bits(0), _consumed_bits(0) { }
+
+HuffmanArchiver::BitReader::BitReader(const unsigned char *data, std::size_t size) noexcept:
+        _in(nullptr), _pos(data), _end(data + size),
+        _bits(0), _bit_count(0), _loaded_bits(0), _consumed_bits(0) { }
+
+void HuffmanArchiver::BitReader::refill() {
+    while (_bit_count < MIN_REFILL_BITS) {
+        if (_pos == _end && !load_chunk()) {
+            _bit_count = 64;
+            return;
+        }
+        if constexpr (std::endian::native == std::endian::little) {
+            if (_end - _pos >= 8) {
+                uint64_t word;
+                std::memcpy(&word, _pos, sizeof(word));
+                _bits |= word << _bit_count;
+                unsigned bytes = (64 - _bit_count) / CHAR_BIT;
+                _pos += bytes;
+                _bit_count += bytes * CHAR_BIT;
+                _loaded_bits += bytes * CHAR_BIT;
+                continue;
+            }
+        }
+        _bits |= uint64_t(*_pos++) << _bit_count;
+        _bit_count += CHAR_BIT;
+        _loaded_bits += CHAR_BIT;
+    }
+}
+
+uint64_t HuffmanArchiver::BitReader::peek() const noexcept {
+    return _bits;
+}
+
+void HuffmanArchiver::BitReader::consume(unsigned length) noexcept {
+    _bits >>= length;
+    _bit_count -= length;
+    _consumed_bits += length;
+}
+
+unsigned char HuffmanArchiver::BitReader::decode_symbol(const HuffTree::DecodeEntry *table) {
+    const uint64_t mask = (uint64_t(1) << HuffTree::DECODE_TABLE_BITS) - 1;
+    HuffTree::DecodeEntry entry = table[_bits & mask];
+    if (!entry.length) {
+        if (!entry.sub_bits) {
+            throw std::logic_error("Attempt to extract a code from invalid data.");
+        }
+        uint64_t sub_mask = (uint64_t(1) << entry.sub_bits) - 1;
+        entry = table[entry.value + ((_bits >> HuffTree::DECODE_TABLE_BITS) & sub_mask)];
+        if (!entry.length) {
+            throw std::logic_error("Attempt to extract a code from invalid data.");
+        }
+    }
+    consume(entry.length);
+    return entry.value;
+}
+
+uint64_t HuffmanArchiver::BitReader::get_consumed_bits() const noexcept {
+    return _consumed_bits;
+}
+
+uint64_t HuffmanArchiver::BitReader::get_consumed_bytes() const noexcept {
+    return (_consumed_bits + CHAR_BIT - 1) / CHAR_BIT;
+}
+
+bool HuffmanArchiver::BitReader::is_overrun() const noexcept {
+    return _consumed_bits > _loaded_bits;
+}
+
+bool HuffmanArchiver::BitReader::load_chunk() {
     if (!_in) {
-        throw std::invalid_argument("Couldn't open file \"" + in_filename + "\".");
+        return false;
+    }
+    std::ios_base::iostate exceptions = _in->exceptions();
+    _in->exceptions(std::ios_base::badbit);
+    _in->read((char *)_chunk.data(), std::streamsize(_chunk.size()));
+    std::size_t count = _in->gcount();
+    _in->clear();
+    _in->exceptions(exceptions);
+    if (!count) {
+        _in = nullptr;
+        return false;
+    }
+    _pos = _chunk.data();
+    _end = _chunk.data() + count;
+    return true;
+}
+
+HuffmanArchiver::BitWriter::BitWriter(std::ostream &out):
+        _out(&out), _buffer(nullptr), _chunk(CHUNK_SIZE), _data(_chunk.data()), _capacity(CHUNK_SIZE),
+        _chunk_size(0), _bits(0), _bit_count(0), _written_bits(0) { }
+
+HuffmanArchiver::BitWriter::BitWriter(std::vector<unsigned char> &out):
+        _out(nullptr), _buffer(&out), _chunk(CHUNK_SIZE), _data(_chunk.data()), _capacity(CHUNK_SIZE),
+        _chunk_size(0), _bits(0), _bit_count(0), _written_bits(0) { }
+
+HuffmanArchiver::BitWriter::BitWriter(unsigned char *out, std::size_t size) noexcept:
+        _out(nullptr), _buffer(nullptr), _data(out), _capacity(size), _chunk_size(0), _bits(0), _bit_count(0),
+        _written_bits(0) { }
+
+void HuffmanArchiver::BitWriter::write(uint64_t code, unsigned length) {
+    _bits |= code << _bit_count;
+    _bit_count += length;
+    _written_bits += length;
+    if (_bit_count >= 64) {
+        store_word();
+        _bit_count -= 64;
+        _bits = _bit_count ? code >> (length - _bit_count) : 0;
+    }
+}
+
+void HuffmanArchiver::BitWriter::flush() {
+    while (_bit_count) {
+        reserve(1);
+        _data[_chunk_size++] = (unsigned char)_bits;
+        _bits >>= CHAR_BIT;
+        _bit_count = _bit_count > CHAR_BIT ? _bit_count - CHAR_BIT : 0;
+    }
+    _bits = 0;
+    flush_chunk();
+}
+
+uint64_t HuffmanArchiver::BitWriter::get_written_bits() const noexcept {
+    return _written_bits;
+}
+
+uint64_t HuffmanArchiver::BitWriter::get_written_bytes() const noexcept {
+    return (_written_bits + CHAR_BIT - 1) / CHAR_BIT;
+}
+
+void HuffmanArchiver::BitWriter::reserve(std::size_t size) {
+    if (_capacity - _chunk_size >= size) {
+        return;
+    }
+    if (!_out && !_buffer) {
+        throw std::length_error("Output buffer is too small.");
+    }
+    flush_chunk();
+}
+
+void HuffmanArchiver::BitWriter::store_word() {
+    reserve(sizeof(_bits));
+    if constexpr (std::endian::native == std::endian::little) {
+        std::memcpy(_data + _chunk_size, &_bits, sizeof(_bits));
+    } else {
+        for (std::size_t i = 0; i < sizeof(_bits); ++i) {
+            _data[_chunk_size + i] = (unsigned char)(_bits >> (i * CHAR_BIT));
+        }
+    }
+    _chunk_size += sizeof(_bits);
+}
+
+void HuffmanArchiver::BitWriter::flush_chunk() {
+    if (_out) {
+        _out->write((char *)_data, std::streamsize(_chunk_size));
+    } else if (_buffer) {
+        _buffer->insert(_buffer->end(), _data, _data + _chunk_size);
+    } else {
+        return;
+    }
+    _chunk_size = 0;
+}
+
+HuffmanArchiver::MappedFile::MappedFile(const std::string &filename) noexcept: _data(nullptr), _size(0) {
+#ifdef HUFFMAN_HAS_MMAP
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+    struct stat info{};
+    if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+        void *data = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            madvise(data, info.st_size, MADV_SEQUENTIAL);
+            _data = (const unsigned char *)data;
+            _size = info.st_size;
+        }
+    }
+    close(fd);
+#endif
+}
+
+HuffmanArchiver::MappedFile::MappedFile(std::istream &in, std::size_t size): _data(nullptr), _size(0) {
+    _buffer.resize(size);
+    in.read((char *)_buffer.data(), std::streamsize(size));
+    _buffer.resize(in.gcount());
+    if (!_buffer.empty()) {
+        _data = _buffer.data();
+        _size = _buffer.size();
+    }
+}
+
+HuffmanArchiver::MappedFile::~MappedFile() {
+#ifdef HUFFMAN_HAS_MMAP
+    if (_data && _buffer.empty()) {
+        munmap((void *)_data, _size);
+    }
+#endif
+}
+
+bool HuffmanArchiver::MappedFile::is_mapped() const noexcept {
+    return _data;
+}
+
+const unsigned char *HuffmanArchiver::MappedFile::data() const noexcept {
+    return _data;
+}
+
+std::size_t HuffmanArchiver::MappedFile::size() const noexcept {
+    return _size;
+}
+
+HuffmanArchiver::HuffmanArchiver(const std::string &in_filename):
+        _in(nullptr), _out(nullptr), _in_regular(false), _in_file_size(0), _out_file_size(0),
+        _extra_data_size(0), _length_limit_overhead(0), _max_code_length(HuffTree::MAX_CANONICAL_CODE_LENGTH),
+        _thread_count(std::max(std::thread::hardware_concurrency(), 1u)), _block_size(0),
+        _memory_limit(DEFAULT_MEMORY_LIMIT), _interleaved(false), _context_model(false),
+        _context_tables(0), _token_model(false) {
+    if (in_filename == STANDARD_STREAM) {
+        _in.rdbuf(std::cin.rdbuf());
+    } else {
+        _in_file.open(in_filename, std::ios_base::binary);
+        if (!_in_file) {
+            throw std::invalid_argument("Couldn't open file \"" + in_filename + "\".");
+        }
+        _in.rdbuf(_in_file.rdbuf());
+        std::error_code error;
+        _in_regular = std::filesystem::is_regular_file(in_filename, error);
     }
-    _out = std::ofstream(out_filename, std::ios_base::binary);
-    if (!_out) {
-        throw std::invalid_argument("Couldn't open file \"" + out_filename + "\".");
+    _in_map = std::make_unique<MappedFile>(_in_file.is_open() ? in_filename : std::string());
+}
+
+HuffmanArchiver::HuffmanArchiver(const std::string &in_filename, const std::string &out_filename):
+        HuffmanArchiver(in_filename) {
+    if (out_filename == STANDARD_STREAM) {
+        _out.rdbuf(std::cout.rdbuf());
+    } else {
+        _out_file.open(out_filename, std::ios_base::binary);
+        if (!_out_file) {
+            throw std::invalid_argument("Couldn't open file \"" + out_filename + "\".");
+        }
+        _out.rdbuf(_out_file.rdbuf());
     }
+    _out_filename = out_filename;
     _out.exceptions(std::ios_base::badbit | std::ios_base::failbit);
 }
 
-std::uint32_t HuffmanArchiver::get_in_file_size() const noexcept {
+HuffmanArchiver::~HuffmanArchiver() = default;
+
+uint64_t HuffmanArchiver::get_in_file_size() const noexcept {
     return _in_file_size;
 }
 
-std::uint32_t HuffmanArchiver::get_out_file_size() const noexcept {
+uint64_t HuffmanArchiver::get_out_file_size() const noexcept {
     return _out_file_size;
 }
 
-std::uint32_t HuffmanArchiver::get_extra_data_size() const noexcept {
+uint64_t HuffmanArchiver::get_extra_data_size() const noexcept {
     return _extra_data_size;
 }
 
-void HuffmanArchiver::zip() {
-    _in.exceptions(std::ios_base::goodbit);
-    std::array<uint32_t, UCHAR_MAX + 1> vocabulary = build_vocabulary();
-    HuffTree tree(vocabulary);
-    _in.clear();
-    _in_file_size = _in.tellg();
-    _out.write((char *)&_in_file_size, sizeof(_in_file_size));
-    uint32_t vocabulary_size = 0;
-    std::vector<std::pair<unsigned char, uint32_t>> records;
-    for (std::size_t i = 0; i <= UCHAR_MAX; ++i) {
-        if (vocabulary.at(i)) {
-            ++vocabulary_size;
-            records.emplace_back(i, vocabulary.at(i));
-        }
-    }
-    _out.write((char *)&vocabulary_size, sizeof(vocabulary_size));
-    for (auto &record: records) {
-        _out.write((char *)&record.first, sizeof(record.first));
-        _out.write((char *)&record.second, sizeof(record.second));
+uint64_t HuffmanArchiver::get_length_limit_overhead() const noexcept {
+    return _length_limit_overhead;
+}
+
+const HuffmanArchiver::Stats &HuffmanArchiver::get_stats() const noexcept {
+    return _stats;
+}
+
+HuffmanArchiver::Stats &HuffmanArchiver::Stats::operator+=(const Stats &other) noexcept {
+    read_seconds += other.read_seconds;
+    histogram_seconds += other.histogram_seconds;
+    tree_build_seconds += other.tree_build_seconds;
+    code_gen_seconds += other.code_gen_seconds;
+    encode_seconds += other.encode_seconds;
+    decode_seconds += other.decode_seconds;
+    write_seconds += other.write_seconds;
+    total_seconds += other.total_seconds;
+    bytes_read += other.bytes_read;
+    bytes_written += other.bytes_written;
+    max_code_length = std::max(max_code_length, other.max_code_length);
+    block_count += other.block_count;
+    return *this;
+}
+
+void HuffmanArchiver::set_max_code_length(unsigned max_code_length) {
+    if (max_code_length < HuffTree::MIN_CODE_LENGTH_LIMIT || max_code_length > HuffTree::MAX_CODE_LENGTH_LIMIT) {
+        throw std::invalid_argument("Maximum code length must be between " +
+                                    std::to_string(HuffTree::MIN_CODE_LENGTH_LIMIT) + " and " +
+                                    std::to_string(HuffTree::MAX_CODE_LENGTH_LIMIT) + ".");
     }
-    _extra_data_size = _out.tellp();
-    encode(tree);
-    _out_file_size = uint32_t(_out.tellp()) - _extra_data_size;
-    _out.flush();
+    _max_code_length = max_code_length;
 }
 
-void HuffmanArchiver::unzip() {
-    _in.exceptions(std::ios_base::badbit | std::ios_base::failbit);
-    _in.read((char *)&_out_file_size, sizeof(_out_file_size));
-    std::array<uint32_t, UCHAR_MAX + 1> vocabulary = extract_vocabulary();
-    _extra_data_size = _in.tellg();
-    HuffTree tree(vocabulary);
-    decode(tree);
-    _in_file_size = uint32_t(_in.tellg()) - _extra_data_size;
-    _out.flush();
+void HuffmanArchiver::set_thread_count(unsigned thread_count) {
+    if (!thread_count) {
+        throw std::invalid_argument("Thread count must be positive.");
+    }
+    _thread_count = thread_count;
 }
 
-std::array<uint32_t, UCHAR_MAX + 1> HuffmanArchiver::build_vocabulary() {
-    _in.exceptions(std::ios_base::goodbit);
-    std::array<uint32_t, UCHAR_MAX + 1> vocabulary{};
-    unsigned char chr;
-    while (_in.read((char *)&chr, sizeof(chr))) {
-        ++vocabulary.at(chr);
+void HuffmanArchiver::set_block_size(std::size_t block_size) {
+    if (block_size && (block_size < MIN_BLOCK_SIZE || block_size > MAX_BLOCK_SIZE)) {
+        throw std::invalid_argument("Block size must be between " + std::to_string(MIN_BLOCK_SIZE) + " and " +
+                                    std::to_string(MAX_BLOCK_SIZE) + " bytes.");
     }
-    return vocabulary;
+    if (block_size && _token_model) {
+        throw std::invalid_argument(TOKEN_OPTIONS_ERROR);
+    }
+    _block_size = block_size;
 }
 
-std::array<uint32_t, UCHAR_MAX + 1> HuffmanArchiver::extract_vocabulary() {
-    _in.exceptions(std::ios_base::badbit | std::ios_base::failbit);
-    std::array<uint32_t, UCHAR_MAX + 1> vocabulary{};
-    uint32_t vocabulary_size;
-    _in.read((char *)&vocabulary_size, sizeof(vocabulary_size));
-    for (std::size_t i = 0; i < vocabulary_size; ++i) {
-        unsigned char chr;
-        uint32_t frequency;
-        _in.read((char *)&chr, sizeof(chr));
-        _in.read((char *)&frequency, sizeof(frequency));
-        vocabulary.at(chr) = frequency;
+void HuffmanArchiver::set_memory_limit(uint64_t memory_limit) noexcept {
+    _memory_limit = memory_limit;
+}
+
+std::size_t HuffmanArchiver::compress_bound(std::size_t size) noexcept {
+    return sizeof(SIGNATURE) + sizeof(FormatVersion) + sizeof(uint64_t) + size;
+}
+
+uint64_t HuffmanArchiver::decompressed_size(std::span<const std::byte> data) {
+    FormatVersion version;
+    uint64_t size;
+    read_header(data, version, size);
+    return size;
+}
+
+std::vector<std::byte> HuffmanArchiver::compress(std::span<const std::byte> data) {
+    std::vector<std::byte> out(compress_bound(data.size()));
+    out.resize(compress(data, out));
+    return out;
+}
+
+std::size_t HuffmanArchiver::compress(std::span<const std::byte> data, std::span<std::byte> out) {
+    const unsigned char *in = (const unsigned char *)data.data();
+    std::array<uint64_t, UCHAR_MAX + 1> vocabulary{};
+    count_bytes(in, data.size(), vocabulary);
+    uint64_t length_limit_overhead;
+    std::array<uint8_t, UCHAR_MAX + 1> code_lengths = choose_code_lengths(
+            vocabulary, HuffTree::MAX_CANONICAL_CODE_LENGTH, length_limit_overhead);
+    uint64_t size = data.size();
+    uint64_t header_size, payload_size;
+    FormatVersion version = choose_format(vocabulary, code_lengths, size, header_size, payload_size);
+    std::vector<unsigned char> packed;
+    unsigned char symbol;
+    if (version == FormatVersion::run && is_single_symbol(vocabulary, symbol)) {
+        packed.assign(1, symbol);
+    } else if (version == FormatVersion::canonical_64) {
+        packed = pack_code_lengths(code_lengths);
     }
-    return vocabulary;
+    if (out.size() < header_size + payload_size) {
+        throw std::length_error("Output buffer is too small.");
+    }
+    unsigned char *header = (unsigned char *)out.data();
+    std::memcpy(header, SIGNATURE, sizeof(SIGNATURE));
+    std::memcpy(header + sizeof(SIGNATURE), &version, sizeof(version));
+    std::memcpy(header + sizeof(SIGNATURE) + sizeof(version), &size, sizeof(size));
+    if (version == FormatVersion::stored) {
+        std::copy_n(in, size, header + header_size);
+        return header_size + size;
+    }
+    std::copy(packed.begin(), packed.end(), header + header_size - packed.size());
+    if (version == FormatVersion::run) {
+        return header_size;
+    }
+    HuffTree tree(code_lengths);
+    BitWriter writer(header + header_size, out.size() - header_size);
+    encode_symbols(tree, in, data.size(), writer);
+    writer.flush();
+    return header_size + writer.get_written_bytes();
 }
 
-void HuffmanArchiver::fill_buffer(std::queue<bool> &buffer) {
-    unsigned char chr;
-    _in.read((char *)&chr, sizeof(chr));
-    for (std::size_t i = 0; i < CHAR_BIT; ++i) {
-        buffer.push(chr & (1 << i));
+std::vector<std::byte> HuffmanArchiver::decompress(std::span<const std::byte> data) {
+    FormatVersion version;
+    uint64_t size;
+    std::size_t position = read_header(data, version, size);
+    uint64_t max_expansion = version == FormatVersion::tokens ? CHAR_BIT * MAX_TOKEN_LENGTH : CHAR_BIT;
+    if (version != FormatVersion::run && size > uint64_t(data.size() - position) * max_expansion) {
+        throw std::logic_error("Unexpected end of compressed data.");
     }
+    std::vector<std::byte> out(size);
+    decompress(data, out);
+    return out;
 }
 
-void HuffmanArchiver::decode(HuffTree &tree) {
-    _in.exceptions(std::ios_base::badbit | std::ios_base::failbit);
-    std::queue<bool> buffer;
-    unsigned char chr;
-    std::size_t i = 0;
-    while (i < _out_file_size) {
-        if (buffer.empty()) {
-            fill_buffer(buffer);
+std::size_t HuffmanArchiver::decompress(std::span<const std::byte> data, std::span<std::byte> out) {
+    FormatVersion version;
+    uint64_t size;
+    std::size_t position = read_header(data, version, size);
+    if (size > out.size()) {
+        throw std::length_error("Output buffer is too small.");
+    }
+    const unsigned char *in = (const unsigned char *)data.data();
+    if (version == FormatVersion::stored) {
+        if (size > data.size() - position) {
+            throw std::logic_error("Unexpected end of compressed data.");
         }
-        if (tree.try_extract_code(buffer, chr)) {
-            _out.write((char *)&chr, sizeof(chr));
-            ++i;
+        std::copy_n(in + position, size, (unsigned char *)out.data());
+        return size;
+    }
+    if (version == FormatVersion::run) {
+        if (position == data.size()) {
+            throw std::logic_error("Unexpected end of compressed data.");
+        }
+        std::memset(out.data(), in[position], size);
+        return size;
+    }
+    if (version == FormatVersion::tokens) {
+        std::vector<unsigned char> tokens;
+        std::vector<uint32_t> offsets;
+        std::vector<uint8_t> code_lengths;
+        position += unpack_tokens(in + position, data.size() - position, tokens, offsets, code_lengths);
+        decode_tokens(tokens, offsets, code_lengths, in + position, data.size() - position,
+                      (unsigned char *)out.data(), size);
+        return size;
+    }
+    std::array<uint8_t, UCHAR_MAX + 1> code_lengths = unpack_code_lengths([&]() {
+        if (position == data.size()) {
+            throw std::logic_error("Unexpected end of compressed data.");
         }
+        return in[position++];
+    });
+    HuffTree tree(code_lengths);
+    if (!tree.build_decode_table()) {
+        throw std::logic_error("Invalid code lengths.");
     }
+    tree.build_multi_decode_table();
+    decode_block(tree, in + position, data.size() - position, (unsigned char *)out.data(), size);
+    return size;
 }
 
-void HuffmanArchiver::extract_buffer(std::queue<bool> &buffer) {
-    while (buffer.size() >= CHAR_BIT) {
-        unsigned char chr = 0;
-        for (std::size_t i = 0; i < CHAR_BIT; ++i) {
-            chr |= buffer.front() << i;
-            buffer.pop();
-        }
-        _out.write((char *)&chr, sizeof(chr));
+void HuffmanArchiver::set_interleaved(bool interleaved) {
+    if (interleaved && _token_model) {
+        throw std::invalid_argument(TOKEN_OPTIONS_ERROR);
     }
+    _interleaved = interleaved;
 }
 
-void HuffmanArchiver::encode(HuffTree &tree) {
-    _in.clear();
-    _in.seekg(0);
-    _in.exceptions(std::ios_base::goodbit);
-    std::queue<bool> buffer;
-    unsigned char chr;
-    while (_in.read((char *)&chr, sizeof(chr))) {
-        extract_buffer(buffer);
-        for (auto bit: tree.get_code_by_char(chr)) {
-            buffer.push(bit);
+void HuffmanArchiver::set_context_model(bool context_model) {
+    if (context_model && _token_model) {
+        throw std::invalid_argument(TOKEN_OPTIONS_ERROR);
+    }
+    _context_model = context_model;
+}
+
+void HuffmanArchiver::set_context_tables(unsigned context_tables) {
+    if (context_tables && (context_tables < MIN_CONTEXT_TABLES || context_tables > MAX_CONTEXT_TABLES)) {
+        throw std::invalid_argument("Context table count must be between " + std::to_string(MIN_CONTEXT_TABLES) +
+                                    " and " + std::to_string(MAX_CONTEXT_TABLES) + ".");
+    }
+    if (context_tables && _token_model) {
+        throw std::invalid_argument(TOKEN_OPTIONS_ERROR);
+    }
+    _context_tables = context_tables;
+}
+
+void HuffmanArchiver::set_token_model(bool token_model) {
+    if (token_model && (_block_size || _interleaved || _context_model || _context_tables)) {
+        throw std::invalid_argument(TOKEN_OPTIONS_ERROR);
+    }
+    _token_model = token_model;
+}
+
+void HuffmanArchiver::zip() {
+    _stats = Stats{};
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    _in.exceptions(std::ios_base::goodbit);
+    if ((_interleaved || _context_model) && !_block_size) {
+        _block_size = DEFAULT_BLOCK_SIZE;
+    }
+    if (is_streaming()) {
+        zip_stream();
+    } else if (_token_model) {
+        zip_tokens();
+    } else if (_block_size) {
+        zip_blocks();
+    } else {
+        zip_single();
+    }
+    std::chrono::steady_clock::time_point write_start = std::chrono::steady_clock::now();
+    _out.flush();
+    _stats.write_seconds += lap(write_start);
+    _stats.bytes_read = _in_file_size;
+    _stats.bytes_written = _out_file_size + _extra_data_size;
+    finish_stats(start, _in_file_size, _out_file_size);
+}
+
+void HuffmanArchiver::zip_single() {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    load_input();
+    _stats.read_seconds += lap(start);
+    std::array<uint64_t, UCHAR_MAX + 1> vocabulary = build_vocabulary();
+    _stats.histogram_seconds += lap(start);
+    std::array<uint8_t, UCHAR_MAX + 1> code_lengths = choose_code_lengths(vocabulary, _max_code_length,
+                                                                          _length_limit_overhead);
+    _in.clear();
+    _in_file_size = _in_map->is_mapped() ? _in_map->size() : uint64_t(_in.tellg());
+    uint64_t header_size, payload_size;
+    FormatVersion version = choose_format(vocabulary, code_lengths, _in_file_size, header_size, payload_size);
+    _stats.tree_build_seconds += lap(start);
+    unsigned char symbol;
+    if (version == FormatVersion::run && is_single_symbol(vocabulary, symbol)) {
+        write_header(FormatVersion::run);
+        _out.write((char *)&symbol, sizeof(symbol));
+        _extra_data_size = _out.tellp();
+        _out_file_size = 0;
+        _length_limit_overhead = 0;
+        _stats.write_seconds += lap(start);
+        return;
+    }
+    if (version == FormatVersion::stored) {
+        write_header(FormatVersion::stored);
+        _extra_data_size = _out.tellp();
+        store_input();
+        _out_file_size = uint64_t(_out.tellp()) - _extra_data_size;
+        _length_limit_overhead = 0;
+        _stats.write_seconds += lap(start);
+        return;
+    }
+    _stats.max_code_length = *std::max_element(code_lengths.begin(), code_lengths.end());
+    write_header(FormatVersion::canonical_64);
+    write_code_lengths(code_lengths);
+    _stats.write_seconds += lap(start);
+    HuffTree tree(code_lengths);
+    _stats.code_gen_seconds += lap(start);
+    _extra_data_size = _out.tellp();
+    encode(tree);
+    _out_file_size = uint64_t(_out.tellp()) - _extra_data_size;
+    _stats.encode_seconds += lap(start);
+}
+
+void HuffmanArchiver::unzip() {
+    _stats = Stats{};
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    _in.exceptions(std::ios_base::badbit | std::ios_base::failbit);
+    FormatVersion version = extract_header();
+    _stats.read_seconds += lap(start);
+    if (version == FormatVersion::stream || (version == FormatVersion::blocks && is_streaming())) {
+        unzip_stream(version);
+    } else if (!_in_file.is_open() || !_in_regular) {
+        throw std::logic_error("Only block archives can be unpacked from a stream.");
+    } else if (version == FormatVersion::blocks) {
+        unzip_blocks();
+    } else {
+        unzip_single(version);
+    }
+    std::chrono::steady_clock::time_point write_start = std::chrono::steady_clock::now();
+    _out.flush();
+    _stats.write_seconds += lap(write_start);
+    _stats.bytes_read = _in_file_size + _extra_data_size;
+    _stats.bytes_written = _out_file_size;
+    finish_stats(start, _out_file_size, _in_file_size);
+}
+
+void HuffmanArchiver::unzip_single(FormatVersion version) {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    if (version == FormatVersion::stored) {
+        _extra_data_size = _in.tellg();
+        extract_stored();
+        _in_file_size = _out_file_size;
+        _stats.decode_seconds += lap(start);
+        return;
+    }
+    if (version == FormatVersion::run) {
+        extract_run();
+        _extra_data_size = _in.tellg();
+        _in_file_size = 0;
+        _stats.decode_seconds += lap(start);
+        return;
+    }
+    if (version == FormatVersion::tokens) {
+        extract_tokens();
+        return;
+    }
+    std::unique_ptr<HuffTree> tree = extract_tree(version);
+    _extra_data_size = _in.tellg();
+    _stats.tree_build_seconds += lap(start);
+    decode(*tree);
+    _in_file_size = uint64_t(_in.tellg()) - _extra_data_size;
+}
+
+void HuffmanArchiver::estimate() {
+    _stats = Stats{};
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    _in.exceptions(std::ios_base::goodbit);
+    if ((_interleaved || _context_model) && !_block_size) {
+        _block_size = DEFAULT_BLOCK_SIZE;
+    }
+    TokenLayout layout;
+    if (_token_model && _in_file.is_open() && _in_regular && prefer_tokens(layout)) {
+        _in_file_size = _in_map->size();
+        _extra_data_size = sizeof(SIGNATURE) + sizeof(FormatVersion) + sizeof(uint64_t) + layout.dictionary.size();
+        _out_file_size = layout.payload_size;
+        _length_limit_overhead = layout.length_limit_overhead;
+    } else if (_block_size || !_in_file.is_open() || !_in_regular) {
+        estimate_blocks();
+    } else {
+        std::chrono::steady_clock::time_point phase_start = start;
+        std::array<uint64_t, UCHAR_MAX + 1> vocabulary = build_vocabulary();
+        _stats.histogram_seconds += lap(phase_start);
+        std::array<uint8_t, UCHAR_MAX + 1> code_lengths = choose_code_lengths(vocabulary, _max_code_length,
+                                                                              _length_limit_overhead);
+        _in_file_size = 0;
+        for (uint64_t frequency: vocabulary) {
+            _in_file_size += frequency;
+        }
+        FormatVersion version = choose_format(vocabulary, code_lengths, _in_file_size, _extra_data_size,
+                                              _out_file_size);
+        if (version != FormatVersion::canonical_64) {
+            _length_limit_overhead = 0;
+        } else {
+            _stats.max_code_length = *std::max_element(code_lengths.begin(), code_lengths.end());
+        }
+        _stats.tree_build_seconds += lap(phase_start);
+    }
+    _stats.bytes_read = _in_file_size;
+    finish_stats(start, _in_file_size, _out_file_size);
+}
+
+double HuffmanArchiver::lap(std::chrono::steady_clock::time_point &start) noexcept {
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    double seconds = std::chrono::duration<double>(now - start).count();
+    start = now;
+    return seconds;
+}
+
+void HuffmanArchiver::finish_stats(std::chrono::steady_clock::time_point start, uint64_t original_size,
+                                   uint64_t payload_size) {
+    _stats.total_seconds = lap(start);
+    _stats.average_code_length = original_size ? double(payload_size) * CHAR_BIT / double(original_size) : 0;
+}
+
+void HuffmanArchiver::load_input() {
+    if (_in_map->is_mapped()) {
+        return;
+    }
+    _in.clear();
+    _in.seekg(0, std::ios_base::end);
+    std::streamoff size = _in.tellg();
+    _in.seekg(0);
+    if (size < 0 || !_in) {
+        throw std::runtime_error("Couldn't read input file.");
+    }
+    if (!size || uint64_t(size) > _memory_limit) {
+        return;
+    }
+    try {
+        _in_map = std::make_unique<MappedFile>(_in, std::size_t(size));
+    } catch (const std::bad_alloc &) {
+        _in.clear();
+        _in.seekg(0);
+    }
+}
+
+std::array<uint64_t, UCHAR_MAX + 1> HuffmanArchiver::build_vocabulary() {
+    _in.exceptions(std::ios_base::goodbit);
+    std::array<uint64_t, UCHAR_MAX + 1> vocabulary{};
+    if (_in_map->is_mapped()) {
+        count_bytes_parallel(_in_map->data(), _in_map->size(), _thread_count, vocabulary);
+        return vocabulary;
+    }
+    std::vector<unsigned char> buffer(BitReader::CHUNK_SIZE);
+    while (_in.read((char *)buffer.data(), std::streamsize(buffer.size())) || _in.gcount()) {
+        count_bytes(buffer.data(), _in.gcount(), vocabulary);
+    }
+    return vocabulary;
+}
+
+void HuffmanArchiver::count_bytes(const unsigned char *data, std::size_t size,
+                                  std::array<uint64_t, UCHAR_MAX + 1> &vocabulary) {
+    std::array<std::array<uint64_t, UCHAR_MAX + 1>, INTERLEAVED_STREAMS> vocabularies{};
+    count_streams(data, size, vocabularies);
+    for (std::size_t chr = 0; chr <= UCHAR_MAX; ++chr) {
+        vocabulary[chr] += vocabularies[0][chr] + vocabularies[1][chr] + vocabularies[2][chr] + vocabularies[3][chr];
+    }
+}
+
+void HuffmanArchiver::count_streams(const unsigned char *data, std::size_t size,
+                                    std::array<std::array<uint64_t, UCHAR_MAX + 1>, INTERLEAVED_STREAMS> &vocabularies) {
+    const std::size_t segment_size = std::size_t(1) << 30;
+    std::array<std::array<uint32_t, UCHAR_MAX + 1>, INTERLEAVED_STREAMS> counts;
+    while (size) {
+        std::size_t count = std::min(size, segment_size);
+        for (auto &table: counts) {
+            table.fill(0);
+        }
+        std::size_t i = 0;
+        for (; i + 4 <= count; i += 4) {
+            ++counts[0][data[i]];
+            ++counts[1][data[i + 1]];
+            ++counts[2][data[i + 2]];
+            ++counts[3][data[i + 3]];
+        }
+        for (; i < count; ++i) {
+            ++counts[i % INTERLEAVED_STREAMS][data[i]];
+        }
+        for (std::size_t stream = 0; stream < INTERLEAVED_STREAMS; ++stream) {
+            for (std::size_t chr = 0; chr <= UCHAR_MAX; ++chr) {
+                vocabularies[stream][chr] += counts[stream][chr];
+            }
+        }
+        data += count;
+        size -= count;
+    }
+}
+
+void HuffmanArchiver::count_contexts(const unsigned char *data, std::size_t size,
+                                     std::vector<std::array<uint64_t, UCHAR_MAX + 1>> &contexts) {
+    contexts.assign(CONTEXT_COUNT, std::array<uint64_t, UCHAR_MAX + 1>{});
+    std::size_t segment_size = (size + INTERLEAVED_STREAMS - 1) / INTERLEAVED_STREAMS;
+    for (std::size_t begin = 0; begin < size; begin += segment_size) {
+        unsigned char previous = 0;
+        for (std::size_t i = begin; i < std::min(size, begin + segment_size); ++i) {
+            ++contexts[previous][data[i]];
+            previous = data[i];
+        }
+    }
+}
+
+void HuffmanArchiver::count_bytes_parallel(const unsigned char *data, std::size_t size, unsigned thread_count,
+                                           std::array<uint64_t, UCHAR_MAX + 1> &vocabulary) {
+    thread_count = std::min<std::size_t>(thread_count, size / PARALLEL_HISTOGRAM_MIN_SIZE);
+    if (thread_count <= 1) {
+        count_bytes(data, size, vocabulary);
+        return;
+    }
+    std::vector<std::array<uint64_t, UCHAR_MAX + 1>> partial_vocabularies(thread_count);
+    std::size_t piece_size = (size + thread_count - 1) / thread_count;
+    run_parallel(thread_count, thread_count, [&](std::size_t i) {
+        std::size_t begin = std::min(size, i * piece_size);
+        partial_vocabularies[i].fill(0);
+        count_bytes(data + begin, std::min(size - begin, piece_size), partial_vocabularies[i]);
+    });
+    for (auto &partial_vocabulary: partial_vocabularies) {
+        for (std::size_t chr = 0; chr <= UCHAR_MAX; ++chr) {
+            vocabulary[chr] += partial_vocabulary[chr];
+        }
+    }
+}
+
+void HuffmanArchiver::run_parallel(std::size_t task_count, unsigned thread_count,
+                                   const std::function<void(std::size_t)> &task) {
+    std::atomic<std::size_t> next_task(0);
+    std::exception_ptr error;
+    std::mutex error_mutex;
+    auto worker = [&]() {
+        for (std::size_t i = next_task++; i < task_count; i = next_task++) {
+            try {
+                task(i);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(error_mutex);
+                if (!error) {
+                    error = std::current_exception();
+                }
+                next_task = task_count;
+            }
+        }
+    };
+    std::vector<std::thread> threads;
+    for (std::size_t i = 1; i < std::min<std::size_t>(thread_count, task_count); ++i) {
+        try {
+            threads.emplace_back(worker);
+        } catch (const std::system_error &) {
+            break;
+        }
+    }
+    worker();
+    for (auto &thread: threads) {
+        thread.join();
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+std::array<uint8_t, UCHAR_MAX + 1> HuffmanArchiver::choose_code_lengths(
+        const std::array<uint64_t, UCHAR_MAX + 1> &vocabulary, unsigned max_code_length,
+        uint64_t &length_limit_overhead) {
+    std::vector<uint64_t> frequencies(vocabulary.begin(), vocabulary.end());
+    std::vector<uint8_t> optimal_lengths = HuffTree::build_code_lengths(frequencies);
+    std::vector<uint8_t> lengths = HuffTree::build_limited_code_lengths(frequencies, max_code_length);
+    uint64_t optimal_bits = 0;
+    uint64_t limited_bits = 0;
+    for (std::size_t i = 0; i <= UCHAR_MAX; ++i) {
+        optimal_bits += frequencies[i] * optimal_lengths[i];
+        limited_bits += frequencies[i] * lengths[i];
+    }
+    length_limit_overhead = (limited_bits + CHAR_BIT - 1) / CHAR_BIT - (optimal_bits + CHAR_BIT - 1) / CHAR_BIT;
+    std::array<uint8_t, UCHAR_MAX + 1> code_lengths{};
+    std::copy(lengths.begin(), lengths.end(), code_lengths.begin());
+    return code_lengths;
+}
+
+uint64_t HuffmanArchiver::encoded_size(const std::array<uint64_t, UCHAR_MAX + 1> &vocabulary,
+                                       const std::array<uint8_t, UCHAR_MAX + 1> &code_lengths) noexcept {
+    uint64_t bits = 0;
+    for (std::size_t i = 0; i <= UCHAR_MAX; ++i) {
+        bits += vocabulary[i] * code_lengths[i];
+    }
+    return (bits + CHAR_BIT - 1) / CHAR_BIT;
+}
+
+bool HuffmanArchiver::is_single_symbol(const std::array<uint64_t, UCHAR_MAX + 1> &vocabulary,
+                                       unsigned char &symbol) noexcept {
+    std::size_t count = 0;
+    for (std::size_t i = 0; i <= UCHAR_MAX; ++i) {
+        if (vocabulary[i]) {
+            symbol = i;
+            ++count;
+        }
+    }
+    return count == 1;
+}
+
+HuffmanArchiver::FormatVersion HuffmanArchiver::choose_format(
+        const std::array<uint64_t, UCHAR_MAX + 1> &vocabulary, const std::array<uint8_t, UCHAR_MAX + 1> &code_lengths,
+        uint64_t size, uint64_t &header_size, uint64_t &payload_size) {
+    header_size = sizeof(SIGNATURE) + sizeof(FormatVersion) + sizeof(uint64_t);
+    unsigned char symbol;
+    if (is_single_symbol(vocabulary, symbol)) {
+        header_size += sizeof(symbol);
+        payload_size = 0;
+        return FormatVersion::run;
+    }
+    uint64_t packed_size = pack_code_lengths(code_lengths).size();
+    payload_size = encoded_size(vocabulary, code_lengths);
+    if (packed_size + payload_size >= size) {
+        payload_size = size;
+        return FormatVersion::stored;
+    }
+    header_size += packed_size;
+    return FormatVersion::canonical_64;
+}
+
+std::array<uint64_t, UCHAR_MAX + 1> HuffmanArchiver::extract_vocabulary() {
+    _in.exceptions(std::ios_base::badbit | std::ios_base::failbit);
+    std::array<uint64_t, UCHAR_MAX + 1> vocabulary{};
+    uint32_t vocabulary_size;
+    _in.read((char *)&vocabulary_size, sizeof(vocabulary_size));
+    for (std::size_t i = 0; i < vocabulary_size; ++i) {
+        unsigned char chr;
+        uint32_t frequency;
+        _in.read((char *)&chr, sizeof(chr));
+        _in.read((char *)&frequency, sizeof(frequency));
+        vocabulary.at(chr) = frequency;
+    }
+    return vocabulary;
+}
+
+void HuffmanArchiver::write_header(FormatVersion version) {
+    _out.write(SIGNATURE, sizeof(SIGNATURE));
+    _out.write((char *)&version, sizeof(version));
+    _out.write((char *)&_in_file_size, sizeof(_in_file_size));
+    if (version == FormatVersion::blocks) {
+        uint32_t block_size = _block_size;
+        _out.write((char *)&block_size, sizeof(block_size));
+    }
+}
+
+bool HuffmanArchiver::is_legacy_header(uint32_t out_file_size) {
+    std::streampos position = _in.tellg();
+    if (position == std::streampos(-1)) {
+        return false;
+    }
+    _in.exceptions(std::ios_base::goodbit);
+    uint32_t vocabulary_size = 0;
+    _in.read((char *)&vocabulary_size, sizeof(vocabulary_size));
+    bool valid = _in && vocabulary_size && vocabulary_size <= UCHAR_MAX + 1;
+    std::array<bool, UCHAR_MAX + 1> seen{};
+    uint64_t total_frequency = 0;
+    for (uint32_t i = 0; valid && i < vocabulary_size; ++i) {
+        unsigned char chr = 0;
+        uint32_t frequency = 0;
+        _in.read((char *)&chr, sizeof(chr));
+        _in.read((char *)&frequency, sizeof(frequency));
+        valid = _in && !seen[chr];
+        seen[chr] = true;
+        total_frequency += frequency;
+    }
+    _in.clear();
+    _in.seekg(position);
+    _in.exceptions(std::ios_base::badbit | std::ios_base::failbit);
+    return valid && total_frequency == out_file_size;
+}
+
+HuffmanArchiver::FormatVersion HuffmanArchiver::extract_header() {
+    _in.exceptions(std::ios_base::badbit | std::ios_base::failbit);
+    char signature[sizeof(SIGNATURE) + 1];
+    _in.read(signature, sizeof(signature));
+    uint32_t legacy_size;
+    std::memcpy(&legacy_size, signature, sizeof(legacy_size));
+    if (!std::equal(SIGNATURE, SIGNATURE + sizeof(SIGNATURE), signature) || is_legacy_header(legacy_size)) {
+        _out_file_size = legacy_size;
+        return FormatVersion::legacy;
+    }
+    FormatVersion version = FormatVersion(signature[sizeof(SIGNATURE)]);
+    if (version == FormatVersion::canonical) {
+        uint32_t out_file_size;
+        _in.read((char *)&out_file_size, sizeof(out_file_size));
+        _out_file_size = out_file_size;
+    } else if (version == FormatVersion::canonical_64 || version == FormatVersion::stored ||
+               version == FormatVersion::run || version == FormatVersion::tokens) {
+        _in.read((char *)&_out_file_size, sizeof(_out_file_size));
+    } else if (version == FormatVersion::blocks) {
+        _in.read((char *)&_out_file_size, sizeof(_out_file_size));
+        uint32_t block_size;
+        _in.read((char *)&block_size, sizeof(block_size));
+        if (block_size < MIN_BLOCK_SIZE || block_size > MAX_BLOCK_SIZE) {
+            throw std::logic_error("Invalid block size.");
+        }
+        _block_size = block_size;
+    } else if (version == FormatVersion::stream) {
+        _out_file_size = 0;
+        uint32_t block_size;
+        _in.read((char *)&block_size, sizeof(block_size));
+        if (block_size < MIN_BLOCK_SIZE || block_size > MAX_BLOCK_SIZE) {
+            throw std::logic_error("Invalid block size.");
+        }
+        _block_size = block_size;
+    } else {
+        throw std::logic_error("Unsupported archive version.");
+    }
+    return version;
+}
+
+std::vector<unsigned char> HuffmanArchiver::pack_code_lengths(const std::array<uint8_t, UCHAR_MAX + 1> &code_lengths) {
+    std::vector<uint8_t> nibbles;
+    for (std::size_t i = 0; i <= UCHAR_MAX;) {
+        if (code_lengths[i]) {
+            nibbles.push_back(code_lengths[i++]);
+            continue;
+        }
+        std::size_t run = 0;
+        while (i <= UCHAR_MAX && !code_lengths[i]) {
+            ++run;
+            ++i;
+        }
+        nibbles.insert(nibbles.end(), {0, uint8_t((run - 1) >> 4), uint8_t((run - 1) & 0xf)});
+    }
+    uint8_t run_length = nibbles.size() < code_lengths.size();
+    if (!run_length) {
+        nibbles.assign(code_lengths.begin(), code_lengths.end());
+    }
+    std::vector<unsigned char> packed(1 + (nibbles.size() + 1) / 2, 0);
+    packed[0] = run_length;
+    for (std::size_t i = 0; i < nibbles.size(); ++i) {
+        packed[1 + i / 2] |= nibbles[i] << (i % 2 * 4);
+    }
+    return packed;
+}
+
+std::size_t HuffmanArchiver::read_header(std::span<const std::byte> data, FormatVersion &version, uint64_t &size) {
+    const unsigned char *in = (const unsigned char *)data.data();
+    std::size_t position = sizeof(SIGNATURE) + sizeof(FormatVersion);
+    if (data.size() < position || !std::equal(SIGNATURE, SIGNATURE + sizeof(SIGNATURE), (const char *)in)) {
+        throw std::logic_error("Unsupported archive version.");
+    }
+    version = FormatVersion(in[sizeof(SIGNATURE)]);
+    if (version == FormatVersion::canonical) {
+        uint32_t size_32;
+        if (data.size() - position < sizeof(size_32)) {
+            throw std::logic_error("Unexpected end of compressed data.");
+        }
+        std::memcpy(&size_32, in + position, sizeof(size_32));
+        size = size_32;
+        return position + sizeof(size_32);
+    }
+    if (version != FormatVersion::canonical_64 && version != FormatVersion::stored && version != FormatVersion::run &&
+        version != FormatVersion::tokens) {
+        throw std::logic_error("Unsupported archive version.");
+    }
+    if (data.size() - position < sizeof(size)) {
+        throw std::logic_error("Unexpected end of compressed data.");
+    }
+    std::memcpy(&size, in + position, sizeof(size));
+    return position + sizeof(size);
+}
+
+void HuffmanArchiver::write_code_lengths(const std::array<uint8_t, UCHAR_MAX + 1> &code_lengths) {
+    std::vector<unsigned char> packed = pack_code_lengths(code_lengths);
+    _out.write((char *)packed.data(), std::streamsize(packed.size()));
+}
+
+std::array<uint8_t, UCHAR_MAX + 1> HuffmanArchiver::extract_code_lengths() {
+    _in.exceptions(std::ios_base::badbit | std::ios_base::failbit);
+    return unpack_code_lengths([this]() {
+        unsigned char byte;
+        _in.read((char *)&byte, sizeof(byte));
+        return byte;
+    });
+}
+
+std::array<uint8_t, UCHAR_MAX + 1> HuffmanArchiver::unpack_code_lengths(
+        const std::function<unsigned char()> &next_byte) {
+    std::array<uint8_t, UCHAR_MAX + 1> code_lengths{};
+    uint8_t run_length = next_byte();
+    if (run_length > 1) {
+        throw std::logic_error("Invalid code lengths.");
+    }
+    unsigned char packed = 0;
+    std::size_t nibble_count = 0;
+    auto next_nibble = [&]() {
+        if (nibble_count++ % 2 == 0) {
+            packed = next_byte();
+            return uint8_t(packed & 0xf);
+        }
+        return uint8_t(packed >> 4);
+    };
+    for (std::size_t i = 0; i <= UCHAR_MAX;) {
+        uint8_t length = next_nibble();
+        if (length || !run_length) {
+            code_lengths[i++] = length;
+            continue;
+        }
+        uint8_t high = next_nibble();
+        uint8_t low = next_nibble();
+        std::size_t run = (high << 4 | low) + 1;
+        if (i + run > code_lengths.size()) {
+            throw std::logic_error("Invalid code lengths.");
+        }
+        i += run;
+    }
+    return code_lengths;
+}
+
+std::unique_ptr<HuffmanArchiver::HuffTree> HuffmanArchiver::extract_tree(FormatVersion version) {
+    if (version == FormatVersion::legacy) {
+        return std::make_unique<HuffTree>(extract_vocabulary());
+    }
+    return std::make_unique<HuffTree>(extract_code_lengths());
+}
+
+std::vector<HuffmanArchiver::BlockEntry> HuffmanArchiver::extract_block_index() {
+    _in.exceptions(std::ios_base::badbit | std::ios_base::failbit);
+    std::streampos start = _in.tellg();
+    uint64_t index_offset;
+    _in.seekg(-std::streamoff(sizeof(index_offset)), std::ios_base::end);
+    uint64_t archive_size = uint64_t(_in.tellg()) + sizeof(index_offset);
+    _in.read((char *)&index_offset, sizeof(index_offset));
+    uint64_t block_count = (_out_file_size + _block_size - 1) / _block_size;
+    const uint64_t entry_size = sizeof(BlockEntry::offset) + sizeof(BlockEntry::size);
+    if (index_offset < uint64_t(start) || index_offset > archive_size - sizeof(index_offset) ||
+        archive_size - sizeof(index_offset) - index_offset != block_count * entry_size) {
+        throw std::logic_error("Invalid block index.");
+    }
+    std::vector<BlockEntry> index(block_count + 1);
+    _in.seekg(std::streamoff(index_offset));
+    uint64_t previous_offset = start;
+    for (uint64_t i = 0; i < block_count; ++i) {
+        _in.read((char *)&index[i].offset, sizeof(index[i].offset));
+        _in.read((char *)&index[i].size, sizeof(index[i].size));
+        uint64_t expected_size = std::min<uint64_t>(_block_size, _out_file_size - i * _block_size);
+        if ((i ? index[i].offset <= previous_offset : index[i].offset != previous_offset) ||
+            index[i].offset >= index_offset || index[i].size != expected_size) {
+            throw std::logic_error("Invalid block index.");
+        }
+        previous_offset = index[i].offset;
+    }
+    index[block_count] = {index_offset, 0};
+    _in.seekg(start);
+    return index;
+}
+
+void HuffmanArchiver::fill_buffer(std::queue<bool> &buffer) {
+    unsigned char chr;
+    _in.read((char *)&chr, sizeof(chr));
+    for (std::size_t i = 0; i < CHAR_BIT; ++i) {
+        buffer.push(chr & (1 << i));
+    }
+}
+
+void HuffmanArchiver::decode(HuffTree &tree, DecodeMode mode) {
+    for (const HuffTree::Code &code: tree.get_code_table()) {
+        _stats.max_code_length = std::max<unsigned>(_stats.max_code_length, code.length);
+    }
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    if (mode != DecodeMode::tree_walk && tree.build_decode_table()) {
+        if (mode == DecodeMode::multi_table) {
+            tree.build_multi_decode_table();
+        }
+        _stats.code_gen_seconds += lap(start);
+        decode_table(tree);
+    } else {
+        decode_tree_walk(tree);
+    }
+    _stats.decode_seconds += lap(start);
+}
+
+void HuffmanArchiver::decode_table(HuffTree &tree) {
+    _in.exceptions(std::ios_base::badbit | std::ios_base::failbit);
+    std::streampos start = _in.tellg();
+    std::optional<BitReader> reader_storage;
+    if (_in_map->is_mapped() && std::size_t(start) <= _in_map->size()) {
+        reader_storage.emplace(_in_map->data() + start, _in_map->size() - start);
+    } else {
+        reader_storage.emplace(_in);
+    }
+    BitReader &reader = *reader_storage;
+    std::vector<unsigned char> buffer(BitReader::CHUNK_SIZE);
+    std::size_t i = 0;
+    while (i < _out_file_size) {
+        std::size_t count = std::min<std::size_t>(buffer.size(), _out_file_size - i);
+        decode_symbols(tree, reader, buffer.data(), count);
+        if (reader.is_overrun()) {
+            throw std::logic_error("Unexpected end of compressed data.");
+        }
+        _out.write((char *)buffer.data(), std::streamsize(count));
+        i += count;
+    }
+    _in.seekg(start + std::streamoff(reader.get_consumed_bytes()));
+}
+
+void HuffmanArchiver::decode_symbols(const HuffTree &tree, BitReader &reader, unsigned char *out,
+                                     std::size_t count) {
+    const HuffTree::DecodeEntry *table = tree.get_decode_table().data();
+    const std::vector<HuffTree::MultiDecodeEntry> &multi_table = tree.get_multi_decode_table();
+    std::size_t i = 0;
+    if (!multi_table.empty()) {
+        const uint64_t mask = (uint64_t(1) << HuffTree::MULTI_DECODE_TABLE_BITS) - 1;
+        const std::size_t lookups_per_refill = BitReader::MIN_REFILL_BITS / HuffTree::MAX_TABLE_CODE_LENGTH;
+        while (i + lookups_per_refill * HuffTree::MAX_MULTI_SYMBOLS <= count) {
+            reader.refill();
+            for (std::size_t j = 0; j < lookups_per_refill; ++j) {
+                const HuffTree::MultiDecodeEntry &entry = multi_table[reader.peek() & mask];
+                if (entry.count) {
+                    std::memcpy(out + i, entry.symbols, HuffTree::MAX_MULTI_SYMBOLS);
+                    reader.consume(entry.length);
+                    i += entry.count;
+                } else {
+                    out[i++] = reader.decode_symbol(table);
+                }
+            }
+        }
+    }
+    for (; i < count; ++i) {
+        reader.refill();
+        out[i] = reader.decode_symbol(table);
+    }
+}
+
+void HuffmanArchiver::decode_interleaved(const HuffTree &tree, const unsigned char *data,
+                                         const std::array<uint32_t, INTERLEAVED_STREAMS> &sizes,
+                                         unsigned char *out, std::size_t count) {
+    BitReader reader0(data, sizes[0]);
+    BitReader reader1(data + sizes[0], sizes[1]);
+    BitReader reader2(data + sizes[0] + sizes[1], sizes[2]);
+    BitReader reader3(data + sizes[0] + sizes[1] + sizes[2], sizes[3]);
+    const HuffTree::DecodeEntry *table = tree.get_decode_table().data();
+    std::size_t i = 0;
+    const std::size_t symbols_per_refill = BitReader::MIN_REFILL_BITS / HuffTree::MAX_CANONICAL_CODE_LENGTH;
+    for (; i + INTERLEAVED_STREAMS * symbols_per_refill <= count; i += INTERLEAVED_STREAMS * symbols_per_refill) {
+        reader0.refill();
+        reader1.refill();
+        reader2.refill();
+        reader3.refill();
+        for (std::size_t j = 0; j < symbols_per_refill; ++j) {
+            out[i + j * INTERLEAVED_STREAMS] = reader0.decode_symbol(table);
+            out[i + j * INTERLEAVED_STREAMS + 1] = reader1.decode_symbol(table);
+            out[i + j * INTERLEAVED_STREAMS + 2] = reader2.decode_symbol(table);
+            out[i + j * INTERLEAVED_STREAMS + 3] = reader3.decode_symbol(table);
+        }
+    }
+    BitReader *readers[INTERLEAVED_STREAMS] = {&reader0, &reader1, &reader2, &reader3};
+    for (; i < count; ++i) {
+        readers[i % INTERLEAVED_STREAMS]->refill();
+        out[i] = readers[i % INTERLEAVED_STREAMS]->decode_symbol(table);
+    }
+    for (BitReader *reader: readers) {
+        if (reader->is_overrun()) {
+            throw std::logic_error("Unexpected end of compressed data.");
+        }
+    }
+}
+
+void HuffmanArchiver::decode_block(const HuffTree &tree, const unsigned char *data, std::size_t size,
+                                   unsigned char *out, std::size_t count) {
+    BitReader reader(data, size);
+    decode_symbols(tree, reader, out, count);
+    if (reader.is_overrun()) {
+        throw std::logic_error("Unexpected end of compressed data.");
+    }
+}
+
+void HuffmanArchiver::decode_contexts(const std::vector<std::unique_ptr<HuffTree>> &trees,
+                                      const std::array<uint16_t, CONTEXT_COUNT> &context_map,
+                                      const unsigned char *data,
+                                      const std::array<uint32_t, INTERLEAVED_STREAMS> &sizes,
+                                      unsigned char *out, std::size_t count) {
+    struct ContextTable {
+        const HuffTree::DecodeEntry *entries;
+        uint64_t mask;
+    };
+    static const std::vector<HuffTree::DecodeEntry> unused_table(std::size_t(1) << HuffTree::DECODE_TABLE_BITS);
+    std::vector<std::size_t> offsets;
+    std::vector<uint64_t> masks;
+    std::vector<HuffTree::DecodeEntry> entries;
+    for (const std::unique_ptr<HuffTree> &tree: trees) {
+        const std::vector<HuffTree::DecodeEntry> &table = tree->get_decode_table();
+        unsigned max_length = 0;
+        for (const HuffTree::Code &code: tree->get_code_table()) {
+            max_length = std::max<unsigned>(max_length, code.length);
+        }
+        unsigned table_bits = std::min(max_length, HuffTree::DECODE_TABLE_BITS);
+        offsets.push_back(entries.size());
+        masks.push_back((uint64_t(1) << table_bits) - 1);
+        entries.insert(entries.end(), table.begin(),
+                       max_length <= HuffTree::DECODE_TABLE_BITS ? table.begin() + (1 << table_bits) : table.end());
+    }
+    std::array<ContextTable, CONTEXT_COUNT> tables;
+    for (std::size_t context = 0; context < CONTEXT_COUNT; ++context) {
+        std::size_t index = context_map[context];
+        tables[context] = index < trees.size() ? ContextTable{entries.data() + offsets[index], masks[index]}
+                                               : ContextTable{unused_table.data(), unused_table.size() - 1};
+    }
+    const uint64_t full_mask = (uint64_t(1) << HuffTree::DECODE_TABLE_BITS) - 1;
+    auto decode_symbol = [full_mask](BitReader &reader, const ContextTable &table) {
+        HuffTree::DecodeEntry entry = table.entries[reader.peek() & table.mask];
+        if (!entry.length) {
+            if (table.mask != full_mask) {
+                throw std::logic_error("Attempt to extract a code from invalid data.");
+            }
+            return reader.decode_symbol(table.entries);
+        }
+        reader.consume(entry.length);
+        return (unsigned char)entry.value;
+    };
+    std::size_t segment_size = (count + INTERLEAVED_STREAMS - 1) / INTERLEAVED_STREAMS;
+    std::size_t last_size = count - std::min(count, (INTERLEAVED_STREAMS - 1) * segment_size);
+    BitReader reader0(data, sizes[0]);
+    BitReader reader1(data + sizes[0], sizes[1]);
+    BitReader reader2(data + sizes[0] + sizes[1], sizes[2]);
+    BitReader reader3(data + sizes[0] + sizes[1] + sizes[2], sizes[3]);
+    unsigned char *out0 = out;
+    unsigned char *out1 = out0 + std::min(count, segment_size);
+    unsigned char *out2 = out0 + std::min(count, 2 * segment_size);
+    unsigned char *out3 = out0 + std::min(count, 3 * segment_size);
+    unsigned char previous0 = 0, previous1 = 0, previous2 = 0, previous3 = 0;
+    std::size_t i = 0;
+    const std::size_t symbols_per_refill = BitReader::MIN_REFILL_BITS / HuffTree::MAX_CANONICAL_CODE_LENGTH;
+    for (; i + symbols_per_refill <= last_size; i += symbols_per_refill) {
+        reader0.refill();
+        reader1.refill();
+        reader2.refill();
+        reader3.refill();
+        for (std::size_t j = 0; j < symbols_per_refill; ++j) {
+            previous0 = out0[i + j] = decode_symbol(reader0, tables[previous0]);
+            previous1 = out1[i + j] = decode_symbol(reader1, tables[previous1]);
+            previous2 = out2[i + j] = decode_symbol(reader2, tables[previous2]);
+            previous3 = out3[i + j] = decode_symbol(reader3, tables[previous3]);
+        }
+    }
+    BitReader *readers[INTERLEAVED_STREAMS] = {&reader0, &reader1, &reader2, &reader3};
+    unsigned char *outs[INTERLEAVED_STREAMS] = {out0, out1, out2, out3};
+    unsigned char previous[INTERLEAVED_STREAMS] = {previous0, previous1, previous2, previous3};
+    for (std::size_t stream = 0; stream < INTERLEAVED_STREAMS; ++stream) {
+        std::size_t stream_size = std::min(count, (stream + 1) * segment_size) - std::min(count, stream * segment_size);
+        for (std::size_t j = i; j < stream_size; ++j) {
+            readers[stream]->refill();
+            previous[stream] = outs[stream][j] = decode_symbol(*readers[stream], tables[previous[stream]]);
+        }
+        if (readers[stream]->is_overrun()) {
+            throw std::logic_error("Unexpected end of compressed data.");
+        }
+    }
+}
+
+uint32_t HuffmanArchiver::decode_context_record(const unsigned char *record, std::size_t record_size,
+                                                unsigned char *out, std::size_t count, Stats &stats) {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::size_t position = sizeof(BlockType);
+    std::array<uint16_t, CONTEXT_COUNT> context_map;
+    std::size_t table_count = 0;
+    if (BlockType(record[0]) == BlockType::clustered) {
+        if (record_size - position < sizeof(uint8_t) + CONTEXT_COUNT) {
+            throw std::logic_error("Invalid block.");
+        }
+        table_count = record[position++];
+        if (!table_count || table_count > MAX_CONTEXT_TABLES) {
+            throw std::logic_error("Invalid block.");
+        }
+        for (std::size_t context = 0; context < CONTEXT_COUNT; ++context) {
+            context_map[context] = record[position++];
+            if (context_map[context] >= table_count) {
+                throw std::logic_error("Invalid block.");
+            }
+        }
+    } else {
+        if (record_size - position < CONTEXT_MASK_SIZE) {
+            throw std::logic_error("Invalid block.");
+        }
+        for (std::size_t context = 0; context < CONTEXT_COUNT; ++context) {
+            bool used = record[position + context / CHAR_BIT] & (1 << context % CHAR_BIT);
+            context_map[context] = used ? table_count++ : CONTEXT_COUNT;
+        }
+        position += CONTEXT_MASK_SIZE;
+    }
+    std::vector<std::unique_ptr<HuffTree>> trees;
+    for (std::size_t table = 0; table < table_count; ++table) {
+        std::array<uint8_t, UCHAR_MAX + 1> code_lengths = unpack_code_lengths([&]() {
+            if (position == record_size) {
+                throw std::logic_error("Invalid block.");
+            }
+            return record[position++];
+        });
+        uint8_t max_length = *std::max_element(code_lengths.begin(), code_lengths.end());
+        if (!max_length) {
+            throw std::logic_error("Invalid code lengths.");
+        }
+        stats.max_code_length = std::max<unsigned>(stats.max_code_length, max_length);
+        trees.push_back(std::make_unique<HuffTree>(code_lengths));
+        if (!trees.back()->build_decode_table()) {
+            throw std::logic_error("Invalid code lengths.");
+        }
+    }
+    std::array<uint32_t, INTERLEAVED_STREAMS> sizes;
+    if (record_size - position < sizeof(sizes)) {
+        throw std::logic_error("Invalid block.");
+    }
+    std::memcpy(sizes.data(), record + position, sizeof(sizes));
+    position += sizeof(sizes);
+    uint64_t payload_size = uint64_t(sizes[0]) + sizes[1] + sizes[2] + sizes[3];
+    if (record_size - position != payload_size) {
+        throw std::logic_error("Invalid block.");
+    }
+    stats.tree_build_seconds += lap(start);
+    decode_contexts(trees, context_map, record + position, sizes, out, count);
+    stats.decode_seconds += lap(start);
+    return payload_size;
+}
+
+uint32_t HuffmanArchiver::decode_block_record(const unsigned char *record, std::size_t record_size,
+                                              unsigned char *out, std::size_t count, Stats &stats) {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    if (!record_size || record[0] > uint8_t(BlockType::clustered)) {
+        throw std::logic_error("Invalid block.");
+    }
+    BlockType type = BlockType(record[0]);
+    std::size_t position = 1;
+    ++stats.block_count;
+    if (type == BlockType::stored) {
+        if (record_size - position != count) {
+            throw std::logic_error("Invalid block.");
+        }
+        std::memcpy(out, record + position, count);
+        stats.decode_seconds += lap(start);
+        return count;
+    }
+    if (type == BlockType::run) {
+        if (record_size - position != 1) {
+            throw std::logic_error("Invalid block.");
+        }
+        std::memset(out, record[position], count);
+        stats.decode_seconds += lap(start);
+        return 0;
+    }
+    if (type == BlockType::context || type == BlockType::clustered) {
+        return decode_context_record(record, record_size, out, count, stats);
+    }
+    std::array<uint8_t, UCHAR_MAX + 1> code_lengths = unpack_code_lengths([&]() {
+        if (position == record_size) {
+            throw std::logic_error("Invalid block.");
+        }
+        return record[position++];
+    });
+    std::array<uint32_t, INTERLEAVED_STREAMS> sizes{};
+    std::size_t stream_count = type == BlockType::interleaved ? INTERLEAVED_STREAMS : 1;
+    if (record_size - position < stream_count * sizeof(uint32_t)) {
+        throw std::logic_error("Invalid block.");
+    }
+    uint64_t payload_size = 0;
+    for (std::size_t i = 0; i < stream_count; ++i) {
+        std::memcpy(&sizes[i], record + position, sizeof(sizes[i]));
+        position += sizeof(sizes[i]);
+        payload_size += sizes[i];
+    }
+    if (record_size - position != payload_size) {
+        throw std::logic_error("Invalid block.");
+    }
+    HuffTree tree(code_lengths);
+    stats.max_code_length = std::max<unsigned>(stats.max_code_length,
+                                               *std::max_element(code_lengths.begin(), code_lengths.end()));
+    stats.tree_build_seconds += lap(start);
+    if (!tree.build_decode_table()) {
+        throw std::logic_error("Invalid code lengths.");
+    }
+    if (type != BlockType::interleaved) {
+        tree.build_multi_decode_table();
+    }
+    stats.code_gen_seconds += lap(start);
+    if (type == BlockType::interleaved) {
+        decode_interleaved(tree, record + position, sizes, out, count);
+    } else {
+        decode_block(tree, record + position, payload_size, out, count);
+    }
+    stats.decode_seconds += lap(start);
+    return payload_size;
+}
+
+void HuffmanArchiver::decode_tree_walk(HuffTree &tree) {
+    _in.exceptions(std::ios_base::badbit | std::ios_base::failbit);
+    std::queue<bool> buffer;
+    unsigned char chr;
+    std::size_t i = 0;
+    while (i < _out_file_size) {
+        if (buffer.empty()) {
+            fill_buffer(buffer);
+        }
+        if (tree.try_extract_code(buffer, chr)) {
+            _out.write((char *)&chr, sizeof(chr));
+            ++i;
+        }
+    }
+}
+
+void HuffmanArchiver::extract_buffer(std::queue<bool> &buffer) {
+    while (buffer.size() >= CHAR_BIT) {
+        unsigned char chr = 0;
+        for (std::size_t i = 0; i < CHAR_BIT; ++i) {
+            chr |= buffer.front() << i;
+            buffer.pop();
+        }
+        _out.write((char *)&chr, sizeof(chr));
+    }
+}
+
+void HuffmanArchiver::encode(HuffTree &tree) {
+    _in.clear();
+    _in.seekg(0);
+    _in.exceptions(std::ios_base::goodbit);
+    BitWriter writer(_out);
+    if (_in_map->is_mapped()) {
+        encode_symbols(tree, _in_map->data(), _in_map->size(), writer);
+        writer.flush();
+        return;
+    }
+    std::vector<unsigned char> buffer(BitWriter::CHUNK_SIZE);
+    while (_in.read((char *)buffer.data(), std::streamsize(buffer.size())) || _in.gcount()) {
+        encode_symbols(tree, buffer.data(), _in.gcount(), writer);
+    }
+    writer.flush();
+}
+
+void HuffmanArchiver::store_input() {
+    if (_in_map->is_mapped()) {
+        _out.write((const char *)_in_map->data(), std::streamsize(_in_map->size()));
+        return;
+    }
+    _in.clear();
+    _in.seekg(0);
+    _in.exceptions(std::ios_base::goodbit);
+    std::vector<char> buffer(BitWriter::CHUNK_SIZE);
+    while (_in.read(buffer.data(), std::streamsize(buffer.size())) || _in.gcount()) {
+        _out.write(buffer.data(), _in.gcount());
+    }
+}
+
+void HuffmanArchiver::extract_stored() {
+    _in.exceptions(std::ios_base::goodbit);
+    std::streampos start = _in.tellg();
+    if (_in_map->is_mapped() && std::size_t(start) <= _in_map->size()) {
+        if (_out_file_size > _in_map->size() - start) {
+            throw std::logic_error("Unexpected end of compressed data.");
+        }
+        _out.write((const char *)_in_map->data() + start, std::streamsize(_out_file_size));
+        _in.seekg(start + std::streamoff(_out_file_size));
+        return;
+    }
+    std::vector<char> buffer(BitReader::CHUNK_SIZE);
+    for (uint64_t i = 0; i < _out_file_size;) {
+        std::size_t count = std::min<uint64_t>(buffer.size(), _out_file_size - i);
+        if (!_in.read(buffer.data(), std::streamsize(count))) {
+            throw std::logic_error("Unexpected end of compressed data.");
+        }
+        _out.write(buffer.data(), std::streamsize(count));
+        i += count;
+    }
+}
+
+void HuffmanArchiver::extract_run() {
+    _in.exceptions(std::ios_base::badbit | std::ios_base::failbit);
+    unsigned char symbol;
+    _in.read((char *)&symbol, sizeof(symbol));
+    std::vector<char> buffer(std::min<uint64_t>(BitReader::CHUNK_SIZE, _out_file_size), char(symbol));
+    for (uint64_t i = 0; i < _out_file_size;) {
+        std::size_t count = std::min<uint64_t>(buffer.size(), _out_file_size - i);
+        _out.write(buffer.data(), std::streamsize(count));
+        i += count;
+    }
+}
+
+void HuffmanArchiver::encode_symbols(const HuffTree &tree, const unsigned char *data, std::size_t size,
+                                     BitWriter &writer) {
+    const std::array<HuffTree::Code, UCHAR_MAX + 1> &codes = tree.get_code_table();
+    for (std::size_t i = 0; i < size; ++i) {
+        const HuffTree::Code &code = codes[data[i]];
+        writer.write(code.bits, code.length);
+    }
+}
+
+std::array<uint32_t, HuffmanArchiver::INTERLEAVED_STREAMS> HuffmanArchiver::encode_contexts(
+        const std::vector<std::unique_ptr<HuffTree>> &trees, const std::array<uint16_t, CONTEXT_COUNT> &context_map,
+        const unsigned char *data, std::size_t size, std::vector<unsigned char> &payload) {
+    std::array<const HuffTree::Code *, CONTEXT_COUNT> codes{};
+    for (std::size_t context = 0; context < CONTEXT_COUNT; ++context) {
+        if (context_map[context] < trees.size()) {
+            codes[context] = trees[context_map[context]]->get_code_table().data();
+        }
+    }
+    std::array<uint32_t, INTERLEAVED_STREAMS> sizes{};
+    std::size_t segment_size = (size + INTERLEAVED_STREAMS - 1) / INTERLEAVED_STREAMS;
+    for (std::size_t stream = 0; stream < INTERLEAVED_STREAMS; ++stream) {
+        std::vector<unsigned char> segment;
+        BitWriter writer(segment);
+        unsigned char previous = 0;
+        for (std::size_t i = std::min(size, stream * segment_size); i < std::min(size, (stream + 1) * segment_size);
+             ++i) {
+            const HuffTree::Code &code = codes[previous][data[i]];
+            writer.write(code.bits, code.length);
+            previous = data[i];
+        }
+        writer.flush();
+        sizes[stream] = segment.size();
+        payload.insert(payload.end(), segment.begin(), segment.end());
+    }
+    return sizes;
+}
+
+std::vector<std::array<uint64_t, UCHAR_MAX + 1>> HuffmanArchiver::cluster_contexts(
+        const std::vector<std::array<uint64_t, UCHAR_MAX + 1>> &contexts, unsigned table_count,
+        std::array<uint16_t, CONTEXT_COUNT> &context_map) {
+    std::vector<uint64_t> totals(CONTEXT_COUNT, 0);
+    std::vector<std::size_t> used;
+    std::vector<std::vector<unsigned char>> symbols(CONTEXT_COUNT);
+    for (std::size_t context = 0; context < CONTEXT_COUNT; ++context) {
+        for (std::size_t chr = 0; chr <= UCHAR_MAX; ++chr) {
+            if (contexts[context][chr]) {
+                totals[context] += contexts[context][chr];
+                symbols[context].push_back(chr);
+            }
+        }
+        if (totals[context]) {
+            used.push_back(context);
+        }
+    }
+    std::stable_sort(used.begin(), used.end(), [&totals](std::size_t lhs, std::size_t rhs) {
+        return totals[lhs] > totals[rhs];
+    });
+    std::size_t cluster_count = std::min<std::size_t>(2 * table_count, used.size());
+    std::vector<std::array<uint64_t, UCHAR_MAX + 1>> tables(cluster_count);
+    context_map.fill(0);
+    for (std::size_t i = 0; i < cluster_count; ++i) {
+        context_map[used[i]] = i;
+        tables[i] = contexts[used[i]];
+    }
+    auto refine = [&]() {
+        std::vector<std::array<float, UCHAR_MAX + 1>> costs(cluster_count);
+        for (unsigned iteration = 0; iteration < CLUSTER_ITERATIONS; ++iteration) {
+            for (std::size_t cluster = 0; cluster < cluster_count; ++cluster) {
+                uint64_t total = 0;
+                for (uint64_t frequency: tables[cluster]) {
+                    total += frequency;
+                }
+                float total_bits = std::log2(float(total) + (UCHAR_MAX + 1) / 2.0f);
+                for (std::size_t chr = 0; chr <= UCHAR_MAX; ++chr) {
+                    costs[cluster][chr] = total_bits - std::log2(float(tables[cluster][chr]) + 0.5f);
+                }
+            }
+            bool changed = iteration == 0;
+            for (std::size_t context: used) {
+                std::size_t best_cluster = context_map[context];
+                float best_cost = std::numeric_limits<float>::max();
+                for (std::size_t cluster = 0; cluster < cluster_count; ++cluster) {
+                    float cost = 0;
+                    for (unsigned char chr: symbols[context]) {
+                        cost += float(contexts[context][chr]) * costs[cluster][chr];
+                    }
+                    if (cost < best_cost) {
+                        best_cost = cost;
+                        best_cluster = cluster;
+                    }
+                }
+                changed |= best_cluster != context_map[context];
+                context_map[context] = best_cluster;
+            }
+            if (!changed) {
+                break;
+            }
+            tables.assign(cluster_count, std::array<uint64_t, UCHAR_MAX + 1>{});
+            for (std::size_t context: used) {
+                for (unsigned char chr: symbols[context]) {
+                    tables[context_map[context]][chr] += contexts[context][chr];
+                }
+            }
+        }
+    };
+    auto compact = [&]() {
+        std::vector<uint16_t> renumbered(cluster_count, CONTEXT_COUNT);
+        std::vector<std::array<uint64_t, UCHAR_MAX + 1>> clusters;
+        for (std::size_t context = 0; context < CONTEXT_COUNT; ++context) {
+            if (!totals[context]) {
+                continue;
+            }
+            uint16_t &cluster = renumbered[context_map[context]];
+            if (cluster == CONTEXT_COUNT) {
+                cluster = clusters.size();
+                clusters.push_back(tables[context_map[context]]);
+            }
+            context_map[context] = cluster;
+        }
+        tables = std::move(clusters);
+        cluster_count = tables.size();
+    };
+    auto entropy = [](uint64_t frequency) {
+        return frequency ? double(frequency) * std::log2(double(frequency)) : 0.0;
+    };
+    auto merge_cost = [&](std::size_t lhs, std::size_t rhs) {
+        uint64_t lhs_total = 0, rhs_total = 0;
+        double cost = 0;
+        for (std::size_t chr = 0; chr <= UCHAR_MAX; ++chr) {
+            uint64_t lhs_frequency = tables[lhs][chr];
+            uint64_t rhs_frequency = tables[rhs][chr];
+            lhs_total += lhs_frequency;
+            rhs_total += rhs_frequency;
+            if (lhs_frequency && rhs_frequency) {
+                cost -= entropy(lhs_frequency + rhs_frequency) - entropy(lhs_frequency) - entropy(rhs_frequency);
+            }
+        }
+        return cost + entropy(lhs_total + rhs_total) - entropy(lhs_total) - entropy(rhs_total);
+    };
+
+    refine();
+    compact();
+    std::vector<std::vector<double>> merge_costs(cluster_count, std::vector<double>(cluster_count));
+    for (std::size_t lhs = 0; lhs < cluster_count; ++lhs) {
+        for (std::size_t rhs = lhs + 1; rhs < cluster_count; ++rhs) {
+            merge_costs[lhs][rhs] = merge_cost(lhs, rhs);
+        }
+    }
+    std::vector<bool> merged(cluster_count, false);
+    for (std::size_t remaining = cluster_count; remaining > table_count; --remaining) {
+        std::size_t best_lhs = 0, best_rhs = 0;
+        double best_cost = std::numeric_limits<double>::max();
+        for (std::size_t lhs = 0; lhs < cluster_count; ++lhs) {
+            for (std::size_t rhs = lhs + 1; rhs < cluster_count && !merged[lhs]; ++rhs) {
+                if (!merged[rhs] && merge_costs[lhs][rhs] < best_cost) {
+                    best_cost = merge_costs[lhs][rhs];
+                    best_lhs = lhs;
+                    best_rhs = rhs;
+                }
+            }
+        }
+        for (std::size_t chr = 0; chr <= UCHAR_MAX; ++chr) {
+            tables[best_lhs][chr] += tables[best_rhs][chr];
+        }
+        for (std::size_t context: used) {
+            if (context_map[context] == best_rhs) {
+                context_map[context] = best_lhs;
+            }
+        }
+        merged[best_rhs] = true;
+        for (std::size_t cluster = 0; cluster < cluster_count; ++cluster) {
+            if (!merged[cluster] && cluster != best_lhs) {
+                merge_costs[std::min(cluster, best_lhs)][std::max(cluster, best_lhs)] =
+                        merge_cost(std::min(cluster, best_lhs), std::max(cluster, best_lhs));
+            }
+        }
+    }
+    compact();
+    refine();
+    compact();
+    return tables;
+}
+
+void HuffmanArchiver::plan_contexts(const unsigned char *data, std::size_t size, BlockLayout &layout,
+                                    Stats &stats) const {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::vector<std::array<uint64_t, UCHAR_MAX + 1>> contexts;
+    count_contexts(data, size, contexts);
+    stats.histogram_seconds += lap(start);
+    std::array<uint16_t, CONTEXT_COUNT> context_map;
+    std::vector<std::array<uint64_t, UCHAR_MAX + 1>> tables;
+    uint64_t header_size = sizeof(BlockType) + INTERLEAVED_STREAMS * sizeof(uint32_t);
+    if (_context_tables) {
+        tables = cluster_contexts(contexts, _context_tables, context_map);
+        header_size += sizeof(uint8_t) + CONTEXT_COUNT;
+    } else {
+        for (std::size_t context = 0; context < CONTEXT_COUNT; ++context) {
+            bool used = std::any_of(contexts[context].begin(), contexts[context].end(), [](uint64_t frequency) {
+                return frequency != 0;
+            });
+            context_map[context] = used ? tables.size() : CONTEXT_COUNT;
+            if (used) {
+                tables.push_back(contexts[context]);
+            }
+        }
+        header_size += CONTEXT_MASK_SIZE;
+    }
+    std::vector<std::array<uint8_t, UCHAR_MAX + 1>> context_code_lengths(tables.size());
+    uint64_t length_limit_overhead = 0;
+    for (std::size_t table = 0; table < tables.size(); ++table) {
+        uint64_t overhead;
+        context_code_lengths[table] = choose_code_lengths(tables[table], _max_code_length, overhead);
+        length_limit_overhead += overhead;
+        header_size += pack_code_lengths(context_code_lengths[table]).size();
+    }
+    uint64_t payload_size = 0;
+    std::size_t segment_size = (size + INTERLEAVED_STREAMS - 1) / INTERLEAVED_STREAMS;
+    for (std::size_t begin = 0; begin < size; begin += segment_size) {
+        uint64_t bits = 0;
+        unsigned char previous = 0;
+        for (std::size_t i = begin; i < std::min(size, begin + segment_size); ++i) {
+            bits += context_code_lengths[context_map[previous]][data[i]];
+            previous = data[i];
+        }
+        payload_size += (bits + CHAR_BIT - 1) / CHAR_BIT;
+    }
+    stats.tree_build_seconds += lap(start);
+    if (header_size + payload_size >= layout.header_size + layout.payload_size) {
+        return;
+    }
+    layout.type = _context_tables ? BlockType::clustered : BlockType::context;
+    layout.context_code_lengths = std::move(context_code_lengths);
+    layout.context_map = context_map;
+    layout.header_size = header_size;
+    layout.payload_size = payload_size;
+    layout.length_limit_overhead = length_limit_overhead;
+}
+
+std::size_t HuffmanArchiver::next_token(const unsigned char *data, std::size_t size) noexcept {
+    static constexpr std::array<bool, UCHAR_MAX + 1> word_bytes = []() {
+        std::array<bool, UCHAR_MAX + 1> bytes{};
+        for (std::size_t chr = 0; chr <= UCHAR_MAX; ++chr) {
+            bytes[chr] = (chr >= '0' && chr <= '9') || (chr >= 'A' && chr <= 'Z') || (chr >= 'a' && chr <= 'z') ||
+                         chr > 0x7f;
+        }
+        return bytes;
+    }();
+    bool word = word_bytes[data[0]];
+    std::size_t end = std::min(size, MAX_TOKEN_LENGTH);
+    std::size_t length = 1;
+    while (length < end && word_bytes[data[length]] == word) {
+        ++length;
+    }
+    return length;
+}
+
+std::vector<uint32_t> HuffmanArchiver::tokenize(const unsigned char *data, std::size_t size,
+                                                std::vector<std::string_view> &dictionary) {
+    std::unordered_map<std::string_view, uint32_t> ids;
+    std::vector<std::pair<std::string_view, uint64_t>> candidates;
+    std::vector<uint32_t> tokens;
+    for (std::size_t position = 0; position < size;) {
+        std::size_t length = next_token(data + position, size - position);
+        if (length > 1) {
+            auto [id, inserted] = ids.try_emplace(std::string_view((const char *)data + position, length),
+                                                  candidates.size());
+            if (inserted) {
+                candidates.emplace_back(id->first, 0);
+            }
+            ++candidates[id->second].second;
+            tokens.push_back(UCHAR_MAX + 1 + id->second);
+        } else {
+            tokens.push_back(data[position]);
+        }
+        position += length;
+    }
+    std::vector<uint32_t> chosen;
+    for (uint32_t candidate = 0; candidate < candidates.size(); ++candidate) {
+        if (candidates[candidate].second >= MIN_TOKEN_FREQUENCY) {
+            chosen.push_back(candidate);
+        }
+    }
+    if (chosen.size() > MAX_TOKEN_COUNT) {
+        std::nth_element(chosen.begin(), chosen.begin() + MAX_TOKEN_COUNT, chosen.end(),
+                         [&candidates](uint32_t lhs, uint32_t rhs) {
+            return candidates[lhs].second * (candidates[lhs].first.size() - 1) >
+                   candidates[rhs].second * (candidates[rhs].first.size() - 1);
+        });
+        chosen.resize(MAX_TOKEN_COUNT);
+    }
+    std::sort(chosen.begin(), chosen.end(), [&candidates](uint32_t lhs, uint32_t rhs) {
+        return candidates[lhs].first < candidates[rhs].first;
+    });
+    std::vector<uint32_t> symbol_ids(candidates.size(), 0);
+    dictionary.clear();
+    for (uint32_t candidate: chosen) {
+        symbol_ids[candidate] = UCHAR_MAX + 1 + dictionary.size();
+        dictionary.push_back(candidates[candidate].first);
+    }
+    std::vector<uint32_t> symbols;
+    symbols.reserve(tokens.size());
+    for (uint32_t token: tokens) {
+        if (token <= UCHAR_MAX) {
+            symbols.push_back(token);
+        } else if (uint32_t id = symbol_ids[token - (UCHAR_MAX + 1)]) {
+            symbols.push_back(id);
+        } else {
+            std::string_view text = candidates[token - (UCHAR_MAX + 1)].first;
+            symbols.insert(symbols.end(), (const unsigned char *)text.data(),
+                           (const unsigned char *)text.data() + text.size());
+        }
+    }
+    return symbols;
+}
+
+std::vector<unsigned char> HuffmanArchiver::pack_tokens(const std::vector<std::string_view> &dictionary,
+                                                        const std::vector<uint8_t> &code_lengths) {
+    std::vector<unsigned char> blob;
+    std::string_view previous;
+    for (std::string_view token: dictionary) {
+        std::size_t prefix = std::mismatch(token.begin(), token.end(), previous.begin(), previous.end()).first -
+                             token.begin();
+        blob.push_back(prefix);
+        blob.push_back(token.size() - prefix);
+        blob.insert(blob.end(), token.begin() + prefix, token.end());
+        previous = token;
+    }
+    blob.insert(blob.end(), code_lengths.begin(), code_lengths.end());
+    std::array<uint64_t, UCHAR_MAX + 1> vocabulary{};
+    count_bytes(blob.data(), blob.size(), vocabulary);
+    uint64_t length_limit_overhead;
+    std::array<uint8_t, UCHAR_MAX + 1> blob_code_lengths = choose_code_lengths(
+            vocabulary, HuffTree::MAX_CANONICAL_CODE_LENGTH, length_limit_overhead);
+    std::vector<unsigned char> encoded;
+    BitWriter writer(encoded);
+    encode_symbols(HuffTree(blob_code_lengths), blob.data(), blob.size(), writer);
+    writer.flush();
+
+    uint32_t token_count = dictionary.size();
+    uint32_t blob_size = blob.size();
+    uint32_t encoded_size = encoded.size();
+    std::vector<unsigned char> packed(sizeof(token_count) + sizeof(blob_size));
+    std::memcpy(packed.data(), &token_count, sizeof(token_count));
+    std::memcpy(packed.data() + sizeof(token_count), &blob_size, sizeof(blob_size));
+    std::vector<unsigned char> packed_lengths = pack_code_lengths(blob_code_lengths);
+    packed.insert(packed.end(), packed_lengths.begin(), packed_lengths.end());
+    packed.resize(packed.size() + sizeof(encoded_size));
+    std::memcpy(packed.data() + packed.size() - sizeof(encoded_size), &encoded_size, sizeof(encoded_size));
+    packed.insert(packed.end(), encoded.begin(), encoded.end());
+    return packed;
+}
+
+std::size_t HuffmanArchiver::unpack_tokens(const unsigned char *data, std::size_t size,
+                                           std::vector<unsigned char> &tokens, std::vector<uint32_t> &offsets,
+                                           std::vector<uint8_t> &code_lengths) {
+    std::size_t position = 0;
+    auto read_u32 = [&]() {
+        uint32_t value;
+        if (size - position < sizeof(value)) {
+            throw std::logic_error("Unexpected end of compressed data.");
+        }
+        std::memcpy(&value, data + position, sizeof(value));
+        position += sizeof(value);
+        return value;
+    };
+    uint32_t token_count = read_u32();
+    uint32_t blob_size = read_u32();
+    if (token_count > MAX_TOKEN_COUNT ||
+        blob_size > uint64_t(token_count) * (MAX_TOKEN_LENGTH + 3) + UCHAR_MAX + 1) {
+        throw std::logic_error("Invalid token dictionary.");
+    }
+    std::array<uint8_t, UCHAR_MAX + 1> blob_code_lengths = unpack_code_lengths([&]() {
+        if (position == size) {
+            throw std::logic_error("Unexpected end of compressed data.");
+        }
+        return data[position++];
+    });
+    uint32_t encoded_size = read_u32();
+    if (encoded_size > size - position || blob_size > uint64_t(encoded_size) * CHAR_BIT) {
+        throw std::logic_error("Unexpected end of compressed data.");
+    }
+    HuffTree tree(blob_code_lengths);
+    if (!tree.build_decode_table()) {
+        throw std::logic_error("Invalid code lengths.");
+    }
+    tree.build_multi_decode_table();
+    std::vector<unsigned char> blob(blob_size);
+    decode_block(tree, data + position, encoded_size, blob.data(), blob.size());
+    position += encoded_size;
+
+    std::size_t blob_position = 0;
+    tokens.clear();
+    offsets.assign(1, 0);
+    for (uint32_t i = 0; i < token_count; ++i) {
+        if (blob_size - blob_position < 2) {
+            throw std::logic_error("Invalid token dictionary.");
+        }
+        std::size_t prefix = blob[blob_position];
+        std::size_t suffix = blob[blob_position + 1];
+        std::size_t previous = offsets[offsets.size() - (i ? 2 : 1)];
+        blob_position += 2;
+        if (prefix > offsets.back() - previous || prefix + suffix < 2 || prefix + suffix > MAX_TOKEN_LENGTH ||
+            suffix > blob_size - blob_position) {
+            throw std::logic_error("Invalid token dictionary.");
+        }
+        for (std::size_t j = 0; j < prefix; ++j) {
+            unsigned char chr = tokens[previous + j];
+            tokens.push_back(chr);
+        }
+        tokens.insert(tokens.end(), blob.begin() + blob_position, blob.begin() + blob_position + suffix);
+        blob_position += suffix;
+        offsets.push_back(tokens.size());
+    }
+    if (blob_size - blob_position != UCHAR_MAX + 1 + token_count) {
+        throw std::logic_error("Invalid token dictionary.");
+    }
+    code_lengths.assign(blob.begin() + blob_position, blob.end());
+    if (*std::max_element(code_lengths.begin(), code_lengths.end()) > TOKEN_MAX_CODE_LENGTH) {
+        throw std::logic_error("Invalid code lengths.");
+    }
+    return position;
+}
+
+void HuffmanArchiver::encode_tokens(const std::vector<uint32_t> &symbols, const std::vector<uint8_t> &code_lengths,
+                                    BitWriter &writer) {
+    std::vector<HuffTree::Code> codes = HuffTree::build_canonical_codes(code_lengths);
+    for (uint32_t symbol: symbols) {
+        writer.write(codes[symbol].bits, codes[symbol].length);
+    }
+}
+
+std::size_t HuffmanArchiver::decode_tokens(const std::vector<unsigned char> &tokens,
+                                           const std::vector<uint32_t> &offsets,
+                                           const std::vector<uint8_t> &code_lengths, const unsigned char *data,
+                                           std::size_t size, unsigned char *out, std::size_t count) {
+    std::vector<HuffTree::Code> codes = HuffTree::build_canonical_codes(code_lengths);
+    const std::size_t table_size = std::size_t(1) << TOKEN_TABLE_BITS;
+    std::vector<uint32_t> table(table_size, 0);
+    std::array<uint32_t, TOKEN_MAX_CODE_LENGTH + 1> length_counts{};
+    for (std::size_t symbol = 0; symbol < codes.size(); ++symbol) {
+        const HuffTree::Code &code = codes[symbol];
+        ++length_counts[code.length];
+        if (code.length && code.length <= TOKEN_TABLE_BITS) {
+            for (std::size_t index = code.bits; index < table_size; index += std::size_t(1) << code.length) {
+                table[index] = symbol << CHAR_BIT | code.length;
+            }
+        }
+    }
+    std::array<uint32_t, TOKEN_MAX_CODE_LENGTH + 2> first_codes{};
+    std::array<uint32_t, TOKEN_MAX_CODE_LENGTH + 2> first_symbols{};
+    for (std::size_t length = 1; length <= TOKEN_MAX_CODE_LENGTH; ++length) {
+        first_codes[length] = (first_codes[length - 1] + (length > 1 ? length_counts[length - 1] : 0)) << 1;
+        first_symbols[length + 1] = first_symbols[length] + length_counts[length];
+    }
+    std::vector<uint32_t> sorted_symbols(first_symbols[TOKEN_MAX_CODE_LENGTH + 1]);
+    std::array<uint32_t, TOKEN_MAX_CODE_LENGTH + 2> next_symbols = first_symbols;
+    for (std::size_t symbol = 0; symbol < codes.size(); ++symbol) {
+        if (codes[symbol].length) {
+            sorted_symbols[next_symbols[codes[symbol].length]++] = symbol;
+        }
+    }
+
+    BitReader reader(data, size);
+    const uint64_t mask = table_size - 1;
+    const std::size_t symbols_per_refill = BitReader::MIN_REFILL_BITS / TOKEN_MAX_CODE_LENGTH;
+    for (std::size_t i = 0; i < count;) {
+        reader.refill();
+        for (std::size_t j = 0; j < symbols_per_refill && i < count; ++j) {
+            uint64_t bits = reader.peek();
+            uint32_t entry = table[bits & mask];
+            uint32_t symbol;
+            if (entry) {
+                symbol = entry >> CHAR_BIT;
+                reader.consume(entry & UCHAR_MAX);
+            } else {
+                uint32_t code = 0;
+                std::size_t length = 1;
+                for (; length <= TOKEN_MAX_CODE_LENGTH; ++length) {
+                    code = code << 1 | ((bits >> (length - 1)) & 1);
+                    if (code - first_codes[length] < length_counts[length]) {
+                        break;
+                    }
+                }
+                if (length > TOKEN_MAX_CODE_LENGTH) {
+                    throw std::logic_error("Attempt to extract a code from invalid data.");
+                }
+                symbol = sorted_symbols[first_symbols[length] + code - first_codes[length]];
+                reader.consume(length);
+            }
+            if (symbol <= UCHAR_MAX) {
+                out[i++] = symbol;
+                continue;
+            }
+            std::size_t token = symbol - (UCHAR_MAX + 1);
+            std::size_t length = offsets[token + 1] - offsets[token];
+            if (length > count - i) {
+                throw std::logic_error("Attempt to extract a code from invalid data.");
+            }
+            if (length <= TOKEN_COPY_SIZE && count - i >= TOKEN_COPY_SIZE &&
+                tokens.size() - offsets[token] >= TOKEN_COPY_SIZE) {
+                std::memcpy(out + i, tokens.data() + offsets[token], TOKEN_COPY_SIZE);
+            } else {
+                std::memcpy(out + i, tokens.data() + offsets[token], length);
+            }
+            i += length;
+        }
+    }
+    if (reader.is_overrun()) {
+        throw std::logic_error("Unexpected end of compressed data.");
+    }
+    return reader.get_consumed_bytes();
+}
+
+HuffmanArchiver::TokenLayout HuffmanArchiver::plan_tokens(const unsigned char *data, std::size_t size,
+                                                          Stats &stats) {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::vector<std::string_view> dictionary;
+    TokenLayout layout;
+    layout.symbols = tokenize(data, size, dictionary);
+    std::vector<uint64_t> frequencies(UCHAR_MAX + 1 + dictionary.size(), 0);
+    for (uint32_t symbol: layout.symbols) {
+        ++frequencies[symbol];
+    }
+    stats.histogram_seconds += lap(start);
+    std::vector<uint8_t> optimal_lengths = HuffTree::build_code_lengths(frequencies);
+    layout.code_lengths = HuffTree::build_limited_code_lengths(frequencies, TOKEN_MAX_CODE_LENGTH);
+    uint64_t optimal_bits = 0;
+    uint64_t limited_bits = 0;
+    for (std::size_t i = 0; i < frequencies.size(); ++i) {
+        optimal_bits += frequencies[i] * optimal_lengths[i];
+        limited_bits += frequencies[i] * layout.code_lengths[i];
+    }
+    layout.payload_size = (limited_bits + CHAR_BIT - 1) / CHAR_BIT;
+    layout.length_limit_overhead = layout.payload_size - (optimal_bits + CHAR_BIT - 1) / CHAR_BIT;
+    stats.tree_build_seconds += lap(start);
+    layout.dictionary = pack_tokens(dictionary, layout.code_lengths);
+    stats.code_gen_seconds += lap(start);
+    stats.max_code_length = *std::max_element(layout.code_lengths.begin(), layout.code_lengths.end());
+    return layout;
+}
+
+bool HuffmanArchiver::prefer_tokens(TokenLayout &layout) {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    load_input();
+    _stats.read_seconds += lap(start);
+    if (!_in_map->is_mapped() || _in_map->size() > _memory_limit) {
+        return false;
+    }
+    layout = plan_tokens(_in_map->data(), _in_map->size(), _stats);
+    start = std::chrono::steady_clock::now();
+    std::array<uint64_t, UCHAR_MAX + 1> vocabulary{};
+    count_bytes_parallel(_in_map->data(), _in_map->size(), _thread_count, vocabulary);
+    _stats.histogram_seconds += lap(start);
+    uint64_t length_limit_overhead, header_size, payload_size;
+    std::array<uint8_t, UCHAR_MAX + 1> code_lengths = choose_code_lengths(vocabulary, _max_code_length,
+                                                                          length_limit_overhead);
+    choose_format(vocabulary, code_lengths, _in_map->size(), header_size, payload_size);
+    _stats.tree_build_seconds += lap(start);
+    uint64_t token_header_size = sizeof(SIGNATURE) + sizeof(FormatVersion) + sizeof(uint64_t) +
+                                 layout.dictionary.size();
+    if (token_header_size + layout.payload_size >= header_size + payload_size) {
+        _stats.max_code_length = 0;
+        return false;
+    }
+    return true;
+}
+
+void HuffmanArchiver::zip_tokens() {
+    TokenLayout layout;
+    if (!prefer_tokens(layout)) {
+        zip_single();
+        return;
+    }
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    _in_file_size = _in_map->size();
+    _length_limit_overhead = layout.length_limit_overhead;
+    write_header(FormatVersion::tokens);
+    _out.write((const char *)layout.dictionary.data(), std::streamsize(layout.dictionary.size()));
+    _extra_data_size = _out.tellp();
+    _stats.write_seconds += lap(start);
+    BitWriter writer(_out);
+    encode_tokens(layout.symbols, layout.code_lengths, writer);
+    writer.flush();
+    _out_file_size = uint64_t(_out.tellp()) - _extra_data_size;
+    _stats.encode_seconds += lap(start);
+}
+
+void HuffmanArchiver::extract_tokens() {
+    if (_out_file_size > _memory_limit) {
+        throw std::length_error("Token archive doesn't fit in the memory limit.");
+    }
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::streampos position = _in.tellg();
+    std::vector<unsigned char> buffer;
+    const unsigned char *data;
+    std::size_t size;
+    if (_in_map->is_mapped() && std::size_t(position) <= _in_map->size()) {
+        data = _in_map->data() + position;
+        size = _in_map->size() - position;
+    } else {
+        _in.seekg(0, std::ios_base::end);
+        size = uint64_t(_in.tellg()) - position;
+        _in.seekg(position);
+        buffer.resize(size);
+        _in.read((char *)buffer.data(), std::streamsize(size));
+        data = buffer.data();
+    }
+    _stats.read_seconds += lap(start);
+    std::vector<unsigned char> tokens;
+    std::vector<uint32_t> offsets;
+    std::vector<uint8_t> code_lengths;
+    std::size_t dictionary_size = unpack_tokens(data, size, tokens, offsets, code_lengths);
+    _stats.tree_build_seconds += lap(start);
+    _stats.max_code_length = *std::max_element(code_lengths.begin(), code_lengths.end());
+    if (_out_file_size > uint64_t(size - dictionary_size) * CHAR_BIT * MAX_TOKEN_LENGTH) {
+        throw std::logic_error("Unexpected end of compressed data.");
+    }
+    std::vector<unsigned char> out(_out_file_size);
+    _in_file_size = decode_tokens(tokens, offsets, code_lengths, data + dictionary_size, size - dictionary_size,
+                                  out.data(), out.size());
+    _extra_data_size = uint64_t(position) + dictionary_size;
+    _stats.decode_seconds += lap(start);
+    _out.write((const char *)out.data(), std::streamsize(out.size()));
+    _stats.write_seconds += lap(start);
+}
+
+HuffmanArchiver::BlockLayout HuffmanArchiver::plan_block(const unsigned char *data, std::size_t size,
+                                                         Stats &stats) const {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::array<std::array<uint64_t, UCHAR_MAX + 1>, INTERLEAVED_STREAMS> vocabularies{};
+    count_streams(data, size, vocabularies);
+    std::array<uint64_t, UCHAR_MAX + 1> vocabulary{};
+    for (std::size_t chr = 0; chr <= UCHAR_MAX; ++chr) {
+        vocabulary[chr] = vocabularies[0][chr] + vocabularies[1][chr] + vocabularies[2][chr] + vocabularies[3][chr];
+    }
+    stats.histogram_seconds += lap(start);
+    ++stats.block_count;
+    BlockLayout layout{};
+    if (is_single_symbol(vocabulary, layout.symbol)) {
+        layout.type = BlockType::run;
+        layout.header_size = sizeof(BlockType) + sizeof(layout.symbol);
+        return layout;
+    }
+    layout.code_lengths = choose_code_lengths(vocabulary, _max_code_length, layout.length_limit_overhead);
+    std::size_t stream_count = _interleaved ? INTERLEAVED_STREAMS : 1;
+    layout.type = _interleaved ? BlockType::interleaved : BlockType::huffman;
+    layout.header_size = sizeof(BlockType) + pack_code_lengths(layout.code_lengths).size() +
+                         stream_count * sizeof(uint32_t);
+    if (_interleaved) {
+        for (const auto &stream_vocabulary: vocabularies) {
+            layout.payload_size += encoded_size(stream_vocabulary, layout.code_lengths);
+        }
+    } else {
+        layout.payload_size = encoded_size(vocabulary, layout.code_lengths);
+    }
+    if (_context_model) {
+        stats.tree_build_seconds += lap(start);
+        plan_contexts(data, size, layout, stats);
+        lap(start);
+    }
+    if (layout.header_size + layout.payload_size >= sizeof(BlockType) + size) {
+        layout.type = BlockType::stored;
+        layout.header_size = sizeof(BlockType);
+        layout.payload_size = size;
+        layout.length_limit_overhead = 0;
+        layout.context_code_lengths.clear();
+    } else if (layout.type == BlockType::context || layout.type == BlockType::clustered) {
+        for (const auto &code_lengths: layout.context_code_lengths) {
+            stats.max_code_length = std::max<unsigned>(
+                    stats.max_code_length, *std::max_element(code_lengths.begin(), code_lengths.end()));
+        }
+    } else {
+        stats.max_code_length = std::max<unsigned>(
+                stats.max_code_length, *std::max_element(layout.code_lengths.begin(), layout.code_lengths.end()));
+    }
+    stats.tree_build_seconds += lap(start);
+    return layout;
+}
+
+HuffmanArchiver::Block HuffmanArchiver::compress_block(const unsigned char *data, std::size_t size) const {
+    Block block{};
+    BlockLayout layout = plan_block(data, size, block.stats);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    block.length_limit_overhead = layout.length_limit_overhead;
+    if (layout.type == BlockType::run) {
+        block.header = {uint8_t(BlockType::run), layout.symbol};
+        return block;
+    }
+    if (layout.type == BlockType::stored) {
+        block.header.push_back(uint8_t(BlockType::stored));
+        block.payload.assign(data, data + size);
+        block.stats.encode_seconds += lap(start);
+        return block;
+    }
+    if (layout.type == BlockType::context || layout.type == BlockType::clustered) {
+        block.header.push_back(uint8_t(layout.type));
+        if (layout.type == BlockType::clustered) {
+            block.header.push_back(layout.context_code_lengths.size());
+            block.header.insert(block.header.end(), layout.context_map.begin(), layout.context_map.end());
+        } else {
+            block.header.resize(sizeof(BlockType) + CONTEXT_MASK_SIZE, 0);
+            for (std::size_t context = 0; context < CONTEXT_COUNT; ++context) {
+                if (layout.context_map[context] < CONTEXT_COUNT) {
+                    block.header[sizeof(BlockType) + context / CHAR_BIT] |= 1 << context % CHAR_BIT;
+                }
+            }
+        }
+        std::vector<std::unique_ptr<HuffTree>> trees;
+        for (const std::array<uint8_t, UCHAR_MAX + 1> &code_lengths: layout.context_code_lengths) {
+            std::vector<unsigned char> packed = pack_code_lengths(code_lengths);
+            block.header.insert(block.header.end(), packed.begin(), packed.end());
+            trees.push_back(std::make_unique<HuffTree>(code_lengths));
+        }
+        block.stats.code_gen_seconds += lap(start);
+        std::array<uint32_t, INTERLEAVED_STREAMS> sizes = encode_contexts(trees, layout.context_map, data, size,
+                                                                          block.payload);
+        const unsigned char *size_bytes = (const unsigned char *)sizes.data();
+        block.header.insert(block.header.end(), size_bytes, size_bytes + sizeof(sizes));
+        block.stats.encode_seconds += lap(start);
+        return block;
+    }
+    const std::array<uint8_t, UCHAR_MAX + 1> &code_lengths = layout.code_lengths;
+    std::vector<unsigned char> packed = pack_code_lengths(code_lengths);
+    HuffTree tree(code_lengths);
+    block.stats.code_gen_seconds += lap(start);
+    std::vector<uint32_t> sizes;
+    if (_interleaved) {
+        std::array<uint32_t, INTERLEAVED_STREAMS> stream_sizes = encode_interleaved(tree, data, size, block.payload);
+        sizes.assign(stream_sizes.begin(), stream_sizes.end());
+    } else {
+        BitWriter writer(block.payload);
+        encode_symbols(tree, data, size, writer);
+        writer.flush();
+        sizes.push_back(block.payload.size());
+    }
+    block.header.push_back(uint8_t(_interleaved ? BlockType::interleaved : BlockType::huffman));
+    block.header.insert(block.header.end(), packed.begin(), packed.end());
+    const unsigned char *size_bytes = (const unsigned char *)sizes.data();
+    block.header.insert(block.header.end(), size_bytes, size_bytes + sizes.size() * sizeof(uint32_t));
+    block.stats.encode_seconds += lap(start);
+    return block;
+}
+
+std::array<uint32_t, HuffmanArchiver::INTERLEAVED_STREAMS> HuffmanArchiver::encode_interleaved(
+        const HuffTree &tree, const unsigned char *data, std::size_t size, std::vector<unsigned char> &payload) {
+    const std::array<HuffTree::Code, UCHAR_MAX + 1> &codes = tree.get_code_table();
+    std::array<std::vector<unsigned char>, INTERLEAVED_STREAMS> streams;
+    BitWriter writer0(streams[0]);
+    BitWriter writer1(streams[1]);
+    BitWriter writer2(streams[2]);
+    BitWriter writer3(streams[3]);
+    BitWriter *writers[INTERLEAVED_STREAMS] = {&writer0, &writer1, &writer2, &writer3};
+    for (std::size_t i = 0; i < size; ++i) {
+        const HuffTree::Code &code = codes[data[i]];
+        writers[i % INTERLEAVED_STREAMS]->write(code.bits, code.length);
+    }
+    std::array<uint32_t, INTERLEAVED_STREAMS> sizes{};
+    for (std::size_t i = 0; i < INTERLEAVED_STREAMS; ++i) {
+        writers[i]->flush();
+        sizes[i] = streams[i].size();
+        payload.insert(payload.end(), streams[i].begin(), streams[i].end());
+    }
+    return sizes;
+}
+
+void HuffmanArchiver::zip_blocks() {
+    _in.clear();
+    if (_in_map->is_mapped()) {
+        _in_file_size = _in_map->size();
+    } else {
+        _in.seekg(0, std::ios_base::end);
+        std::streamoff size = _in.tellg();
+        _in.seekg(0);
+        if (size < 0 || !_in) {
+            throw std::runtime_error("Couldn't read input file.");
+        }
+        _in_file_size = size;
+    }
+    write_header(FormatVersion::blocks);
+    _extra_data_size = _out.tellp();
+    _out_file_size = 0;
+    _length_limit_overhead = 0;
+    std::size_t batch_size = std::size_t(_thread_count) * 4;
+    std::vector<std::vector<unsigned char>> inputs(_in_map->is_mapped() ? 0 : batch_size);
+    std::vector<const unsigned char *> data(batch_size);
+    std::vector<std::size_t> sizes(batch_size);
+    std::vector<Block> blocks(batch_size);
+    std::vector<BlockEntry> index;
+    uint64_t offset = _extra_data_size;
+    uint64_t position = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    while (position < _in_file_size) {
+        std::size_t count = 0;
+        lap(start);
+        for (; count < batch_size && position < _in_file_size; ++count) {
+            sizes[count] = std::min<uint64_t>(_block_size, _in_file_size - position);
+            if (_in_map->is_mapped()) {
+                data[count] = _in_map->data() + position;
+            } else {
+                inputs[count].resize(sizes[count]);
+                if (!_in.read((char *)inputs[count].data(), std::streamsize(sizes[count]))) {
+                    throw std::runtime_error("Couldn't read input file.");
+                }
+                data[count] = inputs[count].data();
+            }
+            position += sizes[count];
+        }
+        _stats.read_seconds += lap(start);
+        run_parallel(count, _thread_count, [&](std::size_t i) {
+            blocks[i] = compress_block(data[i], sizes[i]);
+        });
+        lap(start);
+        for (std::size_t i = 0; i < count; ++i) {
+            _stats += blocks[i].stats;
+            index.push_back({offset, uint32_t(sizes[i])});
+            offset += blocks[i].header.size() + blocks[i].payload.size();
+            _out.write((char *)blocks[i].header.data(), std::streamsize(blocks[i].header.size()));
+            _out.write((char *)blocks[i].payload.data(), std::streamsize(blocks[i].payload.size()));
+            _extra_data_size += blocks[i].header.size();
+            _out_file_size += blocks[i].payload.size();
+            _length_limit_overhead += blocks[i].length_limit_overhead;
+        }
+        _stats.write_seconds += lap(start);
+    }
+    for (const BlockEntry &entry: index) {
+        _out.write((char *)&entry.offset, sizeof(entry.offset));
+        _out.write((char *)&entry.size, sizeof(entry.size));
+    }
+    _out.write((char *)&offset, sizeof(offset));
+    _extra_data_size = uint64_t(_out.tellp()) - _out_file_size;
+}
+
+void HuffmanArchiver::unzip_blocks() {
+    std::vector<BlockEntry> index = extract_block_index();
+    std::size_t block_count = index.size() - 1;
+    int out_fd = -1;
+#ifdef HUFFMAN_HAS_MMAP
+    if (_in_map->is_mapped() && _out_file.is_open()) {
+        out_fd = open(_out_filename.c_str(), O_WRONLY);
+        struct stat info;
+        if (out_fd >= 0 && (fstat(out_fd, &info) != 0 || !S_ISREG(info.st_mode))) {
+            close(out_fd);
+            out_fd = -1;
+        }
+    }
+#endif
+    struct FileCloser {
+        int fd;
+        ~FileCloser() {
+#ifdef HUFFMAN_HAS_MMAP
+            if (fd >= 0) {
+                close(fd);
+            }
+#endif
+        }
+    } out_closer{out_fd};
+    std::size_t batch_size = std::size_t(_thread_count) * 4;
+    std::vector<unsigned char> records;
+    std::vector<std::vector<unsigned char>> outputs(batch_size);
+    std::vector<uint32_t> payload_sizes(batch_size);
+    std::vector<Stats> stats(batch_size);
+    _in_file_size = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (std::size_t first = 0; first < block_count; first += batch_size) {
+        std::size_t count = std::min(batch_size, block_count - first);
+        const unsigned char *data;
+        lap(start);
+        if (_in_map->is_mapped()) {
+            data = _in_map->data() + index[first].offset;
+        } else {
+            records.resize(index[first + count].offset - index[first].offset);
+            _in.seekg(std::streamoff(index[first].offset));
+            _in.read((char *)records.data(), std::streamsize(records.size()));
+            data = records.data();
+        }
+        _stats.read_seconds += lap(start);
+        run_parallel(count, _thread_count, [&](std::size_t i) {
+            const BlockEntry &entry = index[first + i];
+            stats[i] = Stats{};
+            outputs[i].resize(entry.size);
+            payload_sizes[i] = decode_block_record(data + (entry.offset - index[first].offset),
+                                                   index[first + i + 1].offset - entry.offset,
+                                                   outputs[i].data(), entry.size, stats[i]);
+#ifdef HUFFMAN_HAS_MMAP
+            std::chrono::steady_clock::time_point write_start = std::chrono::steady_clock::now();
+            uint64_t position = uint64_t(first + i) * _block_size;
+            for (std::size_t written = 0; out_fd >= 0 && written < entry.size;) {
+                ssize_t result = pwrite(out_fd, outputs[i].data() + written, entry.size - written,
+                                        off_t(position + written));
+                if (result <= 0) {
+                    throw std::runtime_error("Couldn't write output file.");
+                }
+                written += result;
+            }
+            if (out_fd >= 0) {
+                stats[i].write_seconds += lap(write_start);
+            }
+#endif
+        });
+        lap(start);
+        for (std::size_t i = 0; i < count; ++i) {
+            if (out_fd < 0) {
+                _out.write((char *)outputs[i].data(), std::streamsize(outputs[i].size()));
+            }
+            _in_file_size += payload_sizes[i];
+            _stats += stats[i];
+        }
+        _stats.write_seconds += lap(start);
+    }
+    _extra_data_size = index.back().offset + block_count * (sizeof(BlockEntry::offset) + sizeof(BlockEntry::size)) +
+                       sizeof(uint64_t) - _in_file_size;
+}
+
+bool HuffmanArchiver::is_streaming() const noexcept {
+    return !_in_file.is_open() || !_in_regular || !_out_file.is_open();
+}
+
+void HuffmanArchiver::zip_stream() {
+    if (!_block_size) {
+        _block_size = DEFAULT_BLOCK_SIZE;
+    }
+    FormatVersion version = FormatVersion::stream;
+    uint32_t block_size = _block_size;
+    _out.write(SIGNATURE, sizeof(SIGNATURE));
+    _out.write((char *)&version, sizeof(version));
+    _out.write((char *)&block_size, sizeof(block_size));
+    _in_file_size = 0;
+    _out_file_size = 0;
+    _extra_data_size = sizeof(SIGNATURE) + sizeof(version) + sizeof(block_size);
+    _length_limit_overhead = 0;
+    std::size_t batch_size = std::size_t(_thread_count) * 4;
+    std::vector<std::vector<unsigned char>> inputs(batch_size);
+    std::vector<Block> blocks(batch_size);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    while (_in) {
+        std::size_t count = 0;
+        lap(start);
+        for (; count < batch_size && _in; ++count) {
+            inputs[count].resize(_block_size);
+            _in.read((char *)inputs[count].data(), std::streamsize(_block_size));
+            inputs[count].resize(_in.gcount());
+            if (inputs[count].empty()) {
+                break;
+            }
+        }
+        _stats.read_seconds += lap(start);
+        run_parallel(count, _thread_count, [&](std::size_t i) {
+            blocks[i] = compress_block(inputs[i].data(), inputs[i].size());
+        });
+        lap(start);
+        for (std::size_t i = 0; i < count; ++i) {
+            _stats += blocks[i].stats;
+            uint32_t size = inputs[i].size();
+            _out.write((char *)&size, sizeof(size));
+            _out.write((char *)blocks[i].header.data(), std::streamsize(blocks[i].header.size()));
+            _out.write((char *)blocks[i].payload.data(), std::streamsize(blocks[i].payload.size()));
+            _in_file_size += size;
+            _extra_data_size += sizeof(size) + blocks[i].header.size();
+            _out_file_size += blocks[i].payload.size();
+            _length_limit_overhead += blocks[i].length_limit_overhead;
+        }
+        _stats.write_seconds += lap(start);
+    }
+    if (_in.bad()) {
+        throw std::runtime_error("Couldn't read input file.");
+    }
+    uint32_t end_of_blocks = 0;
+    _out.write((char *)&end_of_blocks, sizeof(end_of_blocks));
+    _out.write((char *)&_in_file_size, sizeof(_in_file_size));
+    _extra_data_size += sizeof(end_of_blocks) + sizeof(_in_file_size);
+}
+
+void HuffmanArchiver::unzip_stream(FormatVersion version) {
+    _in.exceptions(std::ios_base::badbit | std::ios_base::failbit);
+    uint64_t read_size = sizeof(SIGNATURE) + sizeof(version) + sizeof(uint32_t);
+    uint64_t total_size = 0;
+    if (version == FormatVersion::blocks) {
+        read_size += sizeof(total_size);
+        total_size = _out_file_size;
+    }
+    std::size_t batch_size = std::size_t(_thread_count) * 4;
+    std::vector<std::vector<unsigned char>> records(batch_size);
+    std::vector<std::vector<unsigned char>> outputs(batch_size);
+    std::vector<uint32_t> payload_sizes(batch_size);
+    std::vector<Stats> stats(batch_size);
+    _in_file_size = 0;
+    _out_file_size = 0;
+    bool finished = false;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    while (!finished) {
+        std::size_t count = 0;
+        lap(start);
+        for (; count < batch_size; ++count) {
+            uint32_t size;
+            if (version == FormatVersion::blocks) {
+                size = std::min<uint64_t>(_block_size, total_size - _out_file_size);
+            } else {
+                _in.read((char *)&size, sizeof(size));
+                read_size += sizeof(size);
+                if (size > _block_size) {
+                    throw std::logic_error("Invalid block.");
+                }
+            }
+            if (!size) {
+                finished = true;
+                break;
+            }
+            std::vector<unsigned char> &record = records[count];
+            record.assign(1, 0);
+            _in.read((char *)record.data(), 1);
+            if (record[0] > uint8_t(BlockType::clustered)) {
+                throw std::logic_error("Invalid block.");
+            }
+            if (BlockType(record[0]) == BlockType::stored) {
+                record.resize(1 + size);
+                _in.read((char *)record.data() + 1, std::streamsize(size));
+                read_size += record.size();
+                outputs[count].resize(size);
+                _out_file_size += size;
+                continue;
+            }
+            if (BlockType(record[0]) == BlockType::run) {
+                record.resize(2);
+                _in.read((char *)record.data() + 1, 1);
+                read_size += record.size();
+                outputs[count].resize(size);
+                _out_file_size += size;
+                continue;
+            }
+            std::size_t table_count = 1;
+            if (BlockType(record[0]) == BlockType::context) {
+                record.resize(1 + CONTEXT_MASK_SIZE);
+                _in.read((char *)record.data() + 1, CONTEXT_MASK_SIZE);
+                table_count = 0;
+                for (std::size_t i = 1; i < record.size(); ++i) {
+                    table_count += std::popcount(record[i]);
+                }
+            } else if (BlockType(record[0]) == BlockType::clustered) {
+                record.resize(1 + sizeof(uint8_t) + CONTEXT_COUNT);
+                _in.read((char *)record.data() + 1, std::streamsize(record.size() - 1));
+                table_count = record[1];
+            }
+            for (std::size_t i = 0; i < table_count; ++i) {
+                unpack_code_lengths([&]() {
+                    unsigned char byte;
+                    _in.read((char *)&byte, sizeof(byte));
+                    record.push_back(byte);
+                    return byte;
+                });
+            }
+            std::size_t stream_count = BlockType(record[0]) == BlockType::huffman ? 1 : INTERLEAVED_STREAMS;
+            uint64_t payload_size = 0;
+            for (std::size_t i = 0; i < stream_count; ++i) {
+                uint32_t stream_size;
+                _in.read((char *)&stream_size, sizeof(stream_size));
+                const unsigned char *stream_size_bytes = (const unsigned char *)&stream_size;
+                record.insert(record.end(), stream_size_bytes, stream_size_bytes + sizeof(stream_size));
+                payload_size += stream_size;
+            }
+            if (payload_size >
+                (uint64_t(size) * HuffTree::MAX_CANONICAL_CODE_LENGTH + CHAR_BIT - 1) / CHAR_BIT + stream_count) {
+                throw std::logic_error("Invalid block.");
+            }
+            std::size_t header_size = record.size();
+            record.resize(header_size + payload_size);
+            _in.read((char *)record.data() + header_size, std::streamsize(payload_size));
+            read_size += record.size();
+            outputs[count].resize(size);
+            _out_file_size += size;
+        }
+        _stats.read_seconds += lap(start);
+        run_parallel(count, _thread_count, [&](std::size_t i) {
+            stats[i] = Stats{};
+            payload_sizes[i] = decode_block_record(records[i].data(), records[i].size(),
+                                                   outputs[i].data(), outputs[i].size(), stats[i]);
+        });
+        lap(start);
+        for (std::size_t i = 0; i < count; ++i) {
+            _out.write((char *)outputs[i].data(), std::streamsize(outputs[i].size()));
+            _in_file_size += payload_sizes[i];
+            _stats += stats[i];
+        }
+        _stats.write_seconds += lap(start);
+    }
+    if (version == FormatVersion::stream) {
+        _in.read((char *)&total_size, sizeof(total_size));
+        read_size += sizeof(total_size);
+        if (total_size != _out_file_size) {
+            throw std::logic_error("Invalid archive length.");
+        }
+    }
+    _extra_data_size = read_size - _in_file_size;
+}
+
+void HuffmanArchiver::estimate_blocks() {
+    if (!_block_size) {
+        _block_size = DEFAULT_BLOCK_SIZE;
+    }
+    const uint64_t entry_size = sizeof(BlockEntry::offset) + sizeof(BlockEntry::size);
+    bool indexed = _in_file.is_open() && _in_regular;
+    _in_file_size = 0;
+    _out_file_size = 0;
+    _extra_data_size = indexed ? sizeof(SIGNATURE) + sizeof(FormatVersion) + sizeof(uint64_t) + sizeof(uint32_t) +
+                                 sizeof(uint64_t)
+                               : sizeof(SIGNATURE) + sizeof(FormatVersion) + sizeof(uint32_t) + sizeof(uint32_t) +
+                                 sizeof(uint64_t);
+    _length_limit_overhead = 0;
+    std::size_t batch_size = std::size_t(_thread_count) * 4;
+    std::vector<std::vector<unsigned char>> inputs(batch_size);
+    std::vector<const unsigned char *> data(batch_size);
+    std::vector<std::size_t> sizes(batch_size);
+    std::vector<BlockLayout> layouts(batch_size);
+    std::vector<Stats> stats(batch_size);
+    bool finished = false;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    while (!finished) {
+        std::size_t count = 0;
+        lap(start);
+        for (; count < batch_size; ++count) {
+            if (_in_map->is_mapped()) {
+                sizes[count] = std::min<uint64_t>(_block_size, _in_map->size() - _in_file_size);
+                data[count] = _in_map->data() + _in_file_size;
+            } else {
+                inputs[count].resize(_block_size);
+                _in.read((char *)inputs[count].data(), std::streamsize(_block_size));
+                sizes[count] = _in.gcount();
+                data[count] = inputs[count].data();
+            }
+            if (!sizes[count]) {
+                finished = true;
+                break;
+            }
+            _in_file_size += sizes[count];
+        }
+        _stats.read_seconds += lap(start);
+        run_parallel(count, _thread_count, [&](std::size_t i) {
+            stats[i] = Stats{};
+            layouts[i] = plan_block(data[i], sizes[i], stats[i]);
+        });
+        for (std::size_t i = 0; i < count; ++i) {
+            _stats += stats[i];
+            _extra_data_size += layouts[i].header_size + (indexed ? entry_size : sizeof(uint32_t));
+            _out_file_size += layouts[i].payload_size;
+            _length_limit_overhead += layouts[i].length_limit_overhead;
         }
     }
-    while (buffer.size() % CHAR_BIT != 0) {
-        buffer.push(false);
+    if (_in.bad()) {
+        throw std::runtime_error("Couldn't read input file.");
     }
-    extract_buffer(buffer);
 }
@@ -1,38 +1,147 @@
 #include <iostream>
+#include <ostream>
+#include <stdexcept>
 #include <string>
 #include "huffman.h"
 
+static unsigned long long parse_number(const std::string &value, const std::string &name, std::size_t max_digits,
+                                       const std::string &suffixes = "") {
+    std::size_t digits = value.size();
+    unsigned long long multiplier = 1;
+    if (!suffixes.empty() && digits && suffixes.find(value.back()) != std::string::npos) {
+        multiplier = value.back() == 'K' ? 1ull << 10 : value.back() == 'M' ? 1ull << 20 : 1ull << 30;
+        --digits;
+    }
+    if (!digits || digits > max_digits || value.find_first_not_of("0123456789") < digits) {
+        throw std::invalid_argument("Invalid " + name + ": \"" + value + "\"");
+    }
+    return std::stoull(value.substr(0, digits)) * multiplier;
+}
+
+static void print_json_stats(std::ostream &out, const huffman_algo::HuffmanArchiver &archiver) {
+    const huffman_algo::HuffmanArchiver::Stats &stats = archiver.get_stats();
+    out << "{\"in_file_size\": " << archiver.get_in_file_size()
+        << ", \"out_file_size\": " << archiver.get_out_file_size()
+        << ", \"extra_data_size\": " << archiver.get_extra_data_size()
+        << ", \"length_limit_overhead\": " << archiver.get_length_limit_overhead()
+        << ", \"read_seconds\": " << stats.read_seconds
+        << ", \"histogram_seconds\": " << stats.histogram_seconds
+        << ", \"tree_build_seconds\": " << stats.tree_build_seconds
+        << ", \"code_gen_seconds\": " << stats.code_gen_seconds
+        << ", \"encode_seconds\": " << stats.encode_seconds
+        << ", \"decode_seconds\": " << stats.decode_seconds
+        << ", \"write_seconds\": " << stats.write_seconds
+        << ", \"total_seconds\": " << stats.total_seconds
+        << ", \"bytes_read\": " << stats.bytes_read
+        << ", \"bytes_written\": " << stats.bytes_written
+        << ", \"average_code_length\": " << stats.average_code_length
+        << ", \"max_code_length\": " << stats.max_code_length
+        << ", \"block_count\": " << stats.block_count << "}\n";
+}
+
 int main(int argc, char *argv[]) {
+    std::ios_base::sync_with_stdio(false);
     bool zip = true;
+    bool estimate = false;
+    bool interleaved = false;
+    bool context = false;
+    bool tokens = false;
+    bool json_stats = false;
     std::string in_filename;
     std::string out_filename;
+    std::string max_code_length;
+    std::string threads;
+    std::string block_size;
+    std::string memory_limit;
+    std::string context_tables;
     for (std::size_t i = 1; i < argc; ++i) {
         std::string_view arg = argv[i];
         if (arg == "-u") {
             zip = false;
         } else if (arg == "-c") {
             zip = true;
+        } else if (arg == "--estimate") {
+            estimate = true;
+        } else if (arg == "--interleaved") {
+            interleaved = true;
+        } else if (arg == "--context") {
+            context = true;
+        } else if (arg == "--tokens") {
+            tokens = true;
+        } else if (arg == "--stats=json") {
+            json_stats = true;
         } else if ((arg == "-f" || arg == "--file") && i < argc - 1) {
             in_filename = argv[i + 1];
             ++i;
         } else if ((arg == "-o" || arg == "--output") && i < argc - 1) {
             out_filename = argv[i + 1];
             ++i;
+        } else if (arg == "--max-code-length" && i < argc - 1) {
+            max_code_length = argv[i + 1];
+            ++i;
+        } else if (arg == "--threads" && i < argc - 1) {
+            threads = argv[i + 1];
+            ++i;
+        } else if (arg == "--block-size" && i < argc - 1) {
+            block_size = argv[i + 1];
+            ++i;
+        } else if (arg == "--memory-limit" && i < argc - 1) {
+            memory_limit = argv[i + 1];
+            ++i;
+        } else if (arg == "--context-tables" && i < argc - 1) {
+            context_tables = argv[i + 1];
+            context = true;
+            ++i;
         } else {
             std::cerr << "Invalid argument: \"" << arg <<  "\"";
             return 1;
         }
     }
-    huffman_algo::HuffmanArchiver archiver(in_filename, out_filename);
+    huffman_algo::HuffmanArchiver archiver = estimate ? huffman_algo::HuffmanArchiver(in_filename)
+                                                      : huffman_algo::HuffmanArchiver(in_filename, out_filename);
     try {
-        if (zip) {
+        if (tokens && (!threads.empty() || !block_size.empty() || interleaved || context)) {
+            throw std::invalid_argument("Token mode can't be combined with thread, block or context options.");
+        }
+        if (!max_code_length.empty()) {
+            archiver.set_max_code_length(parse_number(max_code_length, "maximum code length", 2));
+        }
+        if (!threads.empty()) {
+            archiver.set_thread_count(parse_number(threads, "thread count", 4));
+        }
+        if (!block_size.empty()) {
+            archiver.set_block_size(parse_number(block_size, "block size", 10, "KM"));
+        } else if (!threads.empty() || interleaved || context) {
+            archiver.set_block_size(huffman_algo::HuffmanArchiver::DEFAULT_BLOCK_SIZE);
+        }
+        archiver.set_interleaved(interleaved);
+        archiver.set_context_model(context);
+        archiver.set_token_model(tokens);
+        if (!context_tables.empty()) {
+            archiver.set_context_tables(parse_number(context_tables, "context table count", 2));
+        }
+        if (!memory_limit.empty()) {
+            archiver.set_memory_limit(parse_number(memory_limit, "memory limit", 10, "KMG"));
+        }
+        if (estimate) {
+            archiver.estimate();
+        } else if (zip) {
             archiver.zip();
         } else {
             archiver.unzip();
         }
-        std::cout << archiver.get_in_file_size() << '\n';
-        std::cout << archiver.get_out_file_size() << '\n';
-        std::cout << archiver.get_extra_data_size();
+        std::ostream &stats = !estimate && out_filename == huffman_algo::HuffmanArchiver::STANDARD_STREAM ? std::cerr
+                                                                                                         : std::cout;
+        if (json_stats) {
+            print_json_stats(stats, archiver);
+        } else {
+            stats << archiver.get_in_file_size() << '\n';
+            stats << archiver.get_out_file_size() << '\n';
+            stats << archiver.get_extra_data_size();
+            if ((zip || estimate) && !max_code_length.empty()) {
+                stats << '\n' << archiver.get_length_limit_overhead();
+            }
+        }
     } catch (const std::exception &e) {
         std::cerr << e.what();
         return 1;
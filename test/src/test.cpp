@@ -1,16 +1,26 @@
 #define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
 #include "doctest.h"
 
+#include <algorithm>
 #include <array>
 #include <climits>
+#include <cstdio>
+#include <cstring>
 #include <deque>
 #include <fstream>
-#include <list>
+#include <iostream>
+#include <iterator>
 #include <memory>
 #include <queue>
+#include <span>
+#include <sstream>
 #include <stdexcept>
 #include <string>
+#include <thread>
+#include <tuple>
+#include <utility>
 #include <vector>
+#include <sys/stat.h>
 #include "huffman.h"
 
 using namespace huffman_algo;
@@ -19,55 +29,41 @@ static std::string path(const std::string &filename) {
     return DATA_DIR + filename;
 }
 
+static std::string output_path(const std::string &filename) {
+    return OUTPUT_DIR + filename;
+}
+
 class huffman_algo::HuffmanArchiver::TreeNode::TestTreeNode {
     TEST_CASE_CLASS("testing TreeNode") {
         SUBCASE("constructor doesn't throw") {
             CHECK_NOTHROW(TreeNode node);
-            CHECK_NOTHROW(TreeNode node(2));
-            CHECK_NOTHROW(TreeNode node(2, true));
-            CHECK_NOTHROW(TreeNode node(2, true, 'a'));
-            CHECK_NOTHROW(TreeNode node(2, true, 'a'));
+            CHECK_NOTHROW(TreeNode node(true));
+            CHECK_NOTHROW(TreeNode node(true, 'a'));
+            CHECK_NOTHROW(TreeNode node(false, 0, 1));
+            CHECK_NOTHROW(TreeNode node(false, 0, 1, 2));
+        }
 
-            std::unique_ptr<TreeNode> left_child = nullptr;
-            std::unique_ptr<TreeNode> right_child = std::make_unique<TreeNode>();
+        SUBCASE("constructor") {
+            TreeNode leaf_node(true, 'a');
+            TreeNode inner_node(false, 'b', 1, 2);
 
-            CHECK_NOTHROW(TreeNode node(2, true, 'a', std::move(left_child)));
-            CHECK_NOTHROW(TreeNode node(2, true, 'a', std::move(left_child), std::move(right_child)));
+            CHECK_EQ(leaf_node._is_leaf, true);
+            CHECK_EQ(leaf_node._value, 'a');
+            CHECK_EQ(leaf_node._left_child, 0);
+            CHECK_EQ(leaf_node._right_child, 0);
+            CHECK_EQ(inner_node._is_leaf, false);
+            CHECK_EQ(inner_node._value, 'b');
+            CHECK_EQ(inner_node._left_child, 1);
+            CHECK_EQ(inner_node._right_child, 2);
         }
 
-        SUBCASE("constructor") {
-            std::unique_ptr<TreeNode> left_child = nullptr;
-            std::unique_ptr<TreeNode> right_child =
-                    std::make_unique<TreeNode>(1, false, 'b',
-                                               std::make_unique<TreeNode>(), nullptr);
-            TreeNode node(2, true, 'a',
-                          std::move(left_child), std::move(right_child));
-
-            CHECK_EQ(node._frequency, 2);
-            CHECK_EQ(node._is_leaf, true);
-            CHECK_EQ(node._value, 'a');
-            CHECK_EQ(node._left_child, nullptr);
-            CHECK_NE(node._right_child, nullptr);
-            CHECK_EQ(node._right_child->_frequency, 1);
-            CHECK_EQ(node._right_child->_is_leaf, false);
-            CHECK_EQ(node._right_child->_value, 'b');
-            CHECK_NE(node._right_child->_left_child, nullptr);
-            CHECK_EQ(node._right_child->_right_child, nullptr);
-        }
-
-        std::unique_ptr<TreeNode> left_child = std::make_unique<TreeNode>();
-        std::unique_ptr<TreeNode> right_child = std::make_unique<TreeNode>();
+        SUBCASE("size") {
+            CHECK(sizeof(TreeNode) <= 6);
+        }
 
         TreeNode default_node;
         const TreeNode const_node;
-        TreeNode custom_node(2, true, 'a',
-                             std::move(left_child),std::move(right_child));
-
-        SUBCASE("get_frequency") {
-            CHECK_EQ(default_node.get_frequency(), 0);
-            CHECK_NOTHROW(const_node.get_frequency());
-            CHECK_EQ(custom_node.get_frequency(), custom_node._frequency);
-        }
+        TreeNode custom_node(true, 'a', 3, 4);
 
         SUBCASE("is_leaf") {
             CHECK_EQ(default_node.is_leaf(), false);
@@ -76,21 +72,21 @@ class huffman_algo::HuffmanArchiver::TreeNode::TestTreeNode {
         }
 
         SUBCASE("get_value") {
-            CHECK_EQ(default_node.get_frequency(), 0);
+            CHECK_EQ(default_node.get_value(), 0);
             CHECK_NOTHROW(const_node.get_value());
-            CHECK_EQ(custom_node.get_frequency(), custom_node._frequency);
+            CHECK_EQ(custom_node.get_value(), custom_node._value);
         }
 
         SUBCASE("get_left_child") {
-            CHECK_EQ(default_node.get_left_child(), nullptr);
-            CHECK_EQ(const_node.get_left_child(), nullptr);
+            CHECK_EQ(default_node.get_left_child(), 0);
+            CHECK_EQ(const_node.get_left_child(), 0);
             CHECK_EQ(custom_node.get_left_child(), custom_node._left_child);
             CHECK_NE(custom_node.get_left_child(), custom_node._right_child);
         }
 
         SUBCASE("get_right_child") {
-            CHECK_EQ(default_node.get_right_child(), nullptr);
-            CHECK_EQ(const_node.get_right_child(), nullptr);
+            CHECK_EQ(default_node.get_right_child(), 0);
+            CHECK_EQ(const_node.get_right_child(), 0);
             CHECK_EQ(custom_node.get_right_child(), custom_node._right_child);
             CHECK_NE(custom_node.get_right_child(), custom_node._left_child);
         }
@@ -100,16 +96,14 @@ class huffman_algo::HuffmanArchiver::TreeNode::TestTreeNode {
 
 class huffman_algo::HuffmanArchiver::HuffTree::TestHuffTree {
     TEST_CASE_CLASS("testing HuffTree") {
-        std::array<uint32_t, UCHAR_MAX + 1> empty_vocabulary{};
-        std::array<uint32_t, UCHAR_MAX + 1> normal_vocabulary{};
+        std::array<uint64_t, UCHAR_MAX + 1> empty_vocabulary{};
+        std::array<uint64_t, UCHAR_MAX + 1> normal_vocabulary{};
         normal_vocabulary['a'] = 100;
         normal_vocabulary['b'] = 200;
         normal_vocabulary['c'] = 300;
-        std::array<uint32_t, UCHAR_MAX + 1> big_vocabulary{};
-        std::size_t big_vocabulary_sum = 0;
+        std::array<uint64_t, UCHAR_MAX + 1> big_vocabulary{};
         for (std::size_t i = 0; i <= UCHAR_MAX; ++i) {
             big_vocabulary[i] = 100 * (i + 1);
-            big_vocabulary_sum += 100 * (i + 1);
         }
         REQUIRE_EQ(big_vocabulary.size(), UCHAR_MAX + 1);
 
@@ -119,41 +113,170 @@ class huffman_algo::HuffmanArchiver::HuffTree::TestHuffTree {
             CHECK_NOTHROW(HuffTree tree(big_vocabulary));
         }
 
-        SUBCASE("find_min") {
-            std::list<std::unique_ptr<TreeNode>> empty_list;
-            std::list<std::unique_ptr<TreeNode>> normal_list;
-            normal_list.push_back(std::make_unique<TreeNode>(10));
-            normal_list.push_back(std::make_unique<TreeNode>(5));
-            normal_list.push_back(std::make_unique<TreeNode>(7));
-            normal_list.push_back(std::make_unique<TreeNode>(2));
-            normal_list.push_back(std::make_unique<TreeNode>(8));
-            std::list<std::unique_ptr<TreeNode>> first_element_list;
-            first_element_list.push_back(std::make_unique<TreeNode>(1));
-            first_element_list.push_back(std::make_unique<TreeNode>(5));
-            first_element_list.push_back(std::make_unique<TreeNode>(3));
-            std::list<std::unique_ptr<TreeNode>> last_element_list;
-            last_element_list.push_back(std::make_unique<TreeNode>(5));
-            last_element_list.push_back(std::make_unique<TreeNode>(3));
-            last_element_list.push_back(std::make_unique<TreeNode>(0));
-
-            CHECK_EQ(find_min(empty_list), empty_list.end());
-            CHECK_EQ(find_min(normal_list)->get()->get_frequency(), 2);
-            CHECK_EQ(find_min(first_element_list)->get()->get_frequency(), 1);
-            CHECK_EQ(find_min(last_element_list)->get()->get_frequency(), 0);
+        SUBCASE("build_tree") {
+            std::vector<TreeNode> empty_nodes = HuffTree::build_tree(empty_vocabulary);
+            std::vector<TreeNode> normal_nodes = HuffTree::build_tree(normal_vocabulary);
+            std::vector<TreeNode> big_nodes = HuffTree::build_tree(big_vocabulary);
+
+            CHECK(empty_nodes.empty());
+            REQUIRE_EQ(normal_nodes.size(), 5);
+            CHECK_FALSE(normal_nodes[0].is_leaf());
+            CHECK_EQ(normal_nodes[0].get_left_child(), 1);
+            CHECK_EQ(normal_nodes[0].get_right_child(), 2);
+            CHECK(normal_nodes[1].is_leaf());
+            CHECK_EQ(normal_nodes[1].get_value(), 'c');
+            CHECK_FALSE(normal_nodes[2].is_leaf());
+            CHECK_EQ(big_nodes.size(), 2 * big_vocabulary.size() - 1);
+            std::size_t leaf_count = 0;
+            for (std::size_t i = 0; i < big_nodes.size(); ++i) {
+                if (big_nodes[i].is_leaf()) {
+                    ++leaf_count;
+                } else {
+                    CHECK(big_nodes[i].get_left_child() > i);
+                    CHECK_EQ(big_nodes[i].get_right_child(), big_nodes[i].get_left_child() + 1);
+                }
+            }
+            CHECK_EQ(leaf_count, big_vocabulary.size());
+        }
+
+        SUBCASE("build_limited_code_lengths") {
+            std::vector<uint64_t> fibonacci_frequencies(UCHAR_MAX + 1, 0);
+            uint64_t prev = 1, cur = 1;
+            for (std::size_t i = 0; i < 40; ++i) {
+                fibonacci_frequencies[i] = cur;
+                cur += prev;
+                prev = cur - prev;
+            }
+            std::vector<uint64_t> big_frequencies(big_vocabulary.begin(), big_vocabulary.end());
+            std::vector<uint8_t> optimal_lengths = build_code_lengths(fibonacci_frequencies);
+            REQUIRE(*std::max_element(optimal_lengths.begin(), optimal_lengths.end()) > 15);
+
+            CHECK_EQ(build_limited_code_lengths(big_frequencies, 15), build_code_lengths(big_frequencies));
+            CHECK_EQ(build_limited_code_lengths(fibonacci_frequencies, 40), optimal_lengths);
+            CHECK_THROWS_AS(build_limited_code_lengths(big_frequencies, 7), std::invalid_argument);
+            CHECK_THROWS_AS(build_limited_code_lengths(fibonacci_frequencies, 5), std::invalid_argument);
+            for (unsigned max_code_length: {6u, 8u, 11u, 12u, 15u}) {
+                std::vector<uint8_t> lengths = build_limited_code_lengths(fibonacci_frequencies, max_code_length);
+                uint64_t kraft_sum = 0;
+                uint64_t optimal_bits = 0;
+                uint64_t limited_bits = 0;
+                for (std::size_t i = 0; i <= UCHAR_MAX; ++i) {
+                    CHECK(lengths[i] <= max_code_length);
+                    CHECK_EQ(lengths[i] == 0, fibonacci_frequencies[i] == 0);
+                    if (lengths[i]) {
+                        kraft_sum += uint64_t(1) << (max_code_length - lengths[i]);
+                    }
+                    optimal_bits += fibonacci_frequencies[i] * optimal_lengths[i];
+                    limited_bits += fibonacci_frequencies[i] * lengths[i];
+                }
+                CHECK_EQ(kraft_sum, uint64_t(1) << max_code_length);
+                CHECK(limited_bits >= optimal_bits);
+            }
+        }
+
+        SUBCASE("canonical constructor") {
+            std::array<uint8_t, UCHAR_MAX + 1> empty_lengths{};
+            std::array<uint8_t, UCHAR_MAX + 1> one_letter_lengths{};
+            one_letter_lengths['a'] = 1;
+            std::array<uint8_t, UCHAR_MAX + 1> normal_lengths{};
+            normal_lengths['a'] = 2;
+            normal_lengths['b'] = 2;
+            normal_lengths['c'] = 1;
+            std::array<uint8_t, UCHAR_MAX + 1> big_lengths{};
+            std::vector<uint8_t> lengths = build_code_lengths({big_vocabulary.begin(), big_vocabulary.end()});
+            std::copy(lengths.begin(), lengths.end(), big_lengths.begin());
+            std::array<uint8_t, UCHAR_MAX + 1> incomplete_lengths = normal_lengths;
+            incomplete_lengths['c'] = 2;
+            std::array<uint8_t, UCHAR_MAX + 1> oversubscribed_lengths = normal_lengths;
+            oversubscribed_lengths['d'] = 1;
+            std::array<uint8_t, UCHAR_MAX + 1> too_long_lengths = one_letter_lengths;
+            too_long_lengths['b'] = MAX_CANONICAL_CODE_LENGTH + 1;
+
+            HuffTree empty_tree(empty_lengths);
+            HuffTree one_letter_tree(one_letter_lengths);
+            HuffTree normal_tree(normal_lengths);
+            HuffTree big_tree(big_lengths);
+            CHECK(empty_tree._nodes.empty());
+            CHECK_EQ(one_letter_tree._nodes.size(), 1);
+            CHECK_EQ(one_letter_tree.get_code_table()['a'].length, 1);
+            CHECK_EQ(normal_tree._nodes.size(), 5);
+            CHECK_EQ(normal_tree.get_code_table()['c'].bits, 0b0);
+            CHECK_EQ(normal_tree.get_code_table()['a'].bits, 0b01);
+            CHECK_EQ(normal_tree.get_code_table()['b'].bits, 0b11);
+            for (std::size_t i = 0; i <= UCHAR_MAX; ++i) {
+                CHECK_EQ(big_tree.get_code_table()[i].length, big_lengths[i]);
+                CHECK_EQ(big_tree.get_code_by_char(i).size(), big_lengths[i]);
+            }
+            CHECK_THROWS_AS(HuffTree tree(incomplete_lengths), std::logic_error);
+            CHECK_THROWS_AS(HuffTree tree(oversubscribed_lengths), std::logic_error);
+            CHECK_THROWS_AS(HuffTree tree(too_long_lengths), std::logic_error);
         }
 
-        SUBCASE("build_tree") {
-            std::unique_ptr<TreeNode> empty_root = HuffTree::build_tree(empty_vocabulary);
-            std::unique_ptr<TreeNode> normal_root = HuffTree::build_tree(normal_vocabulary);
-            std::unique_ptr<TreeNode> big_root = HuffTree::build_tree(big_vocabulary);
+        SUBCASE("build_canonical_codes") {
+            std::array<uint8_t, UCHAR_MAX + 1> code_lengths{};
+            code_lengths['a'] = 1;
+            code_lengths['b'] = 2;
+            code_lengths['c'] = 3;
+            code_lengths['d'] = 3;
+            HuffTree tree(code_lengths);
+            std::vector<Code> codes = build_canonical_codes(std::vector<uint8_t>(code_lengths.begin(),
+                                                                                 code_lengths.end()));
+            REQUIRE_EQ(codes.size(), code_lengths.size());
+            for (std::size_t i = 0; i <= UCHAR_MAX; ++i) {
+                CHECK_EQ(codes[i].length, tree.get_code_table()[i].length);
+                CHECK_EQ(codes[i].bits, tree.get_code_table()[i].bits);
+            }
+
+            std::vector<uint8_t> lengths(UCHAR_MAX + 1 + 1000, 0);
+            std::fill(lengths.begin() + UCHAR_MAX + 1, lengths.end(), 10);
+            std::fill(lengths.begin() + UCHAR_MAX + 1, lengths.begin() + UCHAR_MAX + 1 + 24, 9);
+            codes = build_canonical_codes(lengths);
+            for (std::size_t i = 0; i < codes.size(); ++i) {
+                CHECK_EQ(codes[i].length, lengths[i]);
+                for (std::size_t j = 0; j < i; ++j) {
+                    unsigned length = std::min(codes[i].length, codes[j].length);
+                    uint64_t mask = (uint64_t(1) << length) - 1;
+                    if (length && (codes[i].bits & mask) == (codes[j].bits & mask)) {
+                        FAIL("codes share a prefix");
+                    }
+                }
+            }
+
+            CHECK(build_canonical_codes({}).empty());
+            CHECK_EQ(build_canonical_codes({0, 1, 0})[1].length, 1);
+            CHECK_THROWS_AS(build_canonical_codes({1, 1, 1}), std::logic_error);
+            CHECK_THROWS_AS(build_canonical_codes({1, 2}), std::logic_error);
+            CHECK_THROWS_AS(build_canonical_codes({2}), std::logic_error);
+        }
+
+        SUBCASE("build_code_lengths") {
+            std::vector<uint64_t> normal_frequencies(normal_vocabulary.begin(), normal_vocabulary.end());
+            std::vector<uint64_t> big_frequencies(big_vocabulary.begin(), big_vocabulary.end());
+            std::vector<uint64_t> one_letter_frequencies(UCHAR_MAX + 1, 0);
+            one_letter_frequencies['a'] = 100;
+            std::vector<uint64_t> huge_frequencies(50000);
+            for (std::size_t i = 0; i < huge_frequencies.size(); ++i) {
+                huge_frequencies[i] = 1000000 / (i + 1);
+            }
+            HuffTree normal_tree(normal_vocabulary);
+            HuffTree big_tree(big_vocabulary);
 
-            CHECK_EQ(empty_root, nullptr);
-            CHECK_EQ(normal_root->get_frequency(), 600);
-            CHECK_NE(normal_root->get_left_child(), nullptr);
-            CHECK_NE(normal_root->get_right_child(), nullptr);
-            CHECK_EQ(big_root->get_frequency(), big_vocabulary_sum);
-            CHECK_NE(big_root->get_left_child(), nullptr);
-            CHECK_NE(big_root->get_right_child(), nullptr);
+            CHECK(HuffTree::build_code_lengths({}).empty());
+            CHECK_EQ(HuffTree::build_code_lengths(std::vector<uint64_t>(3, 0)), std::vector<uint8_t>(3, 0));
+            CHECK_EQ(HuffTree::build_code_lengths(one_letter_frequencies)['a'], 1);
+            std::vector<uint8_t> normal_lengths = HuffTree::build_code_lengths(normal_frequencies);
+            std::vector<uint8_t> big_lengths = HuffTree::build_code_lengths(big_frequencies);
+            for (std::size_t i = 0; i <= UCHAR_MAX; ++i) {
+                CHECK_EQ(normal_lengths[i], normal_tree.get_code_table()[i].length);
+                CHECK_EQ(big_lengths[i], big_tree.get_code_table()[i].length);
+            }
+            std::vector<uint8_t> huge_lengths = HuffTree::build_code_lengths(huge_frequencies);
+            double kraft_sum = 0;
+            for (auto length: huge_lengths) {
+                REQUIRE(length > 0);
+                kraft_sum += 1.0 / double(uint64_t(1) << length);
+            }
+            CHECK_EQ(kraft_sum, doctest::Approx(1.0));
         }
 
         SUBCASE("constructor") {
@@ -161,21 +284,18 @@ class huffman_algo::HuffmanArchiver::HuffTree::TestHuffTree {
             HuffTree normal_tree(normal_vocabulary);
             HuffTree big_tree(big_vocabulary);
 
-            CHECK_EQ(empty_tree._root, nullptr);
-            CHECK_NE(normal_tree._root, nullptr);
-            CHECK_EQ(normal_tree._root->get_frequency(), 600);
-            CHECK_NE(big_tree._root, nullptr);
-            CHECK_EQ(big_tree._root->get_frequency(), big_vocabulary_sum);
-            CHECK_EQ(empty_tree._cur_node, empty_tree._root.get());
-            CHECK_EQ(normal_tree._cur_node, normal_tree._root.get());
-            CHECK_EQ(big_tree._cur_node, big_tree._root.get());
+            CHECK(empty_tree._nodes.empty());
+            CHECK_EQ(normal_tree._nodes.size(), 5);
+            CHECK_EQ(big_tree._nodes.size(), 2 * big_vocabulary.size() - 1);
+            CHECK_EQ(empty_tree._cur_node, 0);
+            CHECK_EQ(normal_tree._cur_node, 0);
+            CHECK_EQ(big_tree._cur_node, 0);
         }
 
         SUBCASE("get_next_code") {
             HuffTree empty_tree(empty_vocabulary);
-            empty_tree._cur_node = nullptr;
             HuffTree leaf_tree(empty_vocabulary);
-            leaf_tree._cur_node = new TreeNode(20, true, 'a');
+            leaf_tree._nodes.emplace_back(true, 'a');
             std::vector<bool> code;
 
             CHECK_NOTHROW(empty_tree.get_next_code(code));
@@ -184,20 +304,15 @@ class huffman_algo::HuffmanArchiver::HuffTree::TestHuffTree {
             CHECK_NOTHROW(leaf_tree.get_next_code(code));
             CHECK_EQ(leaf_tree._chars_to_codes['a'].size(), 1);
             CHECK_EQ(get_number_of_codes(leaf_tree), 1);
-
-            delete leaf_tree._cur_node;
         }
 
         SUBCASE("get_codes") {
-            std::unique_ptr<TreeNode> empty_root = HuffTree::build_tree(empty_vocabulary);
-            std::unique_ptr<TreeNode> normal_root = HuffTree::build_tree(normal_vocabulary);
-            std::unique_ptr<TreeNode> big_root = HuffTree::build_tree(big_vocabulary);
             HuffTree empty_tree(empty_vocabulary);
-            empty_tree._root = std::move(empty_root);
+            empty_tree._nodes = HuffTree::build_tree(empty_vocabulary);
             HuffTree normal_tree(empty_vocabulary);
-            normal_tree._root = std::move(normal_root);
+            normal_tree._nodes = HuffTree::build_tree(normal_vocabulary);
             HuffTree big_tree(empty_vocabulary);
-            big_tree._root = std::move(big_root);
+            big_tree._nodes = HuffTree::build_tree(big_vocabulary);
 
             CHECK_NOTHROW(empty_tree.get_codes());
             CHECK_EQ(get_number_of_codes(empty_tree), 0);
@@ -222,10 +337,35 @@ class huffman_algo::HuffmanArchiver::HuffTree::TestHuffTree {
             CHECK_EQ(tree.get_code_by_char('c').size(), 0);
         }
 
+        SUBCASE("get_code_table") {
+            HuffTree empty_tree(empty_vocabulary);
+            HuffTree normal_tree(normal_vocabulary);
+            HuffTree big_tree(big_vocabulary);
+
+            CHECK_EQ(reinterpret_cast<std::uintptr_t>(normal_tree.get_code_table().data()) % 64, 0);
+            for (auto &code: empty_tree.get_code_table()) {
+                CHECK_EQ(code.length, 0);
+            }
+            CHECK_EQ(normal_tree.get_code_table()['c'].length, 1);
+            CHECK_EQ(normal_tree.get_code_table()['c'].bits, 0b1);
+            CHECK_EQ(normal_tree.get_code_table()['d'].length, 0);
+            for (HuffTree *cur_tree: {&normal_tree, &big_tree}) {
+                for (std::size_t i = 0; i <= UCHAR_MAX; ++i) {
+                    const std::vector<bool> &code = cur_tree->get_code_by_char(i);
+                    uint64_t bits = 0;
+                    for (std::size_t j = 0; j < code.size(); ++j) {
+                        bits |= uint64_t(code[j]) << j;
+                    }
+                    CHECK_EQ(cur_tree->get_code_table()[i].length, code.size());
+                    CHECK_EQ(cur_tree->get_code_table()[i].bits, bits);
+                }
+            }
+        }
+
         SUBCASE("try_extract_code") {
             HuffTree empty_tree(empty_vocabulary);
-            REQUIRE_EQ(empty_tree._cur_node, nullptr);
-            std::array<uint32_t, UCHAR_MAX + 1> one_letter_vocabulary{};
+            REQUIRE(empty_tree._nodes.empty());
+            std::array<uint64_t, UCHAR_MAX + 1> one_letter_vocabulary{};
             one_letter_vocabulary['a'] = 100;
             HuffTree one_letter_tree(one_letter_vocabulary);
             HuffTree normal_tree(normal_vocabulary);
@@ -247,6 +387,135 @@ class huffman_algo::HuffmanArchiver::HuffTree::TestHuffTree {
             CHECK_EQ(big_buffer.size(), 63);
             CHECK_EQ(chr, 'c');
         }
+
+        SUBCASE("build_multi_decode_table") {
+            std::array<uint64_t, UCHAR_MAX + 1> one_letter_vocabulary{};
+            one_letter_vocabulary['a'] = 100;
+            HuffTree empty_tree(empty_vocabulary);
+            HuffTree one_letter_tree(one_letter_vocabulary);
+            HuffTree normal_tree(normal_vocabulary);
+            std::array<uint64_t, UCHAR_MAX + 1> skewed_vocabulary{};
+            uint32_t prev = 1, cur = 1;
+            for (std::size_t i = 0; i < 16; ++i) {
+                skewed_vocabulary[i] = cur;
+                cur += prev;
+                prev = cur - prev;
+            }
+            HuffTree skewed_tree(skewed_vocabulary);
+            std::size_t table_size = std::size_t(1) << MULTI_DECODE_TABLE_BITS;
+
+            normal_tree.build_multi_decode_table();
+            CHECK(normal_tree.get_multi_decode_table().empty());
+            REQUIRE(empty_tree.build_decode_table());
+            empty_tree.build_multi_decode_table();
+            CHECK(empty_tree.get_multi_decode_table().empty());
+            REQUIRE(one_letter_tree.build_decode_table());
+            one_letter_tree.build_multi_decode_table();
+            for (auto &entry: one_letter_tree.get_multi_decode_table()) {
+                CHECK_EQ(entry.count, MAX_MULTI_SYMBOLS);
+                CHECK_EQ(entry.length, MAX_MULTI_SYMBOLS);
+                CHECK_EQ(entry.symbols[0], 'a');
+            }
+            REQUIRE(normal_tree.build_decode_table());
+            normal_tree.build_multi_decode_table();
+            const MultiDecodeEntry &entry = normal_tree.get_multi_decode_table()[0b10011];
+            CHECK_EQ(entry.count, 3);
+            CHECK_EQ(entry.length, 4);
+            CHECK_EQ(entry.symbols[0], 'c');
+            CHECK_EQ(entry.symbols[1], 'c');
+            CHECK_EQ(entry.symbols[2], normal_tree._decode_table[0b00].value);
+
+            REQUIRE(skewed_tree.build_decode_table());
+            skewed_tree.build_multi_decode_table();
+            const std::vector<DecodeEntry> &single = skewed_tree.get_decode_table();
+            const std::vector<MultiDecodeEntry> &multi = skewed_tree.get_multi_decode_table();
+            REQUIRE_EQ(multi.size(), table_size);
+            for (std::size_t i = 0; i < multi.size(); ++i) {
+                std::size_t length = 0;
+                for (std::size_t j = 0; j < multi[i].count; ++j) {
+                    const DecodeEntry &expected = single[(i >> length) & ((1 << DECODE_TABLE_BITS) - 1)];
+                    CHECK_EQ(multi[i].symbols[j], expected.value);
+                    length += expected.length;
+                }
+                CHECK_EQ(multi[i].length, length);
+                CHECK(length <= MULTI_DECODE_TABLE_BITS);
+            }
+            CHECK(skewed_tree.build_decode_table());
+            CHECK(skewed_tree.get_multi_decode_table().empty());
+
+            std::array<uint64_t, UCHAR_MAX + 1> uniform_vocabulary{};
+            uniform_vocabulary.fill(1);
+            HuffTree uniform_tree(uniform_vocabulary);
+            REQUIRE(uniform_tree.build_decode_table());
+            uniform_tree.build_multi_decode_table();
+            CHECK(uniform_tree.get_multi_decode_table().empty());
+        }
+
+        SUBCASE("build_decode_table") {
+            std::array<uint64_t, UCHAR_MAX + 1> one_letter_vocabulary{};
+            one_letter_vocabulary['a'] = 100;
+            std::array<uint64_t, UCHAR_MAX + 1> long_vocabulary{};
+            std::array<uint64_t, UCHAR_MAX + 1> too_long_vocabulary{};
+            uint32_t prev = 1, cur = 1;
+            for (std::size_t i = 0; i < 32; ++i) {
+                if (i < 16) {
+                    long_vocabulary[i] = cur;
+                }
+                too_long_vocabulary[i] = cur;
+                cur += prev;
+                prev = cur - prev;
+            }
+            HuffTree empty_tree(empty_vocabulary);
+            HuffTree one_letter_tree(one_letter_vocabulary);
+            HuffTree normal_tree(normal_vocabulary);
+            HuffTree big_tree(big_vocabulary);
+            HuffTree long_tree(long_vocabulary);
+            HuffTree too_long_tree(too_long_vocabulary);
+            std::size_t table_size = std::size_t(1) << DECODE_TABLE_BITS;
+
+            CHECK(empty_tree.build_decode_table());
+            CHECK_EQ(empty_tree._decode_table.size(), table_size);
+            CHECK_EQ(empty_tree._decode_table[0].length, 0);
+            CHECK_EQ(empty_tree._decode_table[0].sub_bits, 0);
+            CHECK(one_letter_tree.build_decode_table());
+            for (auto &entry: one_letter_tree.get_decode_table()) {
+                CHECK_EQ(entry.value, 'a');
+                CHECK_EQ(entry.length, 1);
+            }
+            CHECK(normal_tree.build_decode_table());
+            CHECK_EQ(normal_tree._decode_table.size(), table_size);
+            CHECK_EQ(normal_tree._decode_table[0b1].value, 'c');
+            CHECK_EQ(normal_tree._decode_table[0b1].length, 1);
+            CHECK_EQ(normal_tree._decode_table[0b00].length, 2);
+            CHECK_EQ(normal_tree._decode_table[0b10].length, 2);
+            CHECK_NE(normal_tree._decode_table[0b00].value, normal_tree._decode_table[0b10].value);
+            CHECK(big_tree.build_decode_table());
+            CHECK(big_tree._decode_table.size() >= table_size);
+            CHECK(long_tree.build_decode_table());
+            CHECK(long_tree._decode_table.size() > table_size);
+            CHECK_FALSE(too_long_tree.build_decode_table());
+            CHECK(too_long_tree._decode_table.empty());
+
+            for (HuffTree *tree: {&normal_tree, &big_tree, &long_tree}) {
+                const std::vector<DecodeEntry> &table = tree->get_decode_table();
+                for (std::size_t i = 0; i <= UCHAR_MAX; ++i) {
+                    const std::vector<bool> &code = tree->_chars_to_codes[i];
+                    if (code.empty()) {
+                        continue;
+                    }
+                    uint64_t bits = 0;
+                    for (std::size_t j = 0; j < code.size(); ++j) {
+                        bits |= uint64_t(code[j]) << j;
+                    }
+                    DecodeEntry entry = table[bits & (table_size - 1)];
+                    if (!entry.length) {
+                        entry = table[entry.value + ((bits >> DECODE_TABLE_BITS) & ((1 << entry.sub_bits) - 1))];
+                    }
+                    CHECK_EQ(entry.value, i);
+                    CHECK_EQ(entry.length, code.size());
+                }
+            }
+        }
     }
 
     static std::size_t get_number_of_codes(const HuffTree &tree) {
@@ -261,6 +530,241 @@ class huffman_algo::HuffmanArchiver::HuffTree::TestHuffTree {
 };
 
 
+class huffman_algo::HuffmanArchiver::BitReader::TestBitReader {
+    TEST_CASE_CLASS("testing BitReader") {
+        const unsigned char data[] = {0x01, 0xff, 'a', 0x80, 0x00, 0x12, 0x34, 0x56, 0x78, 0x9a};
+
+        SUBCASE("constructor") {
+            BitReader reader(data, sizeof(data));
+            std::ifstream in(path("normal.txt"), std::ios_base::binary);
+            BitReader stream_reader(in);
+
+            CHECK_EQ(reader._in, nullptr);
+            CHECK_EQ(reader._pos, data);
+            CHECK_EQ(reader._end, data + sizeof(data));
+            CHECK_EQ(reader._bit_count, 0);
+            CHECK_EQ(reader._consumed_bits, 0);
+            CHECK_EQ(stream_reader._in, &in);
+            CHECK_EQ(stream_reader._chunk.size(), CHUNK_SIZE);
+            CHECK_EQ(stream_reader._pos, stream_reader._end);
+        }
+
+        SUBCASE("refill and peek") {
+            BitReader reader(data, sizeof(data));
+            BitReader short_reader(data, 2);
+
+            CHECK_NOTHROW(reader.refill());
+            CHECK(reader._bit_count > 56);
+            CHECK_EQ(reader.peek() & 0xffffffff, 0x8061ff01);
+            CHECK_NOTHROW(short_reader.refill());
+            CHECK_EQ(short_reader._bit_count, 64);
+            CHECK_EQ(short_reader.peek(), 0xff01);
+        }
+
+        SUBCASE("consume") {
+            BitReader reader(data, sizeof(data));
+            reader.refill();
+            reader.consume(1);
+
+            CHECK_EQ(reader.peek() & 1, 0);
+            CHECK_EQ(reader.get_consumed_bits(), 1);
+            CHECK_EQ(reader.get_consumed_bytes(), 1);
+            reader.consume(15);
+            CHECK_EQ(reader.peek() & 0xff, 'a');
+            CHECK_EQ(reader.get_consumed_bits(), 16);
+            CHECK_EQ(reader.get_consumed_bytes(), 2);
+            for (std::size_t i = 0; i < 7; ++i) {
+                reader.refill();
+                reader.consume(8);
+            }
+            reader.refill();
+            CHECK_EQ(reader.peek() & 0xff, 0x9a);
+        }
+
+        SUBCASE("is_overrun") {
+            BitReader reader(data, 2);
+            reader.refill();
+
+            reader.consume(16);
+            CHECK_FALSE(reader.is_overrun());
+            reader.consume(1);
+            CHECK(reader.is_overrun());
+        }
+
+        SUBCASE("stream") {
+            std::ifstream in(path("normal.txt"), std::ios_base::binary);
+            in.exceptions(std::ios_base::badbit | std::ios_base::failbit);
+            BitReader reader(in);
+
+            CHECK_NOTHROW(reader.refill());
+            for (char chr = 'a'; chr <= 'f'; ++chr) {
+                CHECK_EQ(reader.peek() & 0xff, chr);
+                reader.consume(8);
+            }
+            CHECK_EQ(reader.peek(), 0);
+            CHECK_FALSE(reader.is_overrun());
+            CHECK_EQ(reader._in, nullptr);
+            CHECK(in.good());
+        }
+    }
+};
+
+
+class huffman_algo::HuffmanArchiver::BitWriter::TestBitWriter {
+    TEST_CASE_CLASS("testing BitWriter") {
+        std::ostringstream out;
+
+        SUBCASE("constructor") {
+            BitWriter writer(out);
+
+            CHECK_EQ(writer._out, &out);
+            CHECK_EQ(writer._chunk.size(), CHUNK_SIZE);
+            CHECK_EQ(writer._chunk_size, 0);
+            CHECK_EQ(writer._bit_count, 0);
+            CHECK_EQ(writer._written_bits, 0);
+        }
+
+        SUBCASE("write") {
+            BitWriter writer(out);
+            writer.write(0b1, 1);
+            writer.write(0b0, 1);
+            writer.write(0b111111, 6);
+
+            CHECK_EQ(writer._bit_count, 8);
+            CHECK_EQ(writer._bits, 0xfd);
+            CHECK_EQ(writer.get_written_bits(), 8);
+            CHECK_EQ(writer.get_written_bytes(), 1);
+            writer.write(0xffffffffffff, 48);
+            writer.write(0x1234, 16);
+            CHECK_EQ(writer._bit_count, 8);
+            CHECK_EQ(writer._bits, 0x12);
+            CHECK_EQ(writer._chunk_size, 8);
+            CHECK(out.str().empty());
+            writer.write(0, 1);
+            CHECK_EQ(writer.get_written_bytes(), 10);
+        }
+
+        SUBCASE("flush") {
+            BitWriter writer(out);
+            writer.write('a', 8);
+            writer.write(0b1, 1);
+            writer.write(0b0, 2);
+            writer.flush();
+
+            CHECK_EQ(out.str(), std::string("a\x01"));
+            CHECK_EQ(writer._bit_count, 0);
+            CHECK_EQ(writer._chunk_size, 0);
+            writer.write('b', 8);
+            writer.flush();
+            CHECK_EQ(out.str(), std::string("a\x01" "b"));
+        }
+
+        SUBCASE("chunk boundaries") {
+            std::string expected;
+            for (std::size_t i = 0; i < 3 * CHUNK_SIZE; ++i) {
+                expected.push_back(char(i * 7 + (i >> 8)));
+            }
+            BitWriter writer(out);
+            for (std::size_t i = 0; i < expected.size(); i += 2) {
+                writer.write((unsigned char)expected[i] | ((unsigned char)expected[i + 1] << 8), 3);
+                writer.write(((unsigned char)expected[i] | ((unsigned char)expected[i + 1] << 8)) >> 3, 13);
+            }
+            writer.flush();
+
+            CHECK_EQ(out.str(), expected);
+        }
+
+        SUBCASE("vector output") {
+            std::vector<unsigned char> buffer = {'x'};
+            BitWriter writer(buffer);
+            CHECK_EQ(writer._out, nullptr);
+            CHECK_EQ(writer._buffer, &buffer);
+            for (std::size_t i = 0; i < 2 * CHUNK_SIZE; ++i) {
+                writer.write(i & 0xff, 8);
+            }
+            writer.write(0b101, 3);
+            writer.flush();
+
+            REQUIRE_EQ(buffer.size(), 2 * CHUNK_SIZE + 2);
+            CHECK_EQ(buffer[0], 'x');
+            CHECK_EQ(buffer[1], 0);
+            CHECK_EQ(buffer[256], 0xff);
+            CHECK_EQ(buffer.back(), 0b101);
+        }
+
+        SUBCASE("span output") {
+            std::array<unsigned char, 10> buffer{};
+            BitWriter writer(buffer.data(), buffer.size());
+            CHECK(writer._chunk.empty());
+            writer.write(0xffffffffffffffff, 64);
+            writer.write(0b11, 2);
+            writer.flush();
+
+            CHECK_EQ(writer.get_written_bytes(), 9);
+            CHECK_EQ(buffer[7], 0xff);
+            CHECK_EQ(buffer[8], 0b11);
+            CHECK_EQ(buffer[9], 0);
+
+            BitWriter small_writer(buffer.data(), 9);
+            small_writer.write(0, 64);
+            CHECK_THROWS_AS(small_writer.write(0, 64), std::length_error);
+            BitWriter tail_writer(buffer.data(), 9);
+            tail_writer.write(0, 64);
+            tail_writer.write(0, 9);
+            CHECK_THROWS_AS(tail_writer.flush(), std::length_error);
+        }
+    }
+};
+
+
+class huffman_algo::HuffmanArchiver::MappedFile::TestMappedFile {
+    TEST_CASE_CLASS("testing MappedFile") {
+        SUBCASE("constructor") {
+            MappedFile normal_map(path("normal.txt"));
+            MappedFile empty_map(path("empty.txt"));
+            MappedFile no_file_map(path("no-file.txt"));
+            MappedFile directory_map(path(""));
+
+            CHECK(normal_map.is_mapped());
+            CHECK_EQ(normal_map.size(), 6);
+            CHECK_EQ(std::string((const char *)normal_map.data(), normal_map.size()), "abcdef");
+            CHECK_FALSE(empty_map.is_mapped());
+            CHECK_EQ(empty_map.data(), nullptr);
+            CHECK_EQ(empty_map.size(), 0);
+            CHECK_FALSE(no_file_map.is_mapped());
+            CHECK_FALSE(directory_map.is_mapped());
+        }
+
+        SUBCASE("big file") {
+            MappedFile big_map(path("War and Peace.txt"));
+            std::ifstream in(path("War and Peace.txt"), std::ios_base::binary);
+            std::string expected((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+
+            REQUIRE(big_map.is_mapped());
+            CHECK_EQ(big_map.size(), expected.size());
+            CHECK_EQ(std::string((const char *)big_map.data(), big_map.size()), expected);
+        }
+
+        SUBCASE("stream") {
+            std::istringstream in("abcdef");
+            MappedFile normal_map(in, 6);
+            std::istringstream short_in("abc");
+            MappedFile short_map(short_in, 6);
+            std::istringstream empty_in;
+            MappedFile empty_map(empty_in, 0);
+
+            CHECK(normal_map.is_mapped());
+            CHECK_EQ(normal_map.data(), normal_map._buffer.data());
+            CHECK_EQ(std::string((const char *)normal_map.data(), normal_map.size()), "abcdef");
+            CHECK(short_map.is_mapped());
+            CHECK_EQ(std::string((const char *)short_map.data(), short_map.size()), "abc");
+            CHECK_FALSE(empty_map.is_mapped());
+            CHECK_EQ(empty_map.size(), 0);
+        }
+    }
+};
+
+
 class huffman_algo::HuffmanArchiver::TestHuffmanArchiver {
     TEST_CASE_CLASS("testing HuffmanArchiver") {
         std::string default_file;
@@ -271,19 +775,19 @@ class huffman_algo::HuffmanArchiver::TestHuffmanArchiver {
         std::string spaces_file = path("spaces.txt");
         std::string big_file = path("War and Peace.txt");
         std::string worst_file = path("worst.txt");
-        std::string out_no_file = path("out no-file.txt");
-        std::string zip_empty_file = path("zip empty.txt");
-        std::string zip_normal_file = path("zip normal.txt");
-        std::string zip_one_letter_file = path("zip one letter.txt");
-        std::string zip_spaces_file = path("zip spaces.txt");
-        std::string zip_big_file = path("zip War and Peace.txt");
-        std::string zip_worst_file = path("zip worst.txt");
-        std::string unzip_empty_file = path("unzip empty.txt");
-        std::string unzip_normal_file = path("unzip normal.txt");
-        std::string unzip_one_letter_file = path("unzip one letter.txt");
-        std::string unzip_spaces_file = path("unzip spaces.txt");
-        std::string unzip_big_file = path("unzip War and Peace.txt");
-        std::string unzip_worst_file = path("unzip worst.txt");
+        std::string out_no_file = output_path("out no-file.txt");
+        std::string zip_empty_file = output_path("zip empty.txt");
+        std::string zip_normal_file = output_path("zip normal.txt");
+        std::string zip_one_letter_file = output_path("zip one letter.txt");
+        std::string zip_spaces_file = output_path("zip spaces.txt");
+        std::string zip_big_file = output_path("zip War and Peace.txt");
+        std::string zip_worst_file = output_path("zip worst.txt");
+        std::string unzip_empty_file = output_path("unzip empty.txt");
+        std::string unzip_normal_file = output_path("unzip normal.txt");
+        std::string unzip_one_letter_file = output_path("unzip one letter.txt");
+        std::string unzip_spaces_file = output_path("unzip spaces.txt");
+        std::string unzip_big_file = output_path("unzip War and Peace.txt");
+        std::string unzip_worst_file = output_path("unzip worst.txt");
 
         SUBCASE("constructor") {
             CHECK_THROWS_AS(HuffmanArchiver archiver(default_file, default_file), std::invalid_argument);
@@ -295,6 +799,503 @@ class huffman_algo::HuffmanArchiver::TestHuffmanArchiver {
             HuffmanArchiver archiver(normal_file, zip_normal_file);
 
             CHECK_EQ(archiver._out.exceptions(), std::ios_base::badbit | std::ios_base::failbit);
+            CHECK_EQ(archiver._max_code_length, HuffTree::MAX_CANONICAL_CODE_LENGTH);
+            CHECK_EQ(archiver._memory_limit, DEFAULT_MEMORY_LIMIT);
+            CHECK_FALSE(archiver.is_streaming());
+
+            HuffmanArchiver stream_archiver(STANDARD_STREAM, STANDARD_STREAM);
+            CHECK_EQ(stream_archiver._in.rdbuf(), std::cin.rdbuf());
+            CHECK_EQ(stream_archiver._out.rdbuf(), std::cout.rdbuf());
+            CHECK_FALSE(stream_archiver._in_map->is_mapped());
+            CHECK(stream_archiver.is_streaming());
+        }
+
+        SUBCASE("set_max_code_length") {
+            HuffmanArchiver archiver(normal_file, zip_normal_file);
+
+            CHECK_THROWS_AS(archiver.set_max_code_length(HuffTree::MIN_CODE_LENGTH_LIMIT - 1), std::invalid_argument);
+            CHECK_THROWS_AS(archiver.set_max_code_length(HuffTree::MAX_CODE_LENGTH_LIMIT + 1), std::invalid_argument);
+            CHECK_NOTHROW(archiver.set_max_code_length(11));
+            CHECK_EQ(archiver._max_code_length, 11);
+        }
+
+        SUBCASE("set_thread_count") {
+            HuffmanArchiver archiver(normal_file, zip_normal_file);
+
+            CHECK_GE(archiver._thread_count, 1);
+            CHECK_THROWS_AS(archiver.set_thread_count(0), std::invalid_argument);
+            CHECK_NOTHROW(archiver.set_thread_count(3));
+            CHECK_EQ(archiver._thread_count, 3);
+        }
+
+        SUBCASE("set_block_size") {
+            HuffmanArchiver archiver(normal_file, zip_normal_file);
+
+            CHECK_EQ(archiver._block_size, 0);
+            CHECK_THROWS_AS(archiver.set_block_size(MIN_BLOCK_SIZE - 1), std::invalid_argument);
+            CHECK_THROWS_AS(archiver.set_block_size(MAX_BLOCK_SIZE + 1), std::invalid_argument);
+            CHECK_NOTHROW(archiver.set_block_size(DEFAULT_BLOCK_SIZE));
+            CHECK_EQ(archiver._block_size, DEFAULT_BLOCK_SIZE);
+            CHECK_NOTHROW(archiver.set_block_size(0));
+            CHECK_EQ(archiver._block_size, 0);
+        }
+
+        SUBCASE("set_context_tables") {
+            HuffmanArchiver archiver(normal_file, zip_normal_file);
+
+            CHECK_EQ(archiver._context_tables, 0);
+            CHECK_THROWS_AS(archiver.set_context_tables(MIN_CONTEXT_TABLES - 1), std::invalid_argument);
+            CHECK_THROWS_AS(archiver.set_context_tables(MAX_CONTEXT_TABLES + 1), std::invalid_argument);
+            CHECK_NOTHROW(archiver.set_context_tables(MAX_CONTEXT_TABLES));
+            CHECK_EQ(archiver._context_tables, MAX_CONTEXT_TABLES);
+            CHECK_NOTHROW(archiver.set_context_tables(0));
+            CHECK_EQ(archiver._context_tables, 0);
+        }
+
+        SUBCASE("set_token_model") {
+            HuffmanArchiver archiver(normal_file, zip_normal_file);
+
+            CHECK_FALSE(archiver._token_model);
+            archiver.set_token_model(true);
+            CHECK(archiver._token_model);
+            CHECK_THROWS_AS(archiver.set_block_size(DEFAULT_BLOCK_SIZE), std::invalid_argument);
+            CHECK_THROWS_AS(archiver.set_interleaved(true), std::invalid_argument);
+            CHECK_THROWS_AS(archiver.set_context_model(true), std::invalid_argument);
+            CHECK_THROWS_AS(archiver.set_context_tables(MIN_CONTEXT_TABLES), std::invalid_argument);
+            CHECK_NOTHROW(archiver.set_block_size(0));
+            CHECK_NOTHROW(archiver.set_context_model(false));
+            CHECK_EQ(archiver._block_size, 0);
+            CHECK_FALSE(archiver._context_model);
+
+            HuffmanArchiver blocks_archiver(normal_file, zip_normal_file);
+            blocks_archiver.set_block_size(DEFAULT_BLOCK_SIZE);
+            CHECK_THROWS_AS(blocks_archiver.set_token_model(true), std::invalid_argument);
+            HuffmanArchiver context_archiver(normal_file, zip_normal_file);
+            context_archiver.set_context_model(true);
+            CHECK_THROWS_AS(context_archiver.set_token_model(true), std::invalid_argument);
+            CHECK_FALSE(context_archiver._token_model);
+        }
+
+        SUBCASE("run_parallel") {
+            for (unsigned thread_count: {1, 2, 5}) {
+                std::vector<int> results(100);
+                run_parallel(results.size(), thread_count, [&](std::size_t i) {
+                    results[i] += int(i * i);
+                });
+                for (std::size_t i = 0; i < results.size(); ++i) {
+                    CHECK_EQ(results[i], i * i);
+                }
+
+                CHECK_NOTHROW(run_parallel(0, thread_count, [](std::size_t) {
+                    throw std::logic_error("Unexpected task.");
+                }));
+                CHECK_THROWS_AS(run_parallel(10, thread_count, [](std::size_t i) {
+                    if (i == 7) {
+                        throw std::logic_error("Failed task.");
+                    }
+                }), std::logic_error);
+            }
+        }
+
+        SUBCASE("compress_block") {
+            HuffmanArchiver archiver(normal_file, zip_normal_file);
+            std::string text = read_file(big_file).substr(0, DEFAULT_BLOCK_SIZE + 3);
+            const unsigned char *data = (const unsigned char *)text.data();
+            std::array<uint64_t, UCHAR_MAX + 1> vocabulary{};
+            count_bytes(data, text.size(), vocabulary);
+            uint64_t length_limit_overhead;
+            std::array<uint8_t, UCHAR_MAX + 1> code_lengths = choose_code_lengths(
+                    vocabulary, HuffTree::MAX_CANONICAL_CODE_LENGTH, length_limit_overhead);
+            std::vector<unsigned char> packed = pack_code_lengths(code_lengths);
+            HuffTree tree(code_lengths);
+            REQUIRE(tree.build_decode_table());
+
+            for (bool interleaved: {false, true}) {
+                archiver.set_interleaved(interleaved);
+                Block block = archiver.compress_block(data, text.size());
+                std::size_t stream_count = interleaved ? INTERLEAVED_STREAMS : 1;
+                std::array<uint32_t, INTERLEAVED_STREAMS> sizes{};
+                std::memcpy(sizes.data(), block.header.data() + 1 + packed.size(), stream_count * sizeof(uint32_t));
+
+                REQUIRE_EQ(block.header.size(), 1 + packed.size() + stream_count * sizeof(uint32_t));
+                CHECK_EQ(BlockType(block.header[0]), interleaved ? BlockType::interleaved : BlockType::huffman);
+                CHECK(std::equal(packed.begin(), packed.end(), block.header.begin() + 1));
+                CHECK_EQ(sizes[0] + sizes[1] + sizes[2] + sizes[3], block.payload.size());
+                CHECK_EQ(block.length_limit_overhead, length_limit_overhead);
+                std::string decoded(text.size(), '\0');
+                std::vector<unsigned char> record = block.header;
+                record.insert(record.end(), block.payload.begin(), block.payload.end());
+                Stats stats{};
+                CHECK_EQ(decode_block_record(record.data(), record.size(), (unsigned char *)decoded.data(),
+                                             decoded.size(), stats), block.payload.size());
+                CHECK(decoded == text);
+                CHECK_EQ(block.stats.block_count, 1);
+                CHECK_EQ(stats.block_count, 1);
+                CHECK_EQ(stats.max_code_length, block.stats.max_code_length);
+                CHECK_THROWS_AS(decode_block_record(record.data(), record.size() - 1, (unsigned char *)decoded.data(),
+                                                    decoded.size(), stats), std::logic_error);
+                record[0] = 7;
+                CHECK_THROWS_AS(decode_block_record(record.data(), record.size(), (unsigned char *)decoded.data(),
+                                                    decoded.size(), stats), std::logic_error);
+                if (!interleaved) {
+                    CHECK_NOTHROW(decode_block(tree, block.payload.data(), block.payload.size(),
+                                               (unsigned char *)decoded.data(), decoded.size()));
+                    CHECK(decoded == text);
+                    CHECK_THROWS_AS(decode_block(tree, block.payload.data(), block.payload.size() / 2,
+                                                 (unsigned char *)decoded.data(), decoded.size()), std::logic_error);
+                } else {
+                    CHECK_NOTHROW(decode_interleaved(tree, block.payload.data(), sizes,
+                                                     (unsigned char *)decoded.data(), decoded.size()));
+                    CHECK(decoded == text);
+                    sizes[3] -= 1;
+                    CHECK_THROWS_AS(decode_interleaved(tree, block.payload.data(), sizes,
+                                                       (unsigned char *)decoded.data(), decoded.size()),
+                                    std::logic_error);
+                }
+            }
+
+            std::string random = read_file(worst_file).substr(0, MIN_BLOCK_SIZE);
+            for (bool interleaved: {false, true}) {
+                archiver.set_interleaved(interleaved);
+                Block block = archiver.compress_block((const unsigned char *)random.data(), random.size());
+                std::vector<unsigned char> record = block.header;
+                record.insert(record.end(), block.payload.begin(), block.payload.end());
+                std::string decoded(random.size(), '\0');
+                Stats stats{};
+
+                REQUIRE_EQ(block.header.size(), 1);
+                CHECK_EQ(BlockType(block.header[0]), BlockType::stored);
+                CHECK_EQ(block.length_limit_overhead, 0);
+                CHECK_EQ(decode_block_record(record.data(), record.size(), (unsigned char *)decoded.data(),
+                                             decoded.size(), stats), random.size());
+                CHECK(decoded == random);
+                CHECK_THROWS_AS(decode_block_record(record.data(), record.size() - 1, (unsigned char *)decoded.data(),
+                                                    decoded.size(), stats), std::logic_error);
+            }
+
+            std::string run(MIN_BLOCK_SIZE, 'z');
+            for (bool interleaved: {false, true}) {
+                archiver.set_interleaved(interleaved);
+                Block block = archiver.compress_block((const unsigned char *)run.data(), run.size());
+                std::string decoded(run.size(), '\0');
+                Stats stats{};
+
+                CHECK_EQ(block.header, std::vector<unsigned char>{uint8_t(BlockType::run), 'z'});
+                CHECK(block.payload.empty());
+                CHECK_EQ(decode_block_record(block.header.data(), block.header.size(), (unsigned char *)decoded.data(),
+                                             decoded.size(), stats), 0);
+                CHECK(decoded == run);
+                CHECK_THROWS_AS(decode_block_record(block.header.data(), 1, (unsigned char *)decoded.data(),
+                                                    decoded.size(), stats), std::logic_error);
+            }
+
+            archiver.set_interleaved(false);
+            archiver.set_context_model(true);
+            for (std::size_t size: {text.size(), MIN_BLOCK_SIZE + 1}) {
+                Block block = archiver.compress_block(data, size);
+                std::vector<unsigned char> record = block.header;
+                record.insert(record.end(), block.payload.begin(), block.payload.end());
+                std::string decoded(size, '\0');
+                Stats stats{};
+
+                REQUIRE_EQ(BlockType(block.header[0]), BlockType::context);
+                std::array<uint32_t, INTERLEAVED_STREAMS> sizes{};
+                std::memcpy(sizes.data(), block.header.data() + block.header.size() - sizeof(sizes), sizeof(sizes));
+                CHECK_EQ(uint64_t(sizes[0]) + sizes[1] + sizes[2] + sizes[3], block.payload.size());
+                Stats plan_stats{};
+                BlockLayout layout = archiver.plan_block(data, size, plan_stats);
+                CHECK_EQ(block.header.size(), layout.header_size);
+                CHECK_EQ(block.payload.size(), layout.payload_size);
+                CHECK_EQ(decode_block_record(record.data(), record.size(), (unsigned char *)decoded.data(),
+                                             decoded.size(), stats), block.payload.size());
+                CHECK(decoded == text.substr(0, size));
+                CHECK_EQ(stats.block_count, 1);
+                CHECK_EQ(stats.max_code_length, block.stats.max_code_length);
+                CHECK_THROWS_AS(decode_block_record(record.data(), record.size() - 1, (unsigned char *)decoded.data(),
+                                                    decoded.size(), stats), std::logic_error);
+                record[1] ^= 1;
+                CHECK_THROWS_AS(decode_block_record(record.data(), record.size(), (unsigned char *)decoded.data(),
+                                                    decoded.size(), stats), std::logic_error);
+            }
+
+            for (uint8_t length: {uint8_t(0), uint8_t(2)}) {
+                std::array<uint8_t, UCHAR_MAX + 1> code_lengths{};
+                code_lengths['a'] = length;
+                std::vector<unsigned char> record = {uint8_t(BlockType::context), 1};
+                record.resize(1 + CONTEXT_MASK_SIZE);
+                std::vector<unsigned char> packed = pack_code_lengths(code_lengths);
+                record.insert(record.end(), packed.begin(), packed.end());
+                std::array<uint32_t, INTERLEAVED_STREAMS> sizes = {1, 1, 1, 1};
+                record.insert(record.end(), (const unsigned char *)sizes.data(),
+                              (const unsigned char *)sizes.data() + sizeof(sizes));
+                record.insert(record.end(), INTERLEAVED_STREAMS, 0xff);
+                std::string decoded(INTERLEAVED_STREAMS, '\0');
+                Stats stats{};
+
+                CHECK_THROWS_AS(decode_block_record(record.data(), record.size(), (unsigned char *)decoded.data(),
+                                                    decoded.size(), stats), std::logic_error);
+            }
+
+            archiver.set_context_tables(MIN_CONTEXT_TABLES);
+            for (std::size_t size: {text.size(), MIN_BLOCK_SIZE + 1}) {
+                Block block = archiver.compress_block(data, size);
+                std::vector<unsigned char> record = block.header;
+                record.insert(record.end(), block.payload.begin(), block.payload.end());
+                std::string decoded(size, '\0');
+                Stats stats{};
+
+                REQUIRE_EQ(BlockType(block.header[0]), BlockType::clustered);
+                CHECK_GE(block.header[1], 1);
+                CHECK_LE(block.header[1], MIN_CONTEXT_TABLES);
+                CHECK(std::all_of(block.header.begin() + 2, block.header.begin() + 2 + CONTEXT_COUNT,
+                                  [&block](unsigned char table) { return table < block.header[1]; }));
+                Stats plan_stats{};
+                BlockLayout layout = archiver.plan_block(data, size, plan_stats);
+                CHECK_EQ(block.header.size(), layout.header_size);
+                CHECK_EQ(block.payload.size(), layout.payload_size);
+                CHECK_EQ(decode_block_record(record.data(), record.size(), (unsigned char *)decoded.data(),
+                                             decoded.size(), stats), block.payload.size());
+                CHECK(decoded == text.substr(0, size));
+                CHECK_THROWS_AS(decode_block_record(record.data(), record.size() - 1, (unsigned char *)decoded.data(),
+                                                    decoded.size(), stats), std::logic_error);
+                record[1] = MAX_CONTEXT_TABLES + 1;
+                CHECK_THROWS_AS(decode_block_record(record.data(), record.size(), (unsigned char *)decoded.data(),
+                                                    decoded.size(), stats), std::logic_error);
+            }
+
+            for (uint8_t length: {uint8_t(0), uint8_t(2)}) {
+                std::array<uint8_t, UCHAR_MAX + 1> code_lengths{};
+                code_lengths['a'] = length;
+                std::vector<unsigned char> record = {uint8_t(BlockType::clustered), 2};
+                record.resize(2 + CONTEXT_COUNT, 1);
+                record[2] = 0;
+                std::array<uint8_t, UCHAR_MAX + 1> valid_lengths{};
+                valid_lengths['a'] = valid_lengths['b'] = 1;
+                for (const std::array<uint8_t, UCHAR_MAX + 1> &lengths: {valid_lengths, code_lengths}) {
+                    std::vector<unsigned char> packed = pack_code_lengths(lengths);
+                    record.insert(record.end(), packed.begin(), packed.end());
+                }
+                std::array<uint32_t, INTERLEAVED_STREAMS> sizes = {1, 1, 1, 1};
+                record.insert(record.end(), (const unsigned char *)sizes.data(),
+                              (const unsigned char *)sizes.data() + sizeof(sizes));
+                record.insert(record.end(), INTERLEAVED_STREAMS, 0xff);
+                std::string decoded(2 * INTERLEAVED_STREAMS, '\0');
+                Stats stats{};
+
+                CHECK_THROWS_AS(decode_block_record(record.data(), record.size(), (unsigned char *)decoded.data(),
+                                                    decoded.size(), stats), std::logic_error);
+            }
+
+            Block block = archiver.compress_block((const unsigned char *)random.data(), random.size());
+            CHECK_EQ(BlockType(block.header[0]), BlockType::stored);
+        }
+
+        SUBCASE("count_bytes") {
+            std::vector<unsigned char> data(1027);
+            for (std::size_t i = 0; i < data.size(); ++i) {
+                data[i] = (unsigned char)(i * i % 251);
+            }
+
+            for (std::size_t size: {0, 1, 3, 4, 5, 1027}) {
+                std::array<uint64_t, UCHAR_MAX + 1> vocabulary{};
+                std::array<uint64_t, UCHAR_MAX + 1> expected_vocabulary{};
+                for (std::size_t i = 0; i < size; ++i) {
+                    ++expected_vocabulary[data[i]];
+                }
+
+                count_bytes(data.data(), size, vocabulary);
+                CHECK_EQ(vocabulary, expected_vocabulary);
+            }
+
+            std::array<uint64_t, UCHAR_MAX + 1> vocabulary{};
+            vocabulary['a'] = 5;
+            count_bytes((const unsigned char *)"aab", 3, vocabulary);
+            CHECK_EQ(vocabulary['a'], 7);
+            CHECK_EQ(vocabulary['b'], 1);
+        }
+
+        SUBCASE("count_bytes_parallel") {
+            std::vector<unsigned char> data(3 * PARALLEL_HISTOGRAM_MIN_SIZE + 13);
+            for (std::size_t i = 0; i < data.size(); ++i) {
+                data[i] = (unsigned char)((i * 2654435761u) >> 13);
+            }
+            std::array<uint64_t, UCHAR_MAX + 1> expected_vocabulary{};
+            count_bytes(data.data(), data.size(), expected_vocabulary);
+
+            for (unsigned thread_count: {1, 2, 3, 4, 7}) {
+                std::array<uint64_t, UCHAR_MAX + 1> vocabulary{};
+                count_bytes_parallel(data.data(), data.size(), thread_count, vocabulary);
+                CHECK_EQ(vocabulary, expected_vocabulary);
+            }
+        }
+
+        SUBCASE("cluster_contexts") {
+            std::string text = "the quick brown fox jumps over the lazy dog, then the dog sleeps while the fox hides.";
+            for (int i = 0; i < 4; ++i) {
+                text += text;
+            }
+            std::vector<std::array<uint64_t, UCHAR_MAX + 1>> contexts;
+            count_contexts((const unsigned char *)text.data(), text.size(), contexts);
+
+            for (unsigned table_count: {MIN_CONTEXT_TABLES, 8u, MAX_CONTEXT_TABLES}) {
+                std::array<uint16_t, CONTEXT_COUNT> context_map{};
+                std::vector<std::array<uint64_t, UCHAR_MAX + 1>> tables =
+                        cluster_contexts(contexts, table_count, context_map);
+                REQUIRE_GE(tables.size(), 1);
+                CHECK_LE(tables.size(), table_count);
+                std::vector<std::array<uint64_t, UCHAR_MAX + 1>> expected_tables(tables.size());
+                for (std::size_t context = 0; context < CONTEXT_COUNT; ++context) {
+                    REQUIRE_LT(context_map[context], tables.size());
+                    for (std::size_t chr = 0; chr <= UCHAR_MAX; ++chr) {
+                        expected_tables[context_map[context]][chr] += contexts[context][chr];
+                    }
+                }
+                CHECK(tables == expected_tables);
+                CHECK(std::none_of(tables.begin(), tables.end(), [](const auto &table) {
+                    return std::all_of(table.begin(), table.end(), [](uint64_t frequency) { return frequency == 0; });
+                }));
+            }
+
+            std::vector<std::array<uint64_t, UCHAR_MAX + 1>> single(CONTEXT_COUNT);
+            single['a']['b'] = 3;
+            std::array<uint16_t, CONTEXT_COUNT> context_map{};
+            std::vector<std::array<uint64_t, UCHAR_MAX + 1>> tables = cluster_contexts(single, MIN_CONTEXT_TABLES,
+                                                                                      context_map);
+            REQUIRE_EQ(tables.size(), 1);
+            CHECK_EQ(tables[0]['b'], 3);
+            CHECK_EQ(context_map['a'], 0);
+        }
+
+        SUBCASE("count_contexts") {
+            std::vector<std::array<uint64_t, UCHAR_MAX + 1>> contexts;
+            count_contexts((const unsigned char *)"abcabcab", 8, contexts);
+            REQUIRE_EQ(contexts.size(), CONTEXT_COUNT);
+            CHECK_EQ(contexts[0]['a'], 2);
+            CHECK_EQ(contexts[0]['b'], 1);
+            CHECK_EQ(contexts[0]['c'], 1);
+            CHECK_EQ(contexts['a']['b'], 2);
+            CHECK_EQ(contexts['b']['c'], 1);
+            CHECK_EQ(contexts['c']['a'], 1);
+            uint64_t total = 0;
+            for (const auto &context: contexts) {
+                for (uint64_t frequency: context) {
+                    total += frequency;
+                }
+            }
+            CHECK_EQ(total, 8);
+
+            count_contexts(nullptr, 0, contexts);
+            REQUIRE_EQ(contexts.size(), CONTEXT_COUNT);
+            CHECK(std::all_of(contexts.begin(), contexts.end(), [](const auto &context) {
+                return std::all_of(context.begin(), context.end(), [](uint64_t frequency) { return frequency == 0; });
+            }));
+        }
+
+        SUBCASE("next_token") {
+            auto token = [](const std::string &text) {
+                return next_token((const unsigned char *)text.data(), text.size());
+            };
+            CHECK_EQ(token("Hello, world"), 5);
+            CHECK_EQ(token(", world"), 2);
+            CHECK_EQ(token("x"), 1);
+            CHECK_EQ(token("abc123def!"), 9);
+            CHECK_EQ(token("\r\n\r\nNext"), 4);
+            CHECK_EQ(token("\xd0\x9c\xd0\xb8\xd1\x80 "), 6);
+            CHECK_EQ(token(std::string(MAX_TOKEN_LENGTH + 10, 'a')), MAX_TOKEN_LENGTH);
+            CHECK_EQ(token("ab"), 2);
+            CHECK_EQ(next_token((const unsigned char *)"abc", 2), 2);
+        }
+
+        SUBCASE("tokenize") {
+            std::string text = "the cat and the dog, and the end, the end";
+            std::vector<std::string_view> dictionary;
+            std::vector<uint32_t> symbols = tokenize((const unsigned char *)text.data(), text.size(), dictionary);
+
+            CHECK(dictionary == std::vector<std::string_view>{", ", "and", "end", "the"});
+            std::string restored;
+            for (uint32_t symbol: symbols) {
+                if (symbol <= UCHAR_MAX) {
+                    restored += char(symbol);
+                } else {
+                    REQUIRE_LT(symbol - (UCHAR_MAX + 1), dictionary.size());
+                    restored += dictionary[symbol - (UCHAR_MAX + 1)];
+                }
+            }
+            CHECK(restored == text);
+            CHECK_EQ(std::count(symbols.begin(), symbols.end(), UCHAR_MAX + 1 + 3), 4);
+            CHECK_EQ(std::count(symbols.begin(), symbols.end(), uint32_t('c')), 1);
+
+            CHECK(tokenize(nullptr, 0, dictionary).empty());
+            CHECK(dictionary.empty());
+        }
+
+        SUBCASE("pack_tokens and unpack_tokens") {
+            std::vector<std::string_view> dictionary = {"and", "andante", "the", "then", "there"};
+            std::vector<uint8_t> code_lengths(UCHAR_MAX + 1 + dictionary.size(), 0);
+            code_lengths[' '] = 2;
+            code_lengths['x'] = 3;
+            for (std::size_t i = 0; i < dictionary.size(); ++i) {
+                code_lengths[UCHAR_MAX + 1 + i] = i < 3 ? 2 : 4;
+            }
+            code_lengths['x'] = 0;
+            code_lengths[UCHAR_MAX + 1 + 2] = 3;
+            std::vector<unsigned char> packed = pack_tokens(dictionary, code_lengths);
+            std::vector<unsigned char> tokens;
+            std::vector<uint32_t> offsets;
+            std::vector<uint8_t> unpacked_lengths;
+
+            CHECK_EQ(unpack_tokens(packed.data(), packed.size(), tokens, offsets, unpacked_lengths), packed.size());
+            CHECK(std::string(tokens.begin(), tokens.end()) == "andandantethethenthere");
+            CHECK(offsets == std::vector<uint32_t>{0, 3, 10, 13, 17, 22});
+            CHECK(unpacked_lengths == code_lengths);
+            for (std::size_t size = 0; size < packed.size(); ++size) {
+                CHECK_THROWS_AS(unpack_tokens(packed.data(), size, tokens, offsets, unpacked_lengths),
+                                std::logic_error);
+            }
+            std::vector<unsigned char> invalid = packed;
+            invalid[0] = 0xff;
+            invalid[1] = 0xff;
+            invalid[2] = 0xff;
+            CHECK_THROWS_AS(unpack_tokens(invalid.data(), invalid.size(), tokens, offsets, unpacked_lengths),
+                            std::logic_error);
+
+            packed = pack_tokens({}, std::vector<uint8_t>(UCHAR_MAX + 1, CHAR_BIT));
+            CHECK_EQ(unpack_tokens(packed.data(), packed.size(), tokens, offsets, unpacked_lengths), packed.size());
+            CHECK(tokens.empty());
+            CHECK(offsets == std::vector<uint32_t>{0});
+            CHECK(unpacked_lengths == std::vector<uint8_t>(UCHAR_MAX + 1, CHAR_BIT));
+        }
+
+        SUBCASE("encode_tokens and decode_tokens") {
+            std::string text = read_file(big_file).substr(0, 100000);
+            std::vector<std::string_view> dictionary;
+            std::vector<uint32_t> symbols = tokenize((const unsigned char *)text.data(), text.size(), dictionary);
+            std::vector<uint64_t> frequencies(UCHAR_MAX + 1 + dictionary.size(), 0);
+            for (uint32_t symbol: symbols) {
+                ++frequencies[symbol];
+            }
+            std::vector<uint8_t> code_lengths = HuffTree::build_limited_code_lengths(frequencies,
+                                                                                     TOKEN_MAX_CODE_LENGTH);
+            REQUIRE_GT(*std::max_element(code_lengths.begin(), code_lengths.end()), TOKEN_TABLE_BITS);
+            std::vector<unsigned char> payload;
+            BitWriter writer(payload);
+            encode_tokens(symbols, code_lengths, writer);
+            writer.flush();
+            std::vector<unsigned char> packed = pack_tokens(dictionary, code_lengths);
+            std::vector<unsigned char> tokens;
+            std::vector<uint32_t> offsets;
+            std::vector<uint8_t> unpacked_lengths;
+            unpack_tokens(packed.data(), packed.size(), tokens, offsets, unpacked_lengths);
+            std::string decoded(text.size(), '\0');
+
+            CHECK_EQ(decode_tokens(tokens, offsets, unpacked_lengths, payload.data(), payload.size(),
+                                   (unsigned char *)decoded.data(), decoded.size()), payload.size());
+            CHECK(decoded == text);
+            CHECK_THROWS_AS(decode_tokens(tokens, offsets, unpacked_lengths, payload.data(), payload.size() / 2,
+                                          (unsigned char *)decoded.data(), decoded.size()), std::logic_error);
+            decoded.resize(text.size() + MAX_TOKEN_LENGTH);
+            CHECK_THROWS_AS(decode_tokens(tokens, offsets, unpacked_lengths, payload.data(), payload.size(),
+                                          (unsigned char *)decoded.data(), decoded.size()), std::logic_error);
         }
 
         SUBCASE("zip mode") {
@@ -306,23 +1307,23 @@ class huffman_algo::HuffmanArchiver::TestHuffmanArchiver {
             HuffmanArchiver worst_archiver(worst_file, zip_worst_file);
 
             SUBCASE("build_vocabulary") {
-                std::array<uint32_t, UCHAR_MAX + 1> empty_vocabulary{};
-                std::array<uint32_t, UCHAR_MAX + 1> normal_vocabulary{};
-                std::array<uint32_t, UCHAR_MAX + 1> one_letter_vocabulary{};
-                std::array<uint32_t, UCHAR_MAX + 1> spaces_vocabulary{};
-                std::array<uint32_t, UCHAR_MAX + 1> big_vocabulary{};
-                std::array<uint32_t, UCHAR_MAX + 1> worst_vocabulary{};
-                std::array<uint32_t, UCHAR_MAX + 1> expected_empty_vocabulary{};
-                std::array<uint32_t, UCHAR_MAX + 1> expected_normal_vocabulary{};
+                std::array<uint64_t, UCHAR_MAX + 1> empty_vocabulary{};
+                std::array<uint64_t, UCHAR_MAX + 1> normal_vocabulary{};
+                std::array<uint64_t, UCHAR_MAX + 1> one_letter_vocabulary{};
+                std::array<uint64_t, UCHAR_MAX + 1> spaces_vocabulary{};
+                std::array<uint64_t, UCHAR_MAX + 1> big_vocabulary{};
+                std::array<uint64_t, UCHAR_MAX + 1> worst_vocabulary{};
+                std::array<uint64_t, UCHAR_MAX + 1> expected_empty_vocabulary{};
+                std::array<uint64_t, UCHAR_MAX + 1> expected_normal_vocabulary{};
                 expected_normal_vocabulary['a'] = 1;
                 expected_normal_vocabulary['b'] = 1;
                 expected_normal_vocabulary['c'] = 1;
                 expected_normal_vocabulary['d'] = 1;
                 expected_normal_vocabulary['e'] = 1;
                 expected_normal_vocabulary['f'] = 1;
-                std::array<uint32_t, UCHAR_MAX + 1> expected_one_letter_vocabulary{};
+                std::array<uint64_t, UCHAR_MAX + 1> expected_one_letter_vocabulary{};
                 expected_one_letter_vocabulary['a'] = 100;
-                std::array<uint32_t, UCHAR_MAX + 1> expected_spaces_vocabulary{};
+                std::array<uint64_t, UCHAR_MAX + 1> expected_spaces_vocabulary{};
                 expected_spaces_vocabulary[' '] = 10;
                 expected_spaces_vocabulary['\n'] = 8;
                 expected_spaces_vocabulary['a'] = 7;
@@ -382,12 +1383,12 @@ class huffman_algo::HuffmanArchiver::TestHuffmanArchiver {
             }
 
             SUBCASE("encode") {
-                std::array<uint32_t, UCHAR_MAX + 1> empty_vocabulary = empty_archiver.build_vocabulary();
-                std::array<uint32_t, UCHAR_MAX + 1> normal_vocabulary = normal_archiver.build_vocabulary();
-                std::array<uint32_t, UCHAR_MAX + 1> one_letter_vocabulary = one_letter_archiver.build_vocabulary();
-                std::array<uint32_t, UCHAR_MAX + 1> spaces_vocabulary = spaces_archiver.build_vocabulary();
-                std::array<uint32_t, UCHAR_MAX + 1> big_vocabulary = big_archiver.build_vocabulary();
-                std::array<uint32_t, UCHAR_MAX + 1> worst_vocabulary = worst_archiver.build_vocabulary();
+                std::array<uint64_t, UCHAR_MAX + 1> empty_vocabulary = empty_archiver.build_vocabulary();
+                std::array<uint64_t, UCHAR_MAX + 1> normal_vocabulary = normal_archiver.build_vocabulary();
+                std::array<uint64_t, UCHAR_MAX + 1> one_letter_vocabulary = one_letter_archiver.build_vocabulary();
+                std::array<uint64_t, UCHAR_MAX + 1> spaces_vocabulary = spaces_archiver.build_vocabulary();
+                std::array<uint64_t, UCHAR_MAX + 1> big_vocabulary = big_archiver.build_vocabulary();
+                std::array<uint64_t, UCHAR_MAX + 1> worst_vocabulary = worst_archiver.build_vocabulary();
                 empty_archiver._in.clear();
                 empty_archiver._in.seekg(0);
                 normal_archiver._in.clear();
@@ -421,6 +1422,70 @@ class huffman_algo::HuffmanArchiver::TestHuffmanArchiver {
                 CHECK_EQ(worst_archiver._out.tellp(), 5000000);
             }
 
+            SUBCASE("zip without mapping") {
+                REQUIRE(big_archiver._in_map->is_mapped());
+                std::array<uint64_t, UCHAR_MAX + 1> mapped_vocabulary = big_archiver.build_vocabulary();
+                CHECK_NOTHROW(big_archiver.zip());
+                big_archiver._out_file.close();
+                std::string mapped_zip = read_file(zip_big_file);
+                HuffmanArchiver stream_archiver(big_file, zip_big_file);
+                stream_archiver._in_map = std::make_unique<MappedFile>(default_file);
+                stream_archiver.set_memory_limit(0);
+                REQUIRE_FALSE(stream_archiver._in_map->is_mapped());
+
+                CHECK_EQ(stream_archiver.build_vocabulary(), mapped_vocabulary);
+                stream_archiver._in.clear();
+                stream_archiver._in.seekg(0);
+                CHECK_NOTHROW(stream_archiver.zip());
+                stream_archiver._out_file.close();
+                CHECK_EQ(big_archiver._in_file_size, stream_archiver._in_file_size);
+                CHECK_EQ(big_archiver._out_file_size, stream_archiver._out_file_size);
+                CHECK_EQ(big_archiver._extra_data_size, stream_archiver._extra_data_size);
+                CHECK(read_file(zip_big_file) == mapped_zip);
+                CHECK_FALSE(stream_archiver._in_map->is_mapped());
+            }
+
+            SUBCASE("zip from memory") {
+                big_archiver.zip();
+                big_archiver._out_file.close();
+                std::string mapped_zip = read_file(zip_big_file);
+                for (uint64_t memory_limit: {uint64_t(file_size(big_file)), uint64_t(file_size(big_file) - 1)}) {
+                    HuffmanArchiver stream_archiver(big_file, zip_big_file);
+                    stream_archiver._in_map = std::make_unique<MappedFile>(default_file);
+                    stream_archiver.set_memory_limit(memory_limit);
+
+                    CHECK_NOTHROW(stream_archiver.zip());
+                    stream_archiver._out_file.close();
+                    CHECK_EQ(stream_archiver._in_map->is_mapped(), memory_limit == uint64_t(file_size(big_file)));
+                    CHECK_EQ(stream_archiver._in_map->size(),
+                             stream_archiver._in_map->is_mapped() ? file_size(big_file) : 0);
+                    CHECK_EQ(stream_archiver._in_file_size, big_archiver._in_file_size);
+                    CHECK(read_file(zip_big_file) == mapped_zip);
+                }
+
+                HuffmanArchiver empty_stream_archiver(empty_file, zip_empty_file);
+                empty_stream_archiver._in_map = std::make_unique<MappedFile>(default_file);
+                CHECK_NOTHROW(empty_stream_archiver.zip());
+                CHECK_FALSE(empty_stream_archiver._in_map->is_mapped());
+                CHECK_EQ(empty_stream_archiver._in_file_size, 0);
+            }
+
+            SUBCASE("zip with max code length") {
+                big_archiver.set_max_code_length(11);
+                normal_archiver.set_max_code_length(11);
+
+                CHECK_NOTHROW(big_archiver.zip());
+                CHECK_NOTHROW(normal_archiver.zip());
+                CHECK(big_archiver._length_limit_overhead > 0);
+                CHECK_EQ(normal_archiver._length_limit_overhead, 0);
+                CHECK_EQ(big_archiver.get_length_limit_overhead(), big_archiver._length_limit_overhead);
+                big_archiver._out_file.close();
+                HuffmanArchiver unzip_big_archiver(zip_big_file, unzip_big_file);
+                CHECK_NOTHROW(unzip_big_archiver.unzip());
+                unzip_big_archiver._out_file.close();
+                CHECK(compare_files(big_file, unzip_big_file));
+            }
+
             SUBCASE("zip") {
                 CHECK_NOTHROW(empty_archiver.zip());
                 CHECK_NOTHROW(normal_archiver.zip());
@@ -435,8 +1500,8 @@ class huffman_algo::HuffmanArchiver::TestHuffmanArchiver {
                 CHECK(big_archiver._in_file_size > 3000000);
                 CHECK_EQ(worst_archiver._in_file_size, 5000000);
                 CHECK_EQ(empty_archiver._out_file_size, 0);
-                CHECK_EQ(normal_archiver._out_file_size, 2);
-                CHECK_EQ(one_letter_archiver._out_file_size, 13);
+                CHECK_EQ(normal_archiver._out_file_size, 6);
+                CHECK_EQ(one_letter_archiver._out_file_size, 0);
                 CHECK_EQ(spaces_archiver._out_file_size, 5);
                 CHECK(big_archiver._out_file_size < 2000000);
                 CHECK_EQ(worst_archiver._out_file_size, 5000000);
@@ -452,6 +1517,11 @@ class huffman_algo::HuffmanArchiver::TestHuffmanArchiver {
                          int(big_archiver._out.tellp()) - big_archiver._out_file_size);
                 CHECK_EQ(worst_archiver._extra_data_size,
                          int(worst_archiver._out.tellp()) - worst_archiver._out_file_size);
+                CHECK_EQ(empty_archiver._extra_data_size, 4 + 8);
+                CHECK_EQ(normal_archiver._extra_data_size, 4 + 8);
+                CHECK_EQ(worst_archiver._extra_data_size, 4 + 8);
+                CHECK_EQ(one_letter_archiver._extra_data_size, 4 + 8 + 1);
+                CHECK(spaces_archiver._extra_data_size > 4 + 8);
             }
         }
 
@@ -476,56 +1546,162 @@ class huffman_algo::HuffmanArchiver::TestHuffmanArchiver {
             HuffmanArchiver worst_archiver(zip_worst_file, unzip_worst_file);
 
             SUBCASE("extract_vocabulary") {
-                std::array<uint32_t, UCHAR_MAX + 1> empty_vocabulary{};
-                std::array<uint32_t, UCHAR_MAX + 1> normal_vocabulary{};
-                std::array<uint32_t, UCHAR_MAX + 1> one_letter_vocabulary{};
-                std::array<uint32_t, UCHAR_MAX + 1> spaces_vocabulary{};
-                std::array<uint32_t, UCHAR_MAX + 1> big_vocabulary{};
-                std::array<uint32_t, UCHAR_MAX + 1> worst_vocabulary{};
-                std::array<uint32_t, UCHAR_MAX + 1> expected_empty_vocabulary{};
-                std::array<uint32_t, UCHAR_MAX + 1> expected_normal_vocabulary{};
+                std::array<uint64_t, UCHAR_MAX + 1> empty_vocabulary{};
+                std::array<uint64_t, UCHAR_MAX + 1> normal_vocabulary{};
+                std::array<uint64_t, UCHAR_MAX + 1> one_letter_vocabulary{};
+                std::array<uint64_t, UCHAR_MAX + 1> spaces_vocabulary{};
+                std::array<uint64_t, UCHAR_MAX + 1> expected_empty_vocabulary{};
+                std::array<uint64_t, UCHAR_MAX + 1> expected_normal_vocabulary{};
                 expected_normal_vocabulary['a'] = 1;
                 expected_normal_vocabulary['b'] = 1;
                 expected_normal_vocabulary['c'] = 1;
                 expected_normal_vocabulary['d'] = 1;
                 expected_normal_vocabulary['e'] = 1;
                 expected_normal_vocabulary['f'] = 1;
-                std::array<uint32_t, UCHAR_MAX + 1> expected_one_letter_vocabulary{};
+                std::array<uint64_t, UCHAR_MAX + 1> expected_one_letter_vocabulary{};
                 expected_one_letter_vocabulary['a'] = 100;
-                std::array<uint32_t, UCHAR_MAX + 1> expected_spaces_vocabulary{};
+                std::array<uint64_t, UCHAR_MAX + 1> expected_spaces_vocabulary{};
                 expected_spaces_vocabulary[' '] = 10;
                 expected_spaces_vocabulary['\n'] = 8;
                 expected_spaces_vocabulary['a'] = 7;
-                uint32_t tmp;
-                empty_archiver._in.read((char *)&tmp, sizeof(tmp));
-                normal_archiver._in.read((char *)&tmp, sizeof(tmp));
-                one_letter_archiver._in.read((char *)&tmp, sizeof(tmp));
-                spaces_archiver._in.read((char *)&tmp, sizeof(tmp));
-                big_archiver._in.read((char *)&tmp, sizeof(tmp));
-                worst_archiver._in.read((char *)&tmp, sizeof(tmp));
-                REQUIRE(empty_archiver._in);
-                REQUIRE(normal_archiver._in);
-                REQUIRE(one_letter_archiver._in);
-                REQUIRE(spaces_archiver._in);
-                REQUIRE(big_archiver._in);
-                REQUIRE(worst_archiver._in);
-
-                CHECK_NOTHROW(empty_vocabulary = empty_archiver.extract_vocabulary());
-                CHECK_NOTHROW(normal_vocabulary = normal_archiver.extract_vocabulary());
-                CHECK_NOTHROW(one_letter_vocabulary = one_letter_archiver.extract_vocabulary());
-                CHECK_NOTHROW(spaces_vocabulary = spaces_archiver.extract_vocabulary());
-                CHECK_NOTHROW(big_vocabulary = big_archiver.extract_vocabulary());
-                CHECK_NOTHROW(worst_vocabulary = worst_archiver.extract_vocabulary());
+                HuffmanArchiver legacy_empty_archiver(path("legacy empty.txt"), unzip_empty_file);
+                HuffmanArchiver legacy_normal_archiver(path("legacy normal.txt"), unzip_normal_file);
+                HuffmanArchiver legacy_one_letter_archiver(path("legacy one letter.txt"), unzip_one_letter_file);
+                HuffmanArchiver legacy_spaces_archiver(path("legacy spaces.txt"), unzip_spaces_file);
+                REQUIRE_EQ(legacy_empty_archiver.extract_header(), FormatVersion::legacy);
+                REQUIRE_EQ(legacy_normal_archiver.extract_header(), FormatVersion::legacy);
+                REQUIRE_EQ(legacy_one_letter_archiver.extract_header(), FormatVersion::legacy);
+                REQUIRE_EQ(legacy_spaces_archiver.extract_header(), FormatVersion::legacy);
+
+                CHECK_NOTHROW(empty_vocabulary = legacy_empty_archiver.extract_vocabulary());
+                CHECK_NOTHROW(normal_vocabulary = legacy_normal_archiver.extract_vocabulary());
+                CHECK_NOTHROW(one_letter_vocabulary = legacy_one_letter_archiver.extract_vocabulary());
+                CHECK_NOTHROW(spaces_vocabulary = legacy_spaces_archiver.extract_vocabulary());
                 CHECK_EQ(empty_vocabulary, expected_empty_vocabulary);
                 CHECK_EQ(normal_vocabulary, expected_normal_vocabulary);
                 CHECK_EQ(one_letter_vocabulary, expected_one_letter_vocabulary);
                 CHECK_EQ(spaces_vocabulary, expected_spaces_vocabulary);
             }
 
+            SUBCASE("extract_header") {
+                HuffmanArchiver legacy_normal_archiver(path("legacy normal.txt"), unzip_normal_file);
+                HuffmanArchiver canonical_normal_archiver(path("canonical normal.txt"), unzip_normal_file);
+
+                CHECK_EQ(canonical_normal_archiver.extract_header(), FormatVersion::canonical);
+                CHECK_EQ(canonical_normal_archiver._out_file_size, 6);
+                CHECK_EQ(canonical_normal_archiver._in.tellg(), 8);
+                CHECK_EQ(empty_archiver.extract_header(), FormatVersion::stored);
+                CHECK_EQ(normal_archiver.extract_header(), FormatVersion::stored);
+                CHECK_EQ(big_archiver.extract_header(), FormatVersion::canonical_64);
+                CHECK_EQ(worst_archiver.extract_header(), FormatVersion::stored);
+                CHECK_EQ(legacy_normal_archiver.extract_header(), FormatVersion::legacy);
+                CHECK_EQ(empty_archiver._out_file_size, 0);
+                CHECK_EQ(normal_archiver._out_file_size, 6);
+                CHECK_EQ(worst_archiver._out_file_size, 5000000);
+                CHECK_EQ(legacy_normal_archiver._out_file_size, 6);
+                CHECK_EQ(normal_archiver._in.tellg(), 12);
+                CHECK_EQ(legacy_normal_archiver._in.tellg(), 4);
+
+                std::string header_file = output_path("legacy header.txt");
+                for (uint8_t version = 0; version <= uint8_t(FormatVersion::tokens); ++version) {
+                    uint32_t size = 0x465548 | uint32_t(version) << 24;
+                    uint32_t vocabulary_size = 2;
+                    uint32_t frequency = size / 2;
+                    {
+                        std::ofstream out(header_file, std::ios_base::binary);
+                        out.write((char *)&size, sizeof(size));
+                        out.write((char *)&vocabulary_size, sizeof(vocabulary_size));
+                        for (char chr: {'a', 'b'}) {
+                            out.put(chr);
+                            out.write((char *)&frequency, sizeof(frequency));
+                        }
+                        out.put(0);
+                    }
+                    REQUIRE_EQ(read_file(header_file).substr(0, 3), "HUF");
+                    HuffmanArchiver archiver(header_file, unzip_normal_file);
+                    CHECK_EQ(archiver.extract_header(), FormatVersion::legacy);
+                    CHECK_EQ(archiver._out_file_size, size);
+                    CHECK_EQ(archiver._in.tellg(), 4);
+                }
+            }
+
+            SUBCASE("extract_code_lengths") {
+                std::array<uint8_t, UCHAR_MAX + 1> expected_normal_lengths{};
+                for (unsigned char chr = 'a'; chr <= 'f'; ++chr) {
+                    expected_normal_lengths[chr] = chr == 'e' || chr == 'f' ? 2 : 3;
+                }
+                std::array<uint8_t, UCHAR_MAX + 1> expected_one_letter_lengths{};
+                expected_one_letter_lengths['a'] = 1;
+                std::array<uint8_t, UCHAR_MAX + 1> big_lengths{};
+                HuffmanArchiver canonical_normal_archiver(path("canonical normal.txt"), unzip_normal_file);
+                HuffmanArchiver canonical_one_letter_archiver(path("canonical one letter.txt"), unzip_one_letter_file);
+                canonical_normal_archiver.extract_header();
+                canonical_one_letter_archiver.extract_header();
+                big_archiver.extract_header();
+
+                CHECK_EQ(canonical_normal_archiver.extract_code_lengths(), expected_normal_lengths);
+                CHECK_EQ(canonical_one_letter_archiver.extract_code_lengths(), expected_one_letter_lengths);
+                CHECK_NOTHROW(big_lengths = big_archiver.extract_code_lengths());
+                CHECK_EQ(big_archiver._in.tellg(), 4 + 8 + pack_code_lengths(big_lengths).size());
+                for (auto length: big_lengths) {
+                    CHECK(length <= HuffTree::MAX_CANONICAL_CODE_LENGTH);
+                }
+            }
+
+            SUBCASE("legacy unzip") {
+                std::vector<std::tuple<std::string, std::string, std::string>> files = {
+                        {empty_file, path("legacy empty.txt"), unzip_empty_file},
+                        {normal_file, path("legacy normal.txt"), unzip_normal_file},
+                        {one_letter_file, path("legacy one letter.txt"), unzip_one_letter_file},
+                        {spaces_file, path("legacy spaces.txt"), unzip_spaces_file},
+                        {normal_file, path("canonical normal.txt"), unzip_normal_file},
+                        {one_letter_file, path("canonical one letter.txt"), unzip_one_letter_file},
+                        {spaces_file, path("canonical spaces.txt"), unzip_spaces_file}};
+                for (auto &[file, legacy_file, unzip_file]: files) {
+                    {
+                        HuffmanArchiver archiver(legacy_file, unzip_file);
+                        CHECK_NOTHROW(archiver.unzip());
+                        CHECK_EQ(archiver._extra_data_size + archiver._in_file_size, file_size(legacy_file));
+                    }
+                    CHECK(compare_files(file, unzip_file));
+                }
+
+                std::string text = read_file(big_file);
+                text = (text + text).substr(0, 0x465548);
+                std::string collision_file = output_path("legacy collision.txt");
+                std::string zip_collision_file = output_path("zip legacy collision.txt");
+                std::string unzip_collision_file = output_path("unzip legacy collision.txt");
+                std::ofstream(collision_file, std::ios_base::binary) << text;
+                {
+                    HuffmanArchiver archiver(collision_file, zip_collision_file);
+                    std::array<uint64_t, UCHAR_MAX + 1> vocabulary = archiver.build_vocabulary();
+                    uint32_t size = text.size();
+                    uint32_t vocabulary_size = 256 - std::count(vocabulary.begin(), vocabulary.end(), 0);
+                    archiver._out.write((char *)&size, sizeof(size));
+                    archiver._out.write((char *)&vocabulary_size, sizeof(vocabulary_size));
+                    for (std::size_t chr = 0; chr <= UCHAR_MAX; ++chr) {
+                        if (vocabulary[chr]) {
+                            uint32_t frequency = vocabulary[chr];
+                            archiver._out.put(char(chr));
+                            archiver._out.write((char *)&frequency, sizeof(frequency));
+                        }
+                    }
+                    HuffTree tree(vocabulary);
+                    archiver.encode(tree);
+                }
+                REQUIRE_EQ(read_file(zip_collision_file).substr(0, 4), std::string("HUF\0", 4));
+                {
+                    HuffmanArchiver archiver(zip_collision_file, unzip_collision_file);
+                    CHECK_NOTHROW(archiver.unzip());
+                    CHECK_EQ(archiver._out_file_size, text.size());
+                }
+                CHECK(compare_files(collision_file, unzip_collision_file));
+            }
+
             SUBCASE("fill_buffer") {
-                normal_archiver._in = std::ifstream(normal_file, std::ios_base::binary);
+                normal_archiver._in_file = std::ifstream(normal_file, std::ios_base::binary);
                 normal_archiver._in.exceptions(std::ios_base::badbit | std::ios_base::failbit);
-                empty_archiver._in = std::ifstream(empty_file, std::ios_base::binary);
+                empty_archiver._in_file = std::ifstream(empty_file, std::ios_base::binary);
                 empty_archiver._in.exceptions(std::ios_base::badbit | std::ios_base::failbit);
                 std::queue<bool> buffer;
 
@@ -543,50 +1719,75 @@ class huffman_algo::HuffmanArchiver::TestHuffmanArchiver {
             }
 
             SUBCASE("decode") {
-                uint32_t tmp;
-                empty_archiver._in.read((char *)&empty_archiver._out_file_size,
-                                        sizeof(empty_archiver._out_file_size));
-                normal_archiver._in.read((char *)&normal_archiver._out_file_size,
-                                         sizeof(normal_archiver._out_file_size));
-                one_letter_archiver._in.read((char *)&one_letter_archiver._out_file_size,
-                                             sizeof(one_letter_archiver._out_file_size));
-                spaces_archiver._in.read((char *)&spaces_archiver._out_file_size,
-                                         sizeof(spaces_archiver._out_file_size));
-                big_archiver._in.read((char *)&big_archiver._out_file_size,
-                                      sizeof(big_archiver._out_file_size));
-                worst_archiver._in.read((char *)&worst_archiver._out_file_size,
-                                        sizeof(worst_archiver._out_file_size));
-                REQUIRE_EQ(empty_archiver._out_file_size, 0);
-                REQUIRE_EQ(normal_archiver._out_file_size, 6);
-                REQUIRE_EQ(one_letter_archiver._out_file_size, 100);
+                std::unique_ptr<HuffTree> spaces_tree = spaces_archiver.extract_tree(spaces_archiver.extract_header());
+                std::unique_ptr<HuffTree> big_tree = big_archiver.extract_tree(big_archiver.extract_header());
                 REQUIRE_EQ(spaces_archiver._out_file_size, 25);
                 REQUIRE(big_archiver._out_file_size > 3000000);
-                REQUIRE_EQ(worst_archiver._out_file_size, 5000000);
-                std::array<uint32_t, UCHAR_MAX + 1> empty_vocabulary = empty_archiver.extract_vocabulary();
-                std::array<uint32_t, UCHAR_MAX + 1> normal_vocabulary = normal_archiver.extract_vocabulary();
-                std::array<uint32_t, UCHAR_MAX + 1> one_letter_vocabulary = one_letter_archiver.extract_vocabulary();
-                std::array<uint32_t, UCHAR_MAX + 1> spaces_vocabulary = spaces_archiver.extract_vocabulary();
-                std::array<uint32_t, UCHAR_MAX + 1> big_vocabulary = big_archiver.extract_vocabulary();
-                std::array<uint32_t, UCHAR_MAX + 1> worst_vocabulary = worst_archiver.extract_vocabulary();
-                HuffTree empty_tree(empty_vocabulary);
-                HuffTree normal_tree(normal_vocabulary);
-                HuffTree one_letter_tree(one_letter_vocabulary);
-                HuffTree spaces_tree(spaces_vocabulary);
-                HuffTree big_tree(big_vocabulary);
-                HuffTree worst_tree(worst_vocabulary);
 
-                CHECK_NOTHROW(empty_archiver.decode(empty_tree));
-                CHECK_NOTHROW(normal_archiver.decode(normal_tree));
-                CHECK_NOTHROW(one_letter_archiver.decode(one_letter_tree));
-                CHECK_NOTHROW(spaces_archiver.decode(spaces_tree));
-                CHECK_NOTHROW(big_archiver.decode(big_tree));
-                CHECK_NOTHROW(worst_archiver.decode(worst_tree));
-                CHECK_EQ(empty_archiver._out.tellp(), 0);
-                CHECK_EQ(normal_archiver._out.tellp(), 6);
-                CHECK_EQ(one_letter_archiver._out.tellp(), 100);
+                CHECK_NOTHROW(spaces_archiver.decode(*spaces_tree));
+                CHECK_NOTHROW(big_archiver.decode(*big_tree));
                 CHECK_EQ(spaces_archiver._out.tellp(), 25);
                 CHECK(big_archiver._out.tellp() > 3000000);
-                CHECK_EQ(worst_archiver._out.tellp(), 5000000);
+            }
+
+            SUBCASE("extract_run") {
+                REQUIRE_EQ(one_letter_archiver.extract_header(), FormatVersion::run);
+                REQUIRE_EQ(one_letter_archiver._out_file_size, 100);
+
+                CHECK_NOTHROW(one_letter_archiver.extract_run());
+                one_letter_archiver._out.flush();
+                CHECK_EQ(one_letter_archiver._out.tellp(), 100);
+                CHECK_EQ(one_letter_archiver._in.tellg(), file_size(zip_one_letter_file));
+                CHECK(compare_files(one_letter_file, unzip_one_letter_file));
+                CHECK_THROWS(one_letter_archiver.extract_run());
+            }
+
+            SUBCASE("extract_stored") {
+                for (bool mapped: {false, true}) {
+                    for (auto &[archiver, file, zip_file, unzip_file]: {
+                            std::tuple(&empty_archiver, empty_file, zip_empty_file, unzip_empty_file),
+                            std::tuple(&normal_archiver, normal_file, zip_normal_file, unzip_normal_file),
+                            std::tuple(&worst_archiver, worst_file, zip_worst_file, unzip_worst_file)}) {
+                        archiver->_in_map = std::make_unique<MappedFile>(mapped ? zip_file : default_file);
+                        archiver->_in.seekg(0);
+                        archiver->_out.seekp(0);
+                        REQUIRE_EQ(archiver->extract_header(), FormatVersion::stored);
+
+                        CHECK_NOTHROW(archiver->extract_stored());
+                        archiver->_out.flush();
+                        CHECK_EQ(archiver->_out.tellp(), archiver->_out_file_size);
+                        CHECK_EQ(archiver->_in.tellg(), file_size(zip_file));
+                        CHECK(compare_files(file, unzip_file));
+                    }
+                }
+                normal_archiver._in.seekg(0);
+                normal_archiver._in_map = std::make_unique<MappedFile>(default_file);
+                normal_archiver.extract_header();
+                normal_archiver._out_file_size = 7;
+                CHECK_THROWS_AS(normal_archiver.extract_stored(), std::logic_error);
+            }
+
+            SUBCASE("decode modes") {
+                std::vector<std::tuple<HuffmanArchiver *, std::string, std::string, std::string>> archivers = {
+                        {&spaces_archiver, spaces_file, zip_spaces_file, unzip_spaces_file},
+                        {&big_archiver, big_file, zip_big_file, unzip_big_file}};
+                for (auto [mode, mapped]: {std::pair(DecodeMode::tree_walk, false),
+                                           std::pair(DecodeMode::table, false), std::pair(DecodeMode::table, true),
+                                           std::pair(DecodeMode::multi_table, false),
+                                           std::pair(DecodeMode::multi_table, true)}) {
+                    for (auto &[archiver, file, zip_file, unzip_file]: archivers) {
+                        archiver->_in_map = std::make_unique<MappedFile>(mapped ? zip_file : default_file);
+                        archiver->_in.seekg(0);
+                        archiver->_out.seekp(0);
+                        std::unique_ptr<HuffTree> tree = archiver->extract_tree(archiver->extract_header());
+
+                        CHECK_NOTHROW(archiver->decode(*tree, mode));
+                        archiver->_out.flush();
+                        CHECK_EQ(archiver->_out.tellp(), archiver->_out_file_size);
+                        CHECK_EQ(archiver->_in.tellg(), file_size(zip_file));
+                        CHECK(compare_files(file, unzip_file));
+                    }
+                }
             }
 
             SUBCASE("unzip") {
@@ -597,8 +1798,8 @@ class huffman_algo::HuffmanArchiver::TestHuffmanArchiver {
                 CHECK_NOTHROW(big_archiver.unzip());
                 CHECK_NOTHROW(worst_archiver.unzip());
                 CHECK_EQ(empty_archiver._in_file_size, 0);
-                CHECK_EQ(normal_archiver._in_file_size, 2);
-                CHECK_EQ(one_letter_archiver._in_file_size, 13);
+                CHECK_EQ(normal_archiver._in_file_size, 6);
+                CHECK_EQ(one_letter_archiver._in_file_size, 0);
                 CHECK_EQ(spaces_archiver._in_file_size, 5);
                 CHECK(big_archiver._in_file_size < 2000000);
                 CHECK_EQ(worst_archiver._in_file_size, 5000000);
@@ -656,6 +1857,524 @@ class huffman_algo::HuffmanArchiver::TestHuffmanArchiver {
             CHECK(compare_files(big_file, unzip_big_file));
             CHECK(compare_files(worst_file, unzip_worst_file));
         }
+
+        SUBCASE("zip and unzip blocks") {
+            std::vector<std::tuple<std::string, std::string, std::string>> files = {
+                    {empty_file, zip_empty_file, unzip_empty_file},
+                    {normal_file, zip_normal_file, unzip_normal_file},
+                    {one_letter_file, zip_one_letter_file, unzip_one_letter_file},
+                    {spaces_file, zip_spaces_file, unzip_spaces_file},
+                    {big_file, zip_big_file, unzip_big_file},
+                    {worst_file, zip_worst_file, unzip_worst_file}};
+            for (auto &[file, zip_file, unzip_file]: files) {
+                std::string expected_zip;
+                for (auto [block_size, thread_count, mapped, interleaved, context, context_tables]: {
+                        std::tuple(MIN_BLOCK_SIZE, 1u, true, false, false, 0u),
+                        std::tuple(MIN_BLOCK_SIZE, 3u, false, false, false, 0u),
+                        std::tuple(DEFAULT_BLOCK_SIZE, 2u, true, false, false, 0u),
+                        std::tuple(MIN_BLOCK_SIZE, 2u, true, true, false, 0u),
+                        std::tuple(DEFAULT_BLOCK_SIZE, 1u, false, true, false, 0u),
+                        std::tuple(MIN_BLOCK_SIZE, 2u, false, false, true, 0u),
+                        std::tuple(DEFAULT_BLOCK_SIZE, 1u, true, true, true, 0u),
+                        std::tuple(DEFAULT_BLOCK_SIZE, 3u, true, false, true, MIN_CONTEXT_TABLES),
+                        std::tuple(DEFAULT_BLOCK_SIZE, 2u, false, false, true, MAX_CONTEXT_TABLES)}) {
+                    HuffmanArchiver zip_archiver(file, zip_file);
+                    zip_archiver.set_block_size(block_size);
+                    zip_archiver.set_thread_count(thread_count);
+                    zip_archiver.set_interleaved(interleaved);
+                    zip_archiver.set_context_model(context);
+                    zip_archiver.set_context_tables(context_tables);
+                    if (!mapped) {
+                        zip_archiver._in_map = std::make_unique<MappedFile>(default_file);
+                    }
+                    REQUIRE_NOTHROW(zip_archiver.zip());
+                    zip_archiver._out_file.close();
+                    HuffmanArchiver unzip_archiver(zip_file, unzip_file);
+                    if (!mapped) {
+                        unzip_archiver._in_map = std::make_unique<MappedFile>(default_file);
+                    }
+                    REQUIRE_NOTHROW(unzip_archiver.unzip());
+                    unzip_archiver._out_file.close();
+
+                    CHECK_EQ(zip_archiver._in_file_size, file_size(file));
+                    CHECK_EQ(zip_archiver._out_file_size + zip_archiver._extra_data_size, file_size(zip_file));
+                    CHECK_EQ(unzip_archiver._out_file_size, zip_archiver._in_file_size);
+                    CHECK_EQ(unzip_archiver._in_file_size, zip_archiver._out_file_size);
+                    CHECK_EQ(unzip_archiver._extra_data_size, zip_archiver._extra_data_size);
+                    CHECK(compare_files(file, unzip_file));
+                    if (block_size == MIN_BLOCK_SIZE && !interleaved && !context && expected_zip.empty()) {
+                        expected_zip = read_file(zip_file);
+                    } else if (block_size == MIN_BLOCK_SIZE && !interleaved && !context) {
+                        CHECK(read_file(zip_file) == expected_zip);
+                    }
+                }
+            }
+
+            HuffmanArchiver zip_archiver(big_file, zip_big_file);
+            zip_archiver.set_block_size(MIN_BLOCK_SIZE);
+            zip_archiver.zip();
+            zip_archiver._out_file.close();
+            std::string archive = read_file(zip_big_file);
+            for (std::size_t size: {std::size_t(15), std::size_t(20), archive.size() / 2, archive.size() - 1}) {
+                std::ofstream(zip_big_file, std::ios_base::binary).write(archive.data(), std::streamsize(size));
+                for (bool mapped: {true, false}) {
+                    HuffmanArchiver unzip_archiver(zip_big_file, unzip_big_file);
+                    if (!mapped) {
+                        unzip_archiver._in_map = std::make_unique<MappedFile>(default_file);
+                    }
+                    CHECK_THROWS(unzip_archiver.unzip());
+                }
+            }
+        }
+
+        SUBCASE("zip and unzip tokens") {
+            std::vector<std::tuple<std::string, std::string, std::string>> files = {
+                    {empty_file, zip_empty_file, unzip_empty_file},
+                    {normal_file, zip_normal_file, unzip_normal_file},
+                    {one_letter_file, zip_one_letter_file, unzip_one_letter_file},
+                    {spaces_file, zip_spaces_file, unzip_spaces_file},
+                    {big_file, zip_big_file, unzip_big_file},
+                    {worst_file, zip_worst_file, unzip_worst_file}};
+            for (auto &[file, zip_file, unzip_file]: files) {
+                HuffmanArchiver zip_archiver(file, zip_file);
+                zip_archiver.set_token_model(true);
+                HuffmanArchiver estimate_archiver(file);
+                estimate_archiver.set_token_model(true);
+                REQUIRE_NOTHROW(zip_archiver.zip());
+                zip_archiver._out_file.close();
+
+                CHECK_EQ(zip_archiver._out_file_size + zip_archiver._extra_data_size, file_size(zip_file));
+                CHECK_NOTHROW(estimate_archiver.estimate());
+                CHECK_EQ(estimate_archiver.get_out_file_size(), zip_archiver.get_out_file_size());
+                CHECK_EQ(estimate_archiver.get_extra_data_size(), zip_archiver.get_extra_data_size());
+                CHECK_EQ(estimate_archiver.get_length_limit_overhead(), zip_archiver.get_length_limit_overhead());
+                for (bool mapped: {true, false}) {
+                    HuffmanArchiver unzip_archiver(zip_file, unzip_file);
+                    if (!mapped) {
+                        unzip_archiver._in_map = std::make_unique<MappedFile>(default_file);
+                    }
+                    REQUIRE_NOTHROW(unzip_archiver.unzip());
+                    unzip_archiver._out_file.close();
+
+                    CHECK(compare_files(file, unzip_file));
+                    CHECK_EQ(unzip_archiver._in_file_size, zip_archiver._out_file_size);
+                    CHECK_EQ(unzip_archiver._extra_data_size, zip_archiver._extra_data_size);
+                }
+            }
+
+            std::string byte_zip = read_file(zip_worst_file);
+            HuffmanArchiver plain_archiver(big_file, zip_big_file);
+            plain_archiver.zip();
+            plain_archiver._out_file.close();
+            uint64_t plain_size = file_size(zip_big_file);
+            HuffmanArchiver token_archiver(big_file, zip_big_file);
+            token_archiver.set_token_model(true);
+            token_archiver.zip();
+            token_archiver._out_file.close();
+            std::string archive = read_file(zip_big_file);
+            CHECK_EQ(FormatVersion(archive[sizeof(SIGNATURE)]), FormatVersion::tokens);
+            CHECK_LT(archive.size(), plain_size * 3 / 5);
+            CHECK_GT(token_archiver.get_stats().max_code_length, HuffTree::MAX_CANONICAL_CODE_LENGTH);
+            CHECK_NE(FormatVersion(byte_zip[sizeof(SIGNATURE)]), FormatVersion::tokens);
+
+            std::span<const std::byte> compressed((const std::byte *)archive.data(), archive.size());
+            std::vector<std::byte> decompressed = decompress(compressed);
+            CHECK(std::string((const char *)decompressed.data(), decompressed.size()) == read_file(big_file));
+            CHECK_THROWS_AS(static_cast<void>(decompress(compressed.first(archive.size() - 1))), std::logic_error);
+
+            HuffmanArchiver limited_unzip_archiver(zip_big_file, unzip_big_file);
+            limited_unzip_archiver.set_memory_limit(file_size(big_file) - 1);
+            CHECK_THROWS_AS(limited_unzip_archiver.unzip(), std::length_error);
+            HuffmanArchiver limited_zip_archiver(big_file, zip_big_file);
+            limited_zip_archiver.set_token_model(true);
+            limited_zip_archiver.set_memory_limit(file_size(big_file) - 1);
+            CHECK_NOTHROW(limited_zip_archiver.zip());
+            limited_zip_archiver._out_file.close();
+            std::string limited_archive = read_file(zip_big_file);
+            CHECK_NE(FormatVersion(limited_archive[sizeof(SIGNATURE)]), FormatVersion::tokens);
+            CHECK_EQ(limited_archive.size(), plain_size);
+
+            archive[sizeof(SIGNATURE) + sizeof(FormatVersion) + sizeof(uint64_t)] ^= 1;
+            CHECK_THROWS_AS(static_cast<void>(decompress(std::span<const std::byte>((const std::byte *)archive.data(),
+                                                                                    archive.size()))),
+                            std::logic_error);
+        }
+
+        SUBCASE("compress and decompress") {
+            for (auto &[file, zip_file]: {std::pair(empty_file, zip_empty_file), std::pair(normal_file, zip_normal_file),
+                                          std::pair(one_letter_file, zip_one_letter_file),
+                                          std::pair(spaces_file, zip_spaces_file), std::pair(big_file, zip_big_file)}) {
+                std::string text = read_file(file);
+                std::span<const std::byte> data((const std::byte *)text.data(), text.size());
+                HuffmanArchiver archiver(file, zip_file);
+                archiver.zip();
+                archiver._out_file.close();
+                std::vector<std::byte> compressed;
+
+                REQUIRE_NOTHROW(compressed = compress(data));
+                CHECK(compressed.size() <= compress_bound(text.size()));
+                CHECK(std::string((const char *)compressed.data(), compressed.size()) == read_file(zip_file));
+                CHECK_EQ(decompressed_size(compressed), text.size());
+                std::vector<std::byte> decompressed = decompress(compressed);
+                CHECK(std::string((const char *)decompressed.data(), decompressed.size()) == text);
+
+                std::vector<std::byte> out(compress_bound(text.size()));
+                CHECK_EQ(compress(data, out), compressed.size());
+                CHECK(std::equal(compressed.begin(), compressed.end(), out.begin()));
+                std::vector<std::byte> decoded(text.size() + 1, std::byte{'?'});
+                CHECK_EQ(decompress(compressed, decoded), text.size());
+                CHECK(std::string((const char *)decoded.data(), text.size()) == text);
+                CHECK_EQ(decoded.back(), std::byte{'?'});
+
+                CHECK_THROWS_AS(static_cast<void>(compress(data, std::span<std::byte>(out.data(),
+                                                                                      compressed.size() - 1))),
+                                std::length_error);
+                if (!text.empty()) {
+                    CHECK_THROWS_AS(static_cast<void>(decompress(compressed, std::span<std::byte>(decoded.data(),
+                                                                                                  text.size() - 1))),
+                                    std::length_error);
+                    CHECK_THROWS_AS(static_cast<void>(decompress(std::span<const std::byte>(compressed.data(),
+                                                                                            compressed.size() - 1))),
+                                    std::logic_error);
+                }
+            }
+
+            std::vector<std::byte> empty_stored = compress(std::span<const std::byte>());
+            REQUIRE_EQ(empty_stored.size(), compress_bound(0));
+            CHECK_EQ(FormatVersion(empty_stored[3]), FormatVersion::stored);
+            CHECK_EQ(decompress(empty_stored, std::span<std::byte>()), 0);
+            CHECK(decompress(empty_stored).empty());
+
+            std::string random = read_file(worst_file);
+            std::vector<std::byte> stored = compress(std::span<const std::byte>((const std::byte *)random.data(),
+                                                                                random.size()));
+            CHECK_EQ(stored.size(), compress_bound(random.size()));
+            CHECK_EQ(FormatVersion(stored[3]), FormatVersion::stored);
+            std::vector<std::byte> restored = decompress(stored);
+            CHECK(std::string((const char *)restored.data(), restored.size()) == random);
+
+            std::string canonical = read_file(path("canonical normal.txt"));
+            std::vector<std::byte> decompressed = decompress(
+                    std::span<const std::byte>((const std::byte *)canonical.data(), canonical.size()));
+            CHECK(std::string((const char *)decompressed.data(), decompressed.size()) == "abcdef");
+            std::string legacy = read_file(path("legacy normal.txt"));
+            CHECK_THROWS_AS(static_cast<void>(decompress(std::span<const std::byte>((const std::byte *)legacy.data(),
+                                                                                    legacy.size()))),
+                            std::logic_error);
+            CHECK_THROWS_AS(static_cast<void>(decompressed_size(std::span<const std::byte>())), std::logic_error);
+        }
+
+        SUBCASE("estimate") {
+            for (auto &[file, zip_file]: {std::pair(empty_file, zip_empty_file), std::pair(normal_file, zip_normal_file),
+                                          std::pair(one_letter_file, zip_one_letter_file),
+                                          std::pair(spaces_file, zip_spaces_file), std::pair(big_file, zip_big_file),
+                                          std::pair(worst_file, zip_worst_file)}) {
+                for (auto [block_size, mapped, interleaved, context, context_tables, max_code_length]: {
+                        std::tuple(std::size_t(0), true, false, false, 0u, 15u),
+                        std::tuple(std::size_t(0), false, false, false, 0u, 11u),
+                        std::tuple(MIN_BLOCK_SIZE, true, false, false, 0u, 15u),
+                        std::tuple(MIN_BLOCK_SIZE, false, true, false, 0u, 11u),
+                        std::tuple(DEFAULT_BLOCK_SIZE, true, true, false, 0u, 15u),
+                        std::tuple(std::size_t(0), false, false, true, 0u, 11u),
+                        std::tuple(DEFAULT_BLOCK_SIZE, true, false, true, 0u, 15u),
+                        std::tuple(DEFAULT_BLOCK_SIZE, false, false, true, MIN_CONTEXT_TABLES, 11u)}) {
+                    HuffmanArchiver zip_archiver(file, zip_file);
+                    HuffmanArchiver estimate_archiver(file);
+                    for (HuffmanArchiver *archiver: {&zip_archiver, &estimate_archiver}) {
+                        archiver->set_block_size(block_size);
+                        archiver->set_interleaved(interleaved);
+                        archiver->set_context_model(context);
+                        archiver->set_context_tables(context_tables);
+                        archiver->set_max_code_length(max_code_length);
+                        if (!mapped) {
+                            archiver->_in_map = std::make_unique<MappedFile>(default_file);
+                        }
+                    }
+                    REQUIRE_NOTHROW(zip_archiver.zip());
+                    zip_archiver._out_file.close();
+
+                    CHECK_NOTHROW(estimate_archiver.estimate());
+                    CHECK_EQ(estimate_archiver.get_in_file_size(), zip_archiver.get_in_file_size());
+                    CHECK_EQ(estimate_archiver.get_out_file_size(), zip_archiver.get_out_file_size());
+                    CHECK_EQ(estimate_archiver.get_extra_data_size(), zip_archiver.get_extra_data_size());
+                    CHECK_EQ(estimate_archiver.get_length_limit_overhead(), zip_archiver.get_length_limit_overhead());
+                    CHECK_EQ(estimate_archiver.get_out_file_size() + estimate_archiver.get_extra_data_size(),
+                             file_size(zip_file));
+                }
+            }
+
+            std::string text = read_file(big_file);
+            std::stringstream in(text);
+            std::stringstream out;
+            std::streambuf *cin_buffer = std::cin.rdbuf(in.rdbuf());
+            std::streambuf *cout_buffer = std::cout.rdbuf(out.rdbuf());
+            {
+                HuffmanArchiver zip_archiver(STANDARD_STREAM, STANDARD_STREAM);
+                zip_archiver.set_block_size(MIN_BLOCK_SIZE);
+                CHECK_NOTHROW(zip_archiver.zip());
+                in.clear();
+                in.seekg(0);
+                HuffmanArchiver estimate_archiver(STANDARD_STREAM);
+                estimate_archiver.set_block_size(MIN_BLOCK_SIZE);
+                CHECK_NOTHROW(estimate_archiver.estimate());
+                CHECK_EQ(estimate_archiver.get_in_file_size(), text.size());
+                CHECK_EQ(estimate_archiver.get_out_file_size(), zip_archiver.get_out_file_size());
+                CHECK_EQ(estimate_archiver.get_extra_data_size(), zip_archiver.get_extra_data_size());
+                CHECK_EQ(estimate_archiver.get_out_file_size() + estimate_archiver.get_extra_data_size(),
+                         out.str().size());
+            }
+            std::cin.rdbuf(cin_buffer);
+            std::cout.rdbuf(cout_buffer);
+        }
+
+        SUBCASE("zip and unzip stream") {
+            std::vector<std::tuple<std::string, std::string, std::string>> files = {
+                    {empty_file, zip_empty_file, unzip_empty_file},
+                    {normal_file, zip_normal_file, unzip_normal_file},
+                    {spaces_file, zip_spaces_file, unzip_spaces_file},
+                    {big_file, zip_big_file, unzip_big_file}};
+            for (auto &[file, zip_file, unzip_file]: files) {
+                for (auto [stream_input, context, context_tables]: {
+                        std::tuple(false, false, 0u), std::tuple(true, false, 0u), std::tuple(false, true, 0u),
+                        std::tuple(true, true, 0u), std::tuple(false, true, MIN_CONTEXT_TABLES)}) {
+                    std::stringstream input(read_file(file));
+                    std::stringstream archive;
+                    HuffmanArchiver zip_archiver(file, zip_file);
+                    zip_archiver.set_block_size(MIN_BLOCK_SIZE);
+                    zip_archiver.set_thread_count(2);
+                    zip_archiver.set_interleaved(stream_input);
+                    zip_archiver.set_context_model(context);
+                    zip_archiver.set_context_tables(context_tables);
+                    if (stream_input) {
+                        zip_archiver._in_file.close();
+                        zip_archiver._in.rdbuf(input.rdbuf());
+                        zip_archiver._in_map = std::make_unique<MappedFile>(default_file);
+                    } else {
+                        zip_archiver._out_file.close();
+                        zip_archiver._out.rdbuf(archive.rdbuf());
+                    }
+                    REQUIRE(zip_archiver.is_streaming());
+                    REQUIRE_NOTHROW(zip_archiver.zip());
+                    zip_archiver._out.flush();
+                    if (stream_input) {
+                        zip_archiver._out_file.close();
+                        archive.str(read_file(zip_file));
+                    }
+                    std::string compressed = archive.str();
+                    REQUIRE(compressed.size() >= 4);
+                    CHECK_EQ(compressed.substr(0, 3), "HUF");
+                    CHECK_EQ(FormatVersion(compressed[3]), FormatVersion::stream);
+                    CHECK_EQ(zip_archiver._in_file_size, file_size(file));
+                    CHECK_EQ(zip_archiver._out_file_size + zip_archiver._extra_data_size, compressed.size());
+
+                    std::stringstream output;
+                    HuffmanArchiver unzip_archiver(zip_file, unzip_file);
+                    unzip_archiver._in_file.close();
+                    unzip_archiver._in.rdbuf(archive.rdbuf());
+                    unzip_archiver._out_file.close();
+                    unzip_archiver._out.rdbuf(output.rdbuf());
+                    unzip_archiver._in_map = std::make_unique<MappedFile>(default_file);
+                    REQUIRE_NOTHROW(unzip_archiver.unzip());
+                    CHECK(output.str() == read_file(file));
+                    CHECK_EQ(unzip_archiver._out_file_size, zip_archiver._in_file_size);
+                    CHECK_EQ(unzip_archiver._in_file_size, zip_archiver._out_file_size);
+                    CHECK_EQ(unzip_archiver._extra_data_size, zip_archiver._extra_data_size);
+                }
+            }
+
+            HuffmanArchiver blocks_archiver(big_file, zip_big_file);
+            blocks_archiver.set_block_size(MIN_BLOCK_SIZE);
+            blocks_archiver.zip();
+            blocks_archiver._out_file.close();
+            HuffmanArchiver single_archiver(normal_file, zip_normal_file);
+            single_archiver.zip();
+            single_archiver._out_file.close();
+            for (auto [zip_file, valid]: {std::pair(zip_big_file, true), std::pair(zip_normal_file, false)}) {
+                std::stringstream archive(read_file(zip_file));
+                std::stringstream output;
+                HuffmanArchiver unzip_archiver(zip_file, unzip_big_file);
+                unzip_archiver._in_file.close();
+                unzip_archiver._in.rdbuf(archive.rdbuf());
+                unzip_archiver._out_file.close();
+                unzip_archiver._out.rdbuf(output.rdbuf());
+                if (valid) {
+                    CHECK_NOTHROW(unzip_archiver.unzip());
+                    CHECK(output.str() == read_file(big_file));
+                } else {
+                    CHECK_THROWS_AS(unzip_archiver.unzip(), std::logic_error);
+                }
+            }
+
+            std::stringstream archive;
+            HuffmanArchiver zip_archiver(spaces_file, zip_spaces_file);
+            zip_archiver._out_file.close();
+            zip_archiver._out.rdbuf(archive.rdbuf());
+            zip_archiver.zip();
+            std::string compressed = archive.str();
+            for (std::size_t size: {std::size_t(5), std::size_t(10), compressed.size() - 1}) {
+                std::stringstream truncated(compressed.substr(0, size));
+                HuffmanArchiver unzip_archiver(zip_spaces_file, unzip_spaces_file);
+                unzip_archiver._in_file.close();
+                unzip_archiver._in.rdbuf(truncated.rdbuf());
+                CHECK_THROWS(unzip_archiver.unzip());
+            }
+            compressed[compressed.size() - sizeof(uint64_t)] ^= 1;
+            std::stringstream corrupted(compressed);
+            HuffmanArchiver unzip_archiver(zip_spaces_file, unzip_spaces_file);
+            unzip_archiver._in_file.close();
+            unzip_archiver._in.rdbuf(corrupted.rdbuf());
+            CHECK_THROWS_AS(unzip_archiver.unzip(), std::logic_error);
+        }
+
+        SUBCASE("zip and unzip pipe") {
+            std::string pipe_file = output_path("pipe");
+            std::remove(pipe_file.c_str());
+            REQUIRE_EQ(mkfifo(pipe_file.c_str(), 0600), 0);
+            std::thread writer([&]() {
+                std::ofstream out(pipe_file, std::ios_base::binary);
+                out << read_file(big_file);
+            });
+            HuffmanArchiver zip_archiver(pipe_file, zip_big_file);
+            CHECK(zip_archiver.is_streaming());
+            CHECK_NOTHROW(zip_archiver.zip());
+            zip_archiver._out_file.close();
+            writer.join();
+            std::remove(pipe_file.c_str());
+            std::string compressed = read_file(zip_big_file);
+            REQUIRE(compressed.size() >= 4);
+            CHECK_EQ(FormatVersion(compressed[3]), FormatVersion::stream);
+            CHECK_EQ(zip_archiver._in_file_size, file_size(big_file));
+            CHECK_EQ(zip_archiver._out_file_size + zip_archiver._extra_data_size, compressed.size());
+
+            HuffmanArchiver unzip_archiver(zip_big_file, unzip_big_file);
+            CHECK_NOTHROW(unzip_archiver.unzip());
+            unzip_archiver._out_file.close();
+            CHECK(compare_files(big_file, unzip_big_file));
+
+            HuffmanArchiver blocks_archiver(big_file, zip_big_file);
+            blocks_archiver.set_block_size(MIN_BLOCK_SIZE);
+            blocks_archiver.zip();
+            blocks_archiver._out_file.close();
+            REQUIRE_EQ(mkfifo(pipe_file.c_str(), 0600), 0);
+            std::string output;
+            std::thread reader([&]() {
+                output = read_file(pipe_file);
+            });
+            HuffmanArchiver pipe_archiver(zip_big_file, pipe_file);
+            CHECK_NOTHROW(pipe_archiver.unzip());
+            pipe_archiver._out_file.close();
+            reader.join();
+            std::remove(pipe_file.c_str());
+            CHECK(output == read_file(big_file));
+        }
+
+        SUBCASE("extract_block_index") {
+            HuffmanArchiver zip_archiver(big_file, zip_big_file);
+            zip_archiver.set_block_size(DEFAULT_BLOCK_SIZE);
+            zip_archiver.zip();
+            zip_archiver._out_file.close();
+            std::string archive = read_file(zip_big_file);
+            std::string text = read_file(big_file);
+            uint64_t block_count = (text.size() + DEFAULT_BLOCK_SIZE - 1) / DEFAULT_BLOCK_SIZE;
+            HuffmanArchiver unzip_archiver(zip_big_file, unzip_big_file);
+            REQUIRE_EQ(unzip_archiver.extract_header(), FormatVersion::blocks);
+            std::streampos start = unzip_archiver._in.tellg();
+            std::vector<BlockEntry> index = unzip_archiver.extract_block_index();
+
+            REQUIRE_EQ(index.size(), block_count + 1);
+            CHECK_EQ(unzip_archiver._in.tellg(), start);
+            CHECK_EQ(index[0].offset, uint64_t(start));
+            for (std::size_t i = 0; i < block_count; ++i) {
+                CHECK(index[i].offset < index[i + 1].offset);
+                CHECK_EQ(index[i].size, std::min<uint64_t>(DEFAULT_BLOCK_SIZE, text.size() - i * DEFAULT_BLOCK_SIZE));
+                std::vector<unsigned char> out(index[i].size);
+                uint32_t payload_size = 0;
+                Stats stats{};
+                CHECK_NOTHROW(payload_size = decode_block_record(
+                        (const unsigned char *)archive.data() + index[i].offset, index[i + 1].offset - index[i].offset,
+                        out.data(), out.size(), stats));
+                CHECK(index[i + 1].offset - index[i].offset > payload_size);
+                CHECK(std::string(out.begin(), out.end()) == text.substr(i * DEFAULT_BLOCK_SIZE, out.size()));
+                CHECK_THROWS_AS(decode_block_record((const unsigned char *)archive.data() + index[i].offset,
+                                                    index[i + 1].offset - index[i].offset - 1, out.data(), out.size(),
+                                                    stats), std::logic_error);
+            }
+            CHECK_EQ(index.back().offset + block_count * 12 + sizeof(uint64_t), archive.size());
+
+            std::string corrupted = archive;
+            corrupted[corrupted.size() - sizeof(uint64_t)] ^= 1;
+            std::ofstream(zip_big_file, std::ios_base::binary).write(corrupted.data(), std::streamsize(corrupted.size()));
+            HuffmanArchiver corrupted_archiver(zip_big_file, unzip_big_file);
+            REQUIRE_EQ(corrupted_archiver.extract_header(), FormatVersion::blocks);
+            CHECK_THROWS_AS(corrupted_archiver.extract_block_index(), std::logic_error);
+        }
+
+        SUBCASE("stats") {
+            uint64_t text_size = file_size(big_file);
+            uint64_t block_count = (text_size + MIN_BLOCK_SIZE - 1) / MIN_BLOCK_SIZE;
+            for (std::size_t block_size: {std::size_t(0), MIN_BLOCK_SIZE}) {
+                HuffmanArchiver zip_archiver(big_file, zip_big_file);
+                zip_archiver.set_block_size(block_size);
+                REQUIRE_NOTHROW(zip_archiver.zip());
+                zip_archiver._out_file.close();
+                HuffmanArchiver unzip_archiver(zip_big_file, unzip_big_file);
+                REQUIRE_NOTHROW(unzip_archiver.unzip());
+                HuffmanArchiver estimate_archiver(big_file);
+                estimate_archiver.set_block_size(block_size);
+                REQUIRE_NOTHROW(estimate_archiver.estimate());
+
+                const Stats &zip_stats = zip_archiver.get_stats();
+                const Stats &unzip_stats = unzip_archiver.get_stats();
+                const Stats &estimate_stats = estimate_archiver.get_stats();
+                uint64_t archive_size = file_size(zip_big_file);
+                CHECK_EQ(zip_stats.bytes_read, text_size);
+                CHECK_EQ(zip_stats.bytes_written, archive_size);
+                CHECK_EQ(unzip_stats.bytes_read, archive_size);
+                CHECK_EQ(unzip_stats.bytes_written, text_size);
+                CHECK_EQ(estimate_stats.bytes_read, text_size);
+                CHECK_EQ(estimate_stats.bytes_written, 0);
+                for (const Stats *stats: {&zip_stats, &unzip_stats, &estimate_stats}) {
+                    CHECK_EQ(stats->block_count, block_size ? block_count : 0);
+                    CHECK(stats->max_code_length > 0);
+                    CHECK(stats->max_code_length <= HuffTree::MAX_CANONICAL_CODE_LENGTH);
+                    CHECK(stats->average_code_length > 0);
+                    CHECK(stats->average_code_length < CHAR_BIT);
+                    for (double seconds: {stats->read_seconds, stats->histogram_seconds, stats->tree_build_seconds,
+                                          stats->code_gen_seconds, stats->encode_seconds, stats->decode_seconds,
+                                          stats->write_seconds, stats->total_seconds}) {
+                        CHECK(seconds >= 0);
+                    }
+                }
+                CHECK_EQ(zip_stats.max_code_length, unzip_stats.max_code_length);
+                CHECK_EQ(zip_stats.average_code_length, doctest::Approx(unzip_stats.average_code_length));
+                CHECK_EQ(zip_stats.average_code_length, doctest::Approx(estimate_stats.average_code_length));
+                CHECK_EQ(unzip_stats.encode_seconds, 0);
+                CHECK_EQ(estimate_stats.decode_seconds, 0);
+            }
+
+            Stats total{};
+            Stats part{};
+            part.read_seconds = 1;
+            part.bytes_read = 2;
+            part.max_code_length = 5;
+            part.block_count = 1;
+            total += part;
+            part.max_code_length = 3;
+            total += part;
+            CHECK_EQ(total.read_seconds, 2);
+            CHECK_EQ(total.bytes_read, 4);
+            CHECK_EQ(total.max_code_length, 5);
+            CHECK_EQ(total.block_count, 2);
+        }
+    }
+
+    static std::string read_file(const std::string &file) {
+        std::ifstream in(file, std::ios_base::binary);
+        return std::string((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    }
+
+    static std::streamoff file_size(const std::string &file) {
+        return std::ifstream(file, std::ios_base::binary | std::ios_base::ate).tellg();
     }
 
     static bool compare_files(const std::string &file1, const std::string &file2) {
@@ -684,14 +2403,14 @@ class huffman_algo::HuffmanArchiver::TestHuffmanArchiver {
 
 TEST_CASE("zip time limit" * doctest::timeout(5)) {
     std::string worst_file = path("worst.txt");
-    std::string zip_worst_file = path("zip worst.txt");
+    std::string zip_worst_file = output_path("zip worst.txt");
     HuffmanArchiver worst_archiver(worst_file, zip_worst_file);
     worst_archiver.zip();
 }
 
 TEST_CASE("unzip time limit" * doctest::timeout(5)) {
-    std::string zip_worst_file = path("zip worst.txt");
-    std::string unzip_worst_file = path("unzip worst.txt");
+    std::string zip_worst_file = output_path("zip worst.txt");
+    std::string unzip_worst_file = output_path("unzip worst.txt");
     HuffmanArchiver worst_archiver(zip_worst_file, unzip_worst_file);
     worst_archiver.unzip();
 }